@@ -52,6 +52,57 @@ extern "C" {
                                   libcbio_open_mode_t mode,
                                   libcbio_t *handle);
 
+    /**
+     * Open a number of database files concurrently on a pool of
+     * threads. Opening a file requires a search for the last valid
+     * header, so opening many files in parallel is significantly
+     * faster than opening them one by one.
+     *
+     * @param names the names of the files to open
+     * @param nfiles the number of elements in names
+     * @param mode how to open the files (see cbio_open_handle())
+     * @param nthreads the number of threads to use (0 for one per cpu)
+     * @param handles where to store the handles. The handle for a file
+     *                that failed to open is set to NULL
+     * @param status where to store the result of opening each file
+     * @return CBIO_SUCCESS if all of the files was opened, or the
+     *                      error code for the first file that failed
+     *                      to open.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_open_handles(const char *const *names,
+                                   size_t nfiles,
+                                   libcbio_open_mode_t mode,
+                                   unsigned int nthreads,
+                                   libcbio_t *handles,
+                                   cbio_error_t *status);
+
+    /**
+     * Open a handle that may be used by multiple threads at the same
+     * time: any number of threads may read documents from the handle
+     * (cbio_get_document(), cbio_get_document_ex(),
+     * cbio_document_get_value() and cbio_changes_since()) while a
+     * single thread stores and commits documents.
+     *
+     * The readers always see the database as of the last commit (a
+     * write isn't visible to the readers, including the writer thread,
+     * until it is committed). The handle keeps up to `nreaders` read
+     * only instances of the database file open for the readers.
+     *
+     * @param name the name of the couchdb file to open
+     * @param mode how to open the file (see cbio_open_handle())
+     * @param nreaders the number of concurrent readers to keep an
+     *                 open file for (0 for one per cpu)
+     * @param handle where to store the result
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_open_shared_handle(const char *name,
+                                         libcbio_open_mode_t mode,
+                                         unsigned int nreaders,
+                                         libcbio_t *handle);
+
     /**
      * cbio_close_handle release all allocated resources for the handle
      * and invalidates it.
@@ -72,6 +123,169 @@ extern "C" {
     LIBCBIO_API
     off_t cbio_get_header_position(libcbio_t handle);
 
+    /**
+     * Open a snapshot of the database as of the last commit done
+     * through the handle. The snapshot is a read only handle which may
+     * be used with all of the read operations (cbio_get_document(),
+     * cbio_changes_since() etc), and it isn't affected by documents
+     * stored and committed through the handle after the snapshot was
+     * taken. The snapshot has its own instance of the file so it may
+     * be used by another thread than the handle.
+     *
+     * @param handle the handle to take the snapshot of
+     * @param snapshot where to store the snapshot
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_snapshot_open(libcbio_t handle, libcbio_t *snapshot);
+
+    /**
+     * Release a snapshot created by cbio_snapshot_open().
+     *
+     * @param snapshot the snapshot to release
+     */
+    LIBCBIO_API
+    void cbio_snapshot_close(libcbio_t snapshot);
+
+    /**
+     * The callback function used by cbio_foreach_header() to iterate
+     * through the headers in the database file.
+     *
+     * @param handle the libcbio handle
+     * @param info information about the header
+     * @param ctx user context
+     * @return 0 to continue with the previous header, non-zero to stop
+     */
+    typedef int (*cbio_header_callback_fn)(libcbio_t handle,
+                                           const cbio_header_info_t *info,
+                                           void *ctx);
+
+    /**
+     * Iterate through the committed headers in the database file,
+     * starting with the newest and moving backwards in the file.
+     *
+     * @param handle the handle to the database
+     * @param callback the callback function called for each header
+     * @param ctx client context (passed to the callback)
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_foreach_header(libcbio_t handle,
+                                     cbio_header_callback_fn callback,
+                                     void *ctx);
+
+    /**
+     * Open a read only handle to the database as of the header at a
+     * given offset in the file (see cbio_foreach_header() and
+     * cbio_get_header_position()).
+     *
+     * @param name the name of the couchdb file to open
+     * @param position the offset of the header in the file
+     * @param handle where to store the result
+     * @return CBIO_SUCCESS upon success, CBIO_ERROR_NO_HEADER if there
+     *                      is no header at the offset, or an
+     *                      appropriate error code describing the
+     *                      problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_open_handle_at(const char *name,
+                                     off_t position,
+                                     libcbio_t *handle);
+
+    /**
+     * Open a read only handle to the database as of the newest header
+     * with no changes after the given sequence number.
+     *
+     * @param name the name of the couchdb file to open
+     * @param sequence the sequence number
+     * @param handle where to store the result
+     * @return CBIO_SUCCESS upon success, CBIO_ERROR_NO_HEADER if there
+     *                      is no such header, or an appropriate error
+     *                      code describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_open_handle_at_sequence(const char *name,
+                                              uint64_t sequence,
+                                              libcbio_t *handle);
+
+    /**
+     * Roll the database back to the newest header with no changes
+     * after the given sequence number. The header is committed as the
+     * newest header in the file, and all changes after it (including
+     * uncommitted changes in the handle) are discarded.
+     *
+     * @param handle the handle to the database (not read only)
+     * @param sequence the sequence number to roll back to
+     * @return CBIO_SUCCESS upon success, CBIO_ERROR_NO_HEADER if there
+     *                      is no such header (the handle is left
+     *                      untouched), or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_rollback(libcbio_t handle, uint64_t sequence);
+
+    /**
+     * Specify how document bodies should be compressed when they are
+     * stored through this handle.
+     *
+     * Only bodies of regular (not deleted and not local) documents
+     * without the CBIO_DOC_IS_COMPRESSED bit in their content type
+     * are considered. The compressed body is only used if it is
+     * at most max_ratio percent of the original size (so a document
+     * that doesn't compress well is stored as is). The
+     * CBIO_DOC_IS_COMPRESSED bit is set in the stored content type
+     * for compressed documents, and cbio_document_get_value() will
+     * return the uncompressed body.
+     *
+     * @param handle the handle to set the compression policy for
+     * @param codec the codec to use (CBIO_COMPRESSION_NONE to disable
+     *              compression)
+     * @param min_size don't try to compress bodies smaller than this
+     * @param max_ratio the maximum size of the compressed body in
+     *                  percent of the original body (0 means that
+     *                  any reduction in size is good enough).
+     * @return CBIO_SUCCESS upon success, CBIO_ERROR_NOT_SUPPORTED if
+     *                      libcbio was built without support for the
+     *                      codec, CBIO_ERROR_ENOENT if
+     *                      CBIO_COMPRESSION_ZSTD_DICT is requested
+     *                      before a dictionary is trained, or an
+     *                      appropriate error code describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_compression(libcbio_t handle,
+                                      cbio_compression_t codec,
+                                      size_t min_size,
+                                      unsigned int max_ratio);
+
+    /**
+     * Train a zstd dictionary for CBIO_COMPRESSION_ZSTD_DICT from the
+     * documents changed since the sequence number `since`.
+     *
+     * The dictionary is stored as a local document in the database
+     * (and is persisted by the next cbio_commit()). It is used for
+     * all documents compressed with CBIO_COMPRESSION_ZSTD_DICT from
+     * now on. Documents compressed with a previous dictionary may
+     * still be read, because the old dictionaries are kept in the
+     * file. Documents compressed with a dictionary are stored with
+     * the CBIO_DOC_IS_DICT_COMPRESSED bit set in the content type.
+     *
+     * @param handle the handle to train the dictionary for
+     * @param since the sequence number to start sampling documents from
+     * @param max_samples the maximum number of documents to sample
+     * @param dict_size the maximum size of the dictionary
+     * @return CBIO_SUCCESS upon success, CBIO_ERROR_ENOENT if there is
+     *                      no documents to sample, CBIO_ERROR_NOT_SUPPORTED
+     *                      if libcbio was built without zstd, or an
+     *                      appropriate error code describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_train_dictionary(libcbio_t handle,
+                                       uint64_t since,
+                                       size_t max_samples,
+                                       size_t dict_size);
+
     /**
      * Create an empty document we may start to populate with values.
      *
@@ -246,6 +460,44 @@ extern "C" {
                                                 uint8_t content_type);
 
 
+    /**
+     * Let libcbio set the content type of the documents stored through
+     * the handle.
+     *
+     * When enabled the body of every document stored (not deleted
+     * and not compressed by the caller) is validated, and the content
+     * type reason (content_type & 0x0F) is set to CBIO_DOC_IS_JSON,
+     * CBIO_DOC_INVALID_JSON or CBIO_DOC_INVALID_JSON_KEY (for JSON
+     * objects with top level keys starting with an underscore),
+     * replacing the value set with cbio_document_set_content_type().
+     * The validation is vectorized on cpus supporting it.
+     *
+     * @param handle the handle to set the content type validation for
+     * @param enable set this parameter to 1 to enable the validation
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_json_validation(libcbio_t handle, int enable);
+
+    /**
+     * Let libcbio remove the documents with the same id from the
+     * batches stored through the handle (cbio_store_documents(), the
+     * bulk writer and cbio_batch_submit()) so that only one of them
+     * is written. The documents removed are just not stored; they
+     * still belong to the caller. Local documents aren't
+     * deduplicated, and neither are the documents of separate
+     * cbio_async_store() operations.
+     *
+     * @param handle the handle to set the deduplication for
+     * @param mode which of the documents to store (CBIO_DEDUP_NONE,
+     *             the default, stores all of them)
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_deduplication(libcbio_t handle, cbio_dedup_t mode);
+
     /**
      * Get a documents id
      *
@@ -295,6 +547,18 @@ extern "C" {
                                             uint64_t *revno);
 
 
+    /**
+     * Get a documents sequence number (for documents returned from the
+     * database)
+     * @param doc the document to get the sequence number from
+     * @param sequence where to store the sequence number
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_document_get_sequence(libcbio_document_t doc,
+                                            uint64_t *sequence);
+
     /**
      * Get a documents deleted flag
      *
@@ -315,6 +579,11 @@ extern "C" {
      * invalidated. If you just want to query the length of the value
      * you should specify NULL for the value pointer.
      *
+     * Compressed documents (see cbio_set_compression()) are
+     * decompressed, so the value is always the uncompressed body.
+     * CBIO_ERROR_CORRUPT is returned if the dictionary used to compress
+     * the document can't be found.
+     *
      * @param doc the document to get the value from
      * @param value where to store the pointer to the value.
      * @param value the number of bytes in the value
@@ -329,6 +598,10 @@ extern "C" {
     /**
      * Get a documents content type
      *
+     * The CBIO_DOC_IS_COMPRESSED and CBIO_DOC_IS_DICT_COMPRESSED bits
+     * tells how the body is stored in the file;
+     * cbio_document_get_value() returns the uncompressed body.
+     *
      * @param doc the document to get the content type from
      * @param content_type where to store the content type
      * @return CBIO_SUCCESS upon success, or an appropriate error code
@@ -407,6 +680,139 @@ extern "C" {
     cbio_error_t cbio_store_documents(libcbio_t handle,
                                       libcbio_document_t *doc,
                                       size_t ndocs);
+
+    /**
+     * Create a bulk writer to store batches of documents to the
+     * database.
+     *
+     * The bulk writer prepares (compresses) the documents in the
+     * batch on a pool of worker threads while the previous batch
+     * is written to disk. The batches are written in the order they
+     * are appended. The handle must not be used for other store
+     * operations while the bulk writer is active.
+     *
+     * @param handle the cbio instance to store the documents to
+     * @param nthreads the number of worker threads to prepare
+     *                 documents (0 for one per cpu)
+     * @param writer where to store the result
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_bulk_writer_create(libcbio_t handle,
+                                         unsigned int nthreads,
+                                         cbio_bulk_writer_t *writer);
+
+    /**
+     * Append a batch of documents to the bulk writer. The batch is
+     * prepared in the background, and written when the next batch is
+     * appended (or the writer is flushed).
+     *
+     * The bulk writer takes ownership of the documents (also upon
+     * failure), and releases them when they are written.
+     *
+     * @param writer the bulk writer to append the documents to
+     * @param doc pointer to an array of documents
+     * @param ndocs the number of elements in the array
+     * @return CBIO_SUCCESS upon success, or the error code from the
+     *                      first batch that failed to be stored. No
+     *                      more documents are stored after a failure.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_bulk_writer_append(cbio_bulk_writer_t writer,
+                                         libcbio_document_t *doc,
+                                         size_t ndocs);
+
+    /**
+     * Wait for all of the appended batches to be written. You need to
+     * call cbio_commit() to persist them.
+     *
+     * @param writer the bulk writer to flush
+     * @return CBIO_SUCCESS upon success, or the error code from the
+     *                      first batch that failed to be stored.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_bulk_writer_flush(cbio_bulk_writer_t writer);
+
+    /**
+     * Flush and release all resources allocated by the bulk writer.
+     *
+     * @param writer the bulk writer to destroy
+     * @return CBIO_SUCCESS upon success, or the error code from the
+     *                      first batch that failed to be stored.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_bulk_writer_destroy(cbio_bulk_writer_t writer);
+
+    /**
+     * Create a batch to build a bulk store without creating a
+     * document for every entry.
+     *
+     * The entries appended to the batch are copied into one buffer
+     * owned by the batch, and the buffers are kept when the batch is
+     * reset, so a batch reused for batches of similar sizes doesn't
+     * allocate any memory (except for compressed bodies).
+     *
+     * @param handle the cbio instance to store the documents to
+     * @param batch where to store the result
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_batch_create(libcbio_t handle, cbio_batch_t *batch);
+
+    /**
+     * Append a document to the batch. Local documents can't be
+     * stored through a batch (use cbio_store_documents()).
+     *
+     * @param batch the batch to append the document to
+     * @param entry the document to append
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_batch_append(cbio_batch_t batch,
+                                   const cbio_batch_entry_t *entry);
+
+    /**
+     * Get the number of documents appended to the batch since it was
+     * created or reset.
+     *
+     * @param batch the batch to query
+     * @return the number of documents in the batch
+     */
+    LIBCBIO_API
+    size_t cbio_batch_count(cbio_batch_t batch);
+
+    /**
+     * Store the documents in the batch, sorted by id, as
+     * cbio_store_documents() would. You need to call cbio_commit() to
+     * persist them. The batch isn't reset.
+     *
+     * @param batch the batch to store
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_batch_submit(cbio_batch_t batch);
+
+    /**
+     * Remove all of the documents from the batch (keeping the memory
+     * for the next batch).
+     *
+     * @param batch the batch to reset
+     */
+    LIBCBIO_API
+    void cbio_batch_reset(cbio_batch_t batch);
+
+    /**
+     * Release all resources allocated by the batch.
+     *
+     * @param batch the batch to destroy
+     */
+    LIBCBIO_API
+    void cbio_batch_destroy(cbio_batch_t batch);
+
     /**
      * Notify cbio that the document is no longer in use and that it's
      * resources may be reused/released.
@@ -469,6 +875,489 @@ extern "C" {
                                     cbio_changes_callback_fn callback,
                                     void *ctx);
 
+    /**
+     * Callback function used by cbio_changes_since_batch(). The
+     * documents are only valid until the callback returns, and must
+     * not be released. Their values may be read from the callback.
+     *
+     * @param handle the libcbio handle
+     * @param docs the documents in the batch (in sequence order)
+     * @param ndocs the number of documents in the batch
+     * @param ctx user context
+     * @return 0 to continue, or non-zero to stop the iteration
+     */
+    typedef int (*cbio_changes_batch_callback_fn)(libcbio_t handle,
+                                                  libcbio_document_t *docs,
+                                                  size_t ndocs,
+                                                  void *ctx);
+
+    /**
+     * Iterate through the changes since sequence number `since` in
+     * batches of up to `batchsize` documents. Unlike
+     * cbio_changes_since() no memory is allocated per document; the
+     * documents in a batch share a buffer which is reused for the next
+     * batch.
+     *
+     * @param handle libcbio handle
+     * @param since the sequence number to start iterating from
+     * @param batchsize the maximum number of documents in a batch
+     * @param callback the callback function called for every batch
+     * @param ctx client context (passed to the callback)
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_changes_since_batch(libcbio_t handle,
+                                          uint64_t since,
+                                          size_t batchsize,
+                                          cbio_changes_batch_callback_fn callback,
+                                          void *ctx);
+
+    /**
+     * Create a memory budget for changes scans. The documents retained
+     * by the callback of cbio_changes_since_budget() are charged to
+     * the budget until they are released. The same budget may be used
+     * by multiple scans (also from different threads).
+     *
+     * @param limit the number of bytes the retained documents may use
+     * @param budget where to store the result
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_budget_create(size_t limit, cbio_budget_t *budget);
+
+    /**
+     * Get the number of bytes charged to the budget
+     *
+     * @param budget the budget to query
+     * @return the number of bytes used by the retained documents
+     */
+    LIBCBIO_API
+    size_t cbio_budget_get_used(cbio_budget_t budget);
+
+    /**
+     * Release the budget. All of the documents charged to the budget
+     * must be released first.
+     *
+     * @param budget the budget to release
+     */
+    LIBCBIO_API
+    void cbio_budget_destroy(cbio_budget_t budget);
+
+    /**
+     * Iterate through the changes since sequence number `since` like
+     * cbio_changes_since(), but charge the documents retained by the
+     * callback to the budget. A document is charged for its metadata
+     * and the size of its body on disk.
+     *
+     * If the next document doesn't fit in the budget, the scan waits
+     * for other threads to release documents. If the budget isn't
+     * available within `timeout` milliseconds the scan stops and
+     * returns CBIO_ERROR_TIMEOUT; the consumer may then release
+     * documents and resume the scan from the sequence number after
+     * the last document it got (see cbio_document_get_sequence()).
+     *
+     * @param handle libcbio handle
+     * @param since the sequence number to start iterating from
+     * @param budget the budget to charge the retained documents to
+     * @param timeout the number of milliseconds to wait for the budget
+     *                (0 to not wait, -1 to wait forever)
+     * @param callback the callback function used to iterate over all changes
+     * @param ctx client context (passed to the callback)
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_changes_since_budget(libcbio_t handle,
+                                           uint64_t since,
+                                           cbio_budget_t budget,
+                                           int timeout,
+                                           cbio_changes_callback_fn callback,
+                                           void *ctx);
+
+    /**
+     * Open a set of database files, one per vbucket. The files are
+     * named <vbucket>.couch and live in the directory `dirname`
+     * (which is created if it doesn't exist and mode is
+     * CBIO_OPEN_CREATE).
+     *
+     * Documents to store in the set may be created by passing the
+     * handle of any of the files in the set to
+     * cbio_create_empty_document().
+     *
+     * @param dirname the directory containing the database files
+     * @param nvbuckets the number of vbuckets (1 - 32768)
+     * @param mode how to open the database files
+     * @param set where to store the result
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_open(const char *dirname,
+                               uint16_t nvbuckets,
+                               libcbio_open_mode_t mode,
+                               cbio_set_t *set);
+
+    /**
+     * Close all of the database files in the set (committing any
+     * pending operations) and release all allocated resources.
+     *
+     * @param set the set to close
+     */
+    LIBCBIO_API
+    void cbio_set_close(cbio_set_t set);
+
+    /**
+     * Get the vbucket a document id maps to. This is the same
+     * mapping (CRC32 based) as used by the clients.
+     *
+     * @param set the vbucket set
+     * @param id the document id
+     * @param nid the number of bytes in the id
+     * @return the vbucket number
+     */
+    LIBCBIO_API
+    uint16_t cbio_set_get_vbucket(cbio_set_t set, const void *id, size_t nid);
+
+    /**
+     * Get the handle for the database file for a vbucket. The handle
+     * is owned by the set and must not be closed.
+     *
+     * @param set the vbucket set
+     * @param vbucket the vbucket number
+     * @return the handle or NULL if the vbucket is out of range
+     */
+    LIBCBIO_API
+    libcbio_t cbio_set_get_handle(cbio_set_t set, uint16_t vbucket);
+
+    /**
+     * Get a document from the file the id maps to. See
+     * cbio_get_document().
+     *
+     * @param set the vbucket set
+     * @param id the identifier to look up
+     * @param nid the number of bytes in the id
+     * @param doc where to store the result
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_get_document(cbio_set_t set,
+                                       const void *id,
+                                       size_t nid,
+                                       libcbio_document_t *doc);
+
+    /**
+     * Store a batch of documents in the set. The batch is split per
+     * vbucket, and the files are written in parallel.
+     *
+     * @param set the vbucket set
+     * @param doc pointer to an array of documents
+     * @param ndocs the number of elements in the array
+     * @return CBIO_SUCCESS upon success, or the error code from one of
+     *                      the files that failed. The documents for
+     *                      the other files may have been stored.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_store_documents(cbio_set_t set,
+                                          libcbio_document_t *doc,
+                                          size_t ndocs);
+
+    /**
+     * Commit all (pending) operations in all of the files in the set.
+     * The files are committed in parallel.
+     *
+     * @param set the vbucket set
+     * @return CBIO_SUCCESS upon success, or the error code from one of
+     *                      the files that failed to commit.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_commit(cbio_set_t set);
+
+    /**
+     * Iterate through the changes since sequence number `since` in
+     * all of the files in the set (in vbucket order). The sequence
+     * numbers are per file, so `since` is applied to each file. The
+     * callback is called with the handle for the file the document
+     * was read from (see cbio_set_get_handle()).
+     *
+     * @param set the vbucket set
+     * @param since the sequence number to start iterating from
+     * @param callback the callback function used to iterate over all changes
+     * @param ctx client context (passed to the callback)
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_changes_since(cbio_set_t set,
+                                        uint64_t since,
+                                        cbio_changes_callback_fn callback,
+                                        void *ctx);
+
+    /**
+     * Adopt the newest header in a database file written by someone
+     * else (another handle or process). The check is cheap (a stat
+     * of the file) unless the file has grown since the handle last
+     * looked for a header.
+     *
+     * @param handle the read only handle to refresh
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_refresh(libcbio_t handle);
+
+    /**
+     * Wait for the database file to be written to since the handle
+     * was opened (or last refreshed). The file is monitored with
+     * inotify where available, otherwise it is polled. Use
+     * cbio_refresh() to adopt the new header.
+     *
+     * @param handle the handle for the file to monitor
+     * @param timeout the maximum number of milliseconds to wait
+     *                (-1 to wait forever)
+     * @return CBIO_SUCCESS if the file was written, CBIO_ERROR_TIMEOUT
+     *                      if the timeout expired
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_wait_for_commit(libcbio_t handle, int timeout);
+
+    /**
+     * Stream the changes committed to the database file by someone
+     * else. Starting at sequence number `*since` all changes are
+     * passed to the callback (as with cbio_changes_since()), and then
+     * the changes in every new commit are passed to the callback as
+     * they are committed.
+     *
+     * @param handle the read only handle to tail
+     * @param since the sequence number to start at. Updated to the
+     *              sequence number to continue from
+     * @param timeout the maximum number of milliseconds to wait for a
+     *                new commit (-1 to wait forever)
+     * @param callback the callback function called for each change
+     * @param ctx client context (passed to the callback)
+     * @return CBIO_ERROR_TIMEOUT when no new changes were committed
+     *                            within the timeout, or an appropriate
+     *                            error code describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_tail_changes(libcbio_t handle,
+                                   uint64_t *since,
+                                   int timeout,
+                                   cbio_changes_callback_fn callback,
+                                   void *ctx);
+
+    /**
+     * Create an async interface to the handle. The operations are
+     * executed on a pool of worker threads, and the results are
+     * posted to a completion queue.
+     *
+     * Stores and commits are executed in the order they are submitted
+     * (and stores submitted back to back may be merged into a single
+     * store). Gets are executed in parallel if the handle was opened
+     * with cbio_open_shared_handle(), otherwise they are executed in
+     * order with the stores and commits. The handle must not be used
+     * for other operations while the async interface exists (unless
+     * it is a shared handle, where other threads may read).
+     *
+     * @param handle the handle to execute the operations on
+     * @param nthreads the number of worker threads (0 for one per cpu)
+     * @param async where to store the result
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_async_create(libcbio_t handle,
+                                   unsigned int nthreads,
+                                   cbio_async_t *async);
+
+    /**
+     * Get a file descriptor which is readable while there are
+     * completions to reap. Don't read from or close it.
+     *
+     * @param async the async interface
+     * @return the file descriptor
+     */
+    LIBCBIO_API
+    int cbio_async_get_fd(cbio_async_t async);
+
+    /**
+     * Submit a get operation. See cbio_get_document().
+     *
+     * @param async the async interface
+     * @param id the identifier to look up (copied)
+     * @param nid the number of bytes in the id
+     * @param cookie user data passed back in the completion
+     * @return CBIO_SUCCESS if the operation was submitted
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_async_get(cbio_async_t async,
+                                const void *id,
+                                size_t nid,
+                                const void *cookie);
+
+    /**
+     * Submit a store operation. See cbio_store_documents(). The
+     * documents must not be modified or released until the operation
+     * is completed.
+     *
+     * @param async the async interface
+     * @param doc pointer to an array of documents (copied)
+     * @param ndocs the number of elements in the array
+     * @param cookie user data passed back in the completion
+     * @return CBIO_SUCCESS if the operation was submitted
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_async_store(cbio_async_t async,
+                                  libcbio_document_t *doc,
+                                  size_t ndocs,
+                                  const void *cookie);
+
+    /**
+     * Submit a commit operation. It is executed after all of the
+     * stores submitted before it.
+     *
+     * @param async the async interface
+     * @param cookie user data passed back in the completion
+     * @return CBIO_SUCCESS if the operation was submitted
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_async_commit(cbio_async_t async, const void *cookie);
+
+    /**
+     * Reap completed operations without blocking.
+     *
+     * @param async the async interface
+     * @param completions where to store the completions
+     * @param max the number of elements in completions
+     * @return the number of completions stored
+     */
+    LIBCBIO_API
+    size_t cbio_async_reap(cbio_async_t async,
+                           cbio_completion_t *completions,
+                           size_t max);
+
+    /**
+     * Wait for all submitted operations to complete and release all
+     * resources. Documents from completions which weren't reaped are
+     * released.
+     *
+     * @param async the async interface to destroy
+     */
+    LIBCBIO_API
+    void cbio_async_destroy(cbio_async_t async);
+
+    /**
+     * Start recording the operations performed through the handle
+     * (cbio_get_document(), cbio_get_document_ex(),
+     * cbio_store_documents(), cbio_commit(), cbio_changes_since() and
+     * cbio_changes_since_batch()) to a trace file. Every record holds
+     * the operation, its result, when it started and how long it took,
+     * and the hash and the size of the id and the value of the
+     * documents involved. The ids and the values themselves aren't
+     * recorded. The trace may be replayed against a copy of the
+     * database with tools/cbio_replay.
+     *
+     * Tracing must not be started or stopped while other threads use
+     * the handle.
+     *
+     * @param handle the handle to trace
+     * @param name the name of the trace file (truncated if it exists)
+     * @return CBIO_SUCCESS upon success, or CBIO_ERROR_EINVAL if the
+     *         handle is already traced
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_trace_start(libcbio_t handle, const char *name);
+
+    /**
+     * Stop recording and close the trace file. Tracing is stopped by
+     * cbio_close_handle() as well.
+     *
+     * @param handle the traced handle
+     * @return CBIO_SUCCESS upon success, or CBIO_ERROR_EIO if some of
+     *         the records couldn't be written
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_trace_stop(libcbio_t handle);
+
+    /**
+     * The callback for the probes (see cbio_set_probe_callback())
+     *
+     * @param handle the handle the function was called for
+     * @param info the entry point and its arguments
+     * @param cookie the cookie passed to cbio_set_probe_callback()
+     */
+    typedef void (*cbio_probe_callback_fn)(libcbio_t handle,
+                                           const cbio_probe_info_t *info,
+                                           void *cookie);
+
+    /**
+     * Install a callback called when cbio_get_document(),
+     * cbio_document_get_value(), cbio_store_documents(), cbio_commit()
+     * and cbio_changes_since() are entered and return, to correlate
+     * the time spent in libcbio with the request traces of the
+     * application. The callback is called in the thread calling the
+     * function and must not call back into the handle.
+     *
+     * The same entry points carry static USDT probes (provider
+     * libcbio, probes get_document_entry, get_document_return etc)
+     * when libcbio is built with sys/sdt.h, which may be traced with
+     * bpftrace or perf without installing a callback. The probes are
+     * a nop unless they're traced.
+     *
+     * The callback must not be replaced while other threads use the
+     * handle.
+     *
+     * @param handle the handle to probe
+     * @param callback the callback, or NULL to remove it
+     * @param cookie passed to the callback
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_probe_callback(libcbio_t handle,
+                                         cbio_probe_callback_fn callback,
+                                         void *cookie);
+
+    /**
+     * Set the allocator used for the memory allocated by libcbio, to
+     * route it to the arenas of the application (documents, batches,
+     * buffers etc). The memory allocated by couchstore (like the
+     * document metadata and bodies it reads) isn't affected.
+     *
+     * Every handle has an allocator of its own (the global allocator
+     * at the time the handle was opened). The global allocator is used
+     * for the handles themselves and for everything not tied to a
+     * handle (like documents created without one). The allocator may
+     * only be set while no memory allocated with it is in use, i.e.
+     * right after opening the handle, or before opening any handle for
+     * the global allocator, and it must remain usable until all of the
+     * documents allocated with it are released.
+     *
+     * @param handle the handle to set the allocator for, or NULL to
+     *               set the global allocator
+     * @param allocator the allocator, or NULL to use malloc() and
+     *                  friends
+     * @return CBIO_SUCCESS upon success, or CBIO_ERROR_EINVAL if the
+     *         allocator is in use
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_allocator(libcbio_t handle,
+                                    const cbio_allocator_t *allocator);
+
+    /**
+     * Get the memory allocated by libcbio for a handle (see
+     * cbio_set_allocator()), e.g. to enforce a memory quota per tenant.
+     * The documents read through a handle are accounted to the handle
+     * (except for the parts allocated by couchstore).
+     *
+     * @param handle the handle, or NULL for the global allocator
+     * @param stats where to store the result
+     * @return CBIO_SUCCESS upon success, or an appropriate error code
+     *                      describing the problem.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_get_memory_stats(libcbio_t handle,
+                                       cbio_memory_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
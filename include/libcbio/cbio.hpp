@@ -0,0 +1,539 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Header only C++20 interface to libcbio. The handles and documents
+ * are move only objects owning the underlying libcbio object, the
+ * accessors return views into the document (valid as long as the
+ * document is), and the identifiers are passed to the library as
+ * views so they don't have to be copied. The errors are reported
+ * by throwing cbio::error (except for a missing document, which is
+ * an empty std::optional).
+ */
+#ifndef LIBCBIO_CBIO_HPP
+#define LIBCBIO_CBIO_HPP 1
+
+#if __cplusplus < 202002L
+#error "libcbio/cbio.hpp requires C++20"
+#endif
+
+#include <libcbio/cbio.h>
+
+#include <coroutine>
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace cbio {
+
+    /**
+     * The exception thrown when libcbio reports an error
+     */
+    class error : public std::runtime_error {
+    public:
+        explicit error(cbio_error_t code)
+            : std::runtime_error(cbio_strerror(code)), code_(code) {}
+
+        cbio_error_t code() const noexcept {
+            return code_;
+        }
+
+    private:
+        cbio_error_t code_;
+    };
+
+    /**
+     * Throw cbio::error unless err is CBIO_SUCCESS
+     */
+    inline void check(cbio_error_t err) {
+        if (err != CBIO_SUCCESS) {
+            throw error(err);
+        }
+    }
+
+    /**
+     * A document. Views returned from the accessors are valid until
+     * the document is destroyed or modified.
+     */
+    class document {
+    public:
+        document() noexcept = default;
+
+        /**
+         * Take ownership of a document returned from the C API
+         */
+        explicit document(libcbio_document_t doc) noexcept : doc_(doc) {}
+
+        document(document &&other) noexcept
+            : doc_(std::exchange(other.doc_, nullptr)) {}
+
+        document &operator=(document &&other) noexcept {
+            if (this != &other) {
+                reset();
+                doc_ = std::exchange(other.doc_, nullptr);
+            }
+            return *this;
+        }
+
+        document(const document &) = delete;
+        document &operator=(const document &) = delete;
+
+        ~document() {
+            reset();
+        }
+
+        libcbio_document_t get() const noexcept {
+            return doc_;
+        }
+
+        /**
+         * Give up the ownership of the document (the caller must
+         * release it with cbio_document_release())
+         */
+        libcbio_document_t release() noexcept {
+            return std::exchange(doc_, nullptr);
+        }
+
+        void reset() noexcept {
+            if (doc_ != nullptr) {
+                cbio_document_release(std::exchange(doc_, nullptr));
+            }
+        }
+
+        explicit operator bool() const noexcept {
+            return doc_ != nullptr;
+        }
+
+        std::string_view id() const {
+            const void *ptr;
+            size_t nb;
+            check(cbio_document_get_id(doc_, &ptr, &nb));
+            return std::string_view(static_cast<const char *>(ptr), nb);
+        }
+
+        std::string_view meta() const {
+            const void *ptr;
+            size_t nb;
+            check(cbio_document_get_meta(doc_, &ptr, &nb));
+            return std::string_view(static_cast<const char *>(ptr), nb);
+        }
+
+        /**
+         * The (uncompressed) body of the document. The body is read
+         * from disk the first time it is requested.
+         */
+        std::string_view value() const {
+            const void *ptr;
+            size_t nb;
+            check(cbio_document_get_value(doc_, &ptr, &nb));
+            return std::string_view(static_cast<const char *>(ptr), nb);
+        }
+
+        std::span<const std::byte> value_bytes() const {
+            std::string_view v = value();
+            return std::as_bytes(std::span<const char>(v.data(), v.size()));
+        }
+
+        uint64_t revision() const {
+            uint64_t revno;
+            check(cbio_document_get_revision(doc_, &revno));
+            return revno;
+        }
+
+        bool deleted() const {
+            int deleted;
+            check(cbio_document_get_deleted(doc_, &deleted));
+            return deleted != 0;
+        }
+
+        uint8_t content_type() const {
+            uint8_t type;
+            check(cbio_document_get_content_type(doc_, &type));
+            return type;
+        }
+
+        /**
+         * Set the id. Unless copy is true the data must stay valid
+         * until the document is stored.
+         */
+        document &set_id(std::string_view id, bool copy = true) {
+            check(cbio_document_set_id(doc_, id.data(), id.size(), copy));
+            return *this;
+        }
+
+        document &set_meta(std::string_view meta, bool copy = true) {
+            check(cbio_document_set_meta(doc_, meta.data(), meta.size(),
+                                         copy));
+            return *this;
+        }
+
+        document &set_value(std::string_view value, bool copy = true) {
+            check(cbio_document_set_value(doc_, value.data(), value.size(),
+                                          copy));
+            return *this;
+        }
+
+        document &set_value(std::span<const std::byte> value,
+                            bool copy = true) {
+            check(cbio_document_set_value(doc_, value.data(), value.size(),
+                                          copy));
+            return *this;
+        }
+
+        document &set_revision(uint64_t revno) {
+            check(cbio_document_set_revision(doc_, revno));
+            return *this;
+        }
+
+        document &set_deleted(bool deleted) {
+            check(cbio_document_set_deleted(doc_, deleted ? 1 : 0));
+            return *this;
+        }
+
+        document &set_content_type(uint8_t type) {
+            check(cbio_document_set_content_type(doc_, type));
+            return *this;
+        }
+
+    private:
+        libcbio_document_t doc_ = nullptr;
+    };
+
+    namespace detail {
+        inline std::vector<libcbio_document_t>
+        raw_documents(std::span<const document> docs) {
+            std::vector<libcbio_document_t> raw;
+            raw.reserve(docs.size());
+            for (const document &doc : docs) {
+                raw.push_back(doc.get());
+            }
+            return raw;
+        }
+    }
+
+    /**
+     * A handle to a database file
+     */
+    class handle {
+    public:
+        handle() noexcept = default;
+
+        /**
+         * Take ownership of a handle opened with the C API
+         */
+        explicit handle(libcbio_t h) noexcept : handle_(h) {}
+
+        /**
+         * Open a database file. See cbio_open_handle()
+         */
+        handle(const std::string &name, libcbio_open_mode_t mode) {
+            check(cbio_open_handle(name.c_str(), mode, &handle_));
+        }
+
+        /**
+         * Open a database file which may be read by multiple threads.
+         * See cbio_open_shared_handle()
+         */
+        static handle shared(const std::string &name,
+                             libcbio_open_mode_t mode,
+                             unsigned int nreaders = 0) {
+            libcbio_t h;
+            check(cbio_open_shared_handle(name.c_str(), mode, nreaders, &h));
+            return handle(h);
+        }
+
+        handle(handle &&other) noexcept
+            : handle_(std::exchange(other.handle_, nullptr)) {}
+
+        handle &operator=(handle &&other) noexcept {
+            if (this != &other) {
+                close();
+                handle_ = std::exchange(other.handle_, nullptr);
+            }
+            return *this;
+        }
+
+        handle(const handle &) = delete;
+        handle &operator=(const handle &) = delete;
+
+        ~handle() {
+            close();
+        }
+
+        libcbio_t get() const noexcept {
+            return handle_;
+        }
+
+        void close() noexcept {
+            if (handle_ != nullptr) {
+                cbio_close_handle(std::exchange(handle_, nullptr));
+            }
+        }
+
+        explicit operator bool() const noexcept {
+            return handle_ != nullptr;
+        }
+
+        /**
+         * Create an empty document to store through this handle
+         */
+        document create_document() const {
+            libcbio_document_t doc;
+            check(cbio_create_empty_document(handle_, &doc));
+            return document(doc);
+        }
+
+        /**
+         * Get a document, or an empty optional if it doesn't exist
+         * (or is deleted and include_deleted is false)
+         */
+        std::optional<document> get(std::string_view id,
+                                    bool include_deleted = false) const {
+            libcbio_document_t doc;
+            cbio_error_t err;
+            if (include_deleted) {
+                err = cbio_get_document_ex(handle_, id.data(), id.size(),
+                                           &doc);
+            } else {
+                err = cbio_get_document(handle_, id.data(), id.size(), &doc);
+            }
+            if (err == CBIO_ERROR_ENOENT) {
+                return std::nullopt;
+            }
+            check(err);
+            return document(doc);
+        }
+
+        void store(const document &doc) {
+            check(cbio_store_document(handle_, doc.get()));
+        }
+
+        void store(std::span<const document> docs) {
+            std::vector<libcbio_document_t> raw = detail::raw_documents(docs);
+            check(cbio_store_documents(handle_, raw.data(), raw.size()));
+        }
+
+        void commit() {
+            check(cbio_commit(handle_));
+        }
+
+        /**
+         * Get the documents changed since the sequence number. The
+         * result is a range of documents (the values are read when
+         * requested).
+         */
+        std::vector<document> changes(uint64_t since) const {
+            std::vector<document> docs;
+            check(cbio_changes_since(handle_, since, collect, &docs));
+            return docs;
+        }
+
+        off_t header_position() const {
+            return cbio_get_header_position(handle_);
+        }
+
+    private:
+        static int collect(libcbio_t, libcbio_document_t doc, void *ctx) {
+            try {
+                static_cast<std::vector<document> *>(ctx)->emplace_back(doc);
+            } catch (...) {
+                /* Let libcbio release the document */
+                return 0;
+            }
+            return 1;
+        }
+
+        libcbio_t handle_ = nullptr;
+    };
+
+    /**
+     * Coroutine interface on top of the async API. The operations
+     * return awaitables which suspend the calling coroutine until the
+     * operation completes. The coroutines are resumed from poll(),
+     * which should be called when fd() is readable (or periodically).
+     */
+    class async {
+    public:
+        /**
+         * Create the async interface for the handle. The handle must
+         * outlive this object. See cbio_async_create()
+         */
+        explicit async(const handle &h, unsigned int nthreads = 0) {
+            check(cbio_async_create(h.get(), nthreads, &async_));
+        }
+
+        async(const async &) = delete;
+        async &operator=(const async &) = delete;
+
+        /**
+         * Waits for the outstanding operations. Coroutines suspended
+         * on operations which weren't reaped with poll() are never
+         * resumed.
+         */
+        ~async() {
+            cbio_async_destroy(async_);
+        }
+
+        int fd() const noexcept {
+            return cbio_async_get_fd(async_);
+        }
+
+        /**
+         * Resume the coroutines waiting for completed operations
+         *
+         * @return the number of coroutines resumed
+         */
+        size_t poll() {
+            cbio_completion_t completions[64];
+            size_t total = 0;
+            size_t nc;
+
+            do {
+                nc = cbio_async_reap(async_, completions, 64);
+                for (size_t ii = 0; ii < nc; ++ii) {
+                    operation *op = static_cast<operation *>(
+                        const_cast<void *>(completions[ii].cookie));
+                    op->completion_ = completions[ii];
+                    op->waiter_.resume();
+                }
+                total += nc;
+            } while (nc == 64);
+
+            return total;
+        }
+
+    private:
+        class operation {
+        public:
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+        protected:
+            friend class async;
+
+            explicit operation(cbio_async_t a) noexcept : async_(a) {}
+
+            /* Don't suspend if we failed to submit the operation */
+            bool suspend(std::coroutine_handle<> waiter, cbio_error_t err) {
+                waiter_ = waiter;
+                completion_.status = err;
+                return err == CBIO_SUCCESS;
+            }
+
+            cbio_async_t async_;
+            std::coroutine_handle<> waiter_;
+            cbio_completion_t completion_ = {};
+        };
+
+    public:
+        class get_operation : public operation {
+        public:
+            bool await_suspend(std::coroutine_handle<> waiter) {
+                return suspend(waiter, cbio_async_get(async_, id_.data(),
+                                                      id_.size(), this));
+            }
+
+            std::optional<document> await_resume() {
+                if (completion_.status == CBIO_ERROR_ENOENT) {
+                    return std::nullopt;
+                }
+                check(completion_.status);
+                return document(completion_.doc);
+            }
+
+        private:
+            friend class async;
+
+            get_operation(cbio_async_t a, std::string_view id) noexcept
+                : operation(a), id_(id) {}
+
+            std::string_view id_;
+        };
+
+        class store_operation : public operation {
+        public:
+            bool await_suspend(std::coroutine_handle<> waiter) {
+                return suspend(waiter, cbio_async_store(async_, raw_.data(),
+                                                        raw_.size(), this));
+            }
+
+            void await_resume() {
+                check(completion_.status);
+            }
+
+        private:
+            friend class async;
+
+            store_operation(cbio_async_t a, std::span<const document> docs)
+                : operation(a), raw_(detail::raw_documents(docs)) {}
+
+            std::vector<libcbio_document_t> raw_;
+        };
+
+        class commit_operation : public operation {
+        public:
+            bool await_suspend(std::coroutine_handle<> waiter) {
+                return suspend(waiter, cbio_async_commit(async_, this));
+            }
+
+            void await_resume() {
+                check(completion_.status);
+            }
+
+        private:
+            friend class async;
+
+            explicit commit_operation(cbio_async_t a) noexcept
+                : operation(a) {}
+        };
+
+        /**
+         * Get a document. The id is copied when the operation is
+         * submitted.
+         */
+        get_operation get(std::string_view id) {
+            return get_operation(async_, id);
+        }
+
+        /**
+         * Store documents. The documents must not be modified until
+         * the operation completes.
+         */
+        store_operation store(std::span<const document> docs) {
+            return store_operation(async_, docs);
+        }
+
+        store_operation store(const document &doc) {
+            return store_operation(async_, std::span<const document>(&doc, 1));
+        }
+
+        commit_operation commit() {
+            return commit_operation(async_);
+        }
+
+    private:
+        cbio_async_t async_;
+    };
+}
+
+#endif
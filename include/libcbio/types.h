@@ -31,6 +31,9 @@ extern "C" {
 
     /**< Document contents compressed via Snappy */
 #define CBIO_DOC_IS_COMPRESSED 128
+
+    /**< Document contents compressed via zstd with a trained dictionary */
+#define CBIO_DOC_IS_DICT_COMPRESSED 64
     /* Content Type Reasons (content_meta & 0x0F): */
 
     /**< Document is valid JSON data */
@@ -52,6 +55,21 @@ extern "C" {
     struct libcbio_document_st;
     typedef struct libcbio_document_st *libcbio_document_t;
 
+    struct cbio_bulk_writer_st;
+    typedef struct cbio_bulk_writer_st *cbio_bulk_writer_t;
+
+    struct cbio_batch_st;
+    typedef struct cbio_batch_st *cbio_batch_t;
+
+    struct cbio_set_st;
+    typedef struct cbio_set_st *cbio_set_t;
+
+    struct cbio_async_st;
+    typedef struct cbio_async_st *cbio_async_t;
+
+    struct cbio_budget_st;
+    typedef struct cbio_budget_st *cbio_budget_t;
+
     typedef enum {
         CBIO_OPEN_RDONLY,
         CBIO_OPEN_RW,
@@ -69,9 +87,175 @@ extern "C" {
         CBIO_ERROR_ENOENT,
         CBIO_ERROR_NO_HEADER,
         CBIO_ERROR_HEADER_VERSION,
-        CBIO_ERROR_CHECKSUM_FAIL
+        CBIO_ERROR_CHECKSUM_FAIL,
+        CBIO_ERROR_NOT_SUPPORTED,
+        CBIO_ERROR_TIMEOUT
     } cbio_error_t;
 
+    /**
+     * The operations in the async API
+     */
+    typedef enum {
+        CBIO_ASYNC_GET,
+        CBIO_ASYNC_STORE,
+        CBIO_ASYNC_COMMIT
+    } cbio_async_op_t;
+
+    /**
+     * The result of an operation submitted to the async API
+     */
+    typedef struct {
+        /** The operation */
+        cbio_async_op_t op;
+        /** The cookie passed when the operation was submitted */
+        const void *cookie;
+        /** The result of the operation */
+        cbio_error_t status;
+        /**
+         * The document for a successful CBIO_ASYNC_GET (with the
+         * value read). Release it with cbio_document_release()
+         */
+        libcbio_document_t doc;
+    } cbio_completion_t;
+
+    /**
+     * Information about a header in the database file
+     */
+    typedef struct {
+        /** The offset of the header in the file */
+        off_t position;
+        /** The sequence number of the last change in the header */
+        uint64_t last_sequence;
+        /** The number of documents */
+        uint64_t doc_count;
+        /** The number of deleted documents */
+        uint64_t deleted_count;
+    } cbio_header_info_t;
+
+    /**
+     * The compression codecs libcbio may apply to document bodies
+     * when they are stored. See cbio_set_compression()
+     */
+    typedef enum {
+        /** Store the document bodies as provided */
+        CBIO_COMPRESSION_NONE,
+        /** Compress the document bodies with Snappy */
+        CBIO_COMPRESSION_SNAPPY,
+        /**
+         * Compress the document bodies with zstd using the dictionary
+         * created by cbio_train_dictionary()
+         */
+        CBIO_COMPRESSION_ZSTD_DICT
+    } cbio_compression_t;
+
+    /**
+     * How the documents with the same id in one store are handled.
+     * See cbio_set_deduplication()
+     */
+    typedef enum {
+        /** Store all of the documents */
+        CBIO_DEDUP_NONE,
+        /** Only store the last document with the id */
+        CBIO_DEDUP_LAST,
+        /**
+         * Only store the document with the highest revision number
+         * (the last of them if more than one has it)
+         */
+        CBIO_DEDUP_REVISION
+    } cbio_dedup_t;
+
+    /**
+     * The API entry points reporting to the probes (see
+     * cbio_set_probe_callback())
+     */
+    typedef enum {
+        /** cbio_get_document() and cbio_get_document_ex() */
+        CBIO_PROBE_GET_DOCUMENT,
+        /** cbio_document_get_value() */
+        CBIO_PROBE_GET_VALUE,
+        /** cbio_store_documents() (and cbio_store_document()) */
+        CBIO_PROBE_STORE_DOCUMENTS,
+        /** cbio_commit() */
+        CBIO_PROBE_COMMIT,
+        /** cbio_changes_since() and cbio_changes_since_batch() */
+        CBIO_PROBE_CHANGES_SINCE
+    } cbio_probe_t;
+
+    /**
+     * The arguments of a probe
+     */
+    typedef struct {
+        /** The entry point */
+        cbio_probe_t probe;
+        /** 0 when the function is entered, 1 when it returns */
+        int exit;
+        /** The size of the id for gets (0 otherwise) */
+        size_t nid;
+        /**
+         * The number of documents: 1 for gets, the number of documents
+         * stored, or the number of changes delivered (on exit)
+         */
+        size_t count;
+        /**
+         * The number of bytes: the size of the value (on disk for
+         * cbio_get_document(), on exit), or the total size of the
+         * values stored
+         */
+        size_t nbytes;
+        /** The result of the function (on exit) */
+        cbio_error_t status;
+    } cbio_probe_info_t;
+
+    /**
+     * An allocator for the memory allocated by libcbio (see
+     * cbio_set_allocator()). The functions have the semantics of their
+     * libc counterparts, and are passed the ctx member.
+     */
+    typedef struct {
+        void *(*malloc_fn)(size_t size, void *ctx);
+        void *(*calloc_fn)(size_t nmemb, size_t size, void *ctx);
+        void *(*realloc_fn)(void *ptr, size_t size, void *ctx);
+        void (*free_fn)(void *ptr, void *ctx);
+        void *ctx;
+    } cbio_allocator_t;
+
+    /**
+     * The memory allocated by libcbio (see cbio_get_memory_stats()).
+     * The sizes are the sizes requested, not including the overhead
+     * of the allocator (or the header libcbio adds to each block).
+     */
+    typedef struct {
+        /** The number of bytes currently allocated */
+        uint64_t allocated;
+        /** The largest number of bytes allocated at any time */
+        uint64_t peak;
+        /** The number of blocks currently allocated */
+        uint64_t allocations;
+        /** The number of blocks allocated so far */
+        uint64_t total_allocations;
+    } cbio_memory_stats_t;
+
+    /**
+     * A document to append to a batch (see cbio_batch_append()). The
+     * id, meta and value are copied into the batch, so they only need
+     * to be valid for the duration of the call.
+     */
+    typedef struct {
+        const void *id;
+        size_t nid;
+        const void *meta;
+        size_t nmeta;
+        /** Ignored for deleted documents */
+        const void *value;
+        size_t nvalue;
+        /** See cbio_document_set_revision() */
+        uint64_t revno;
+        /** See cbio_document_set_content_type() */
+        uint8_t content_type;
+        /** Set to 1 to delete the document */
+        int deleted;
+    } cbio_batch_entry_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,486 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * The async API runs the operations on a work queue and posts the
+ * results to a completion queue. The completion queue has a file
+ * descriptor (an eventfd, or the read end of a pipe) which is readable
+ * while there are completions to reap, so it may be added to the
+ * clients event loop.
+ *
+ * Only a single thread may write to a handle, so the stores and
+ * commits are executed in order by a single job at a time (the write
+ * lane). Stores queued behind each other are merged into a single
+ * call to cbio_store_documents, unless the handle deduplicates (the
+ * documents of separate stores must all be written). Gets run in
+ * parallel on the work queue if the handle is shared (see
+ * cbio_open_shared_handle), otherwise they go through the write lane
+ * as well.
+ */
+#include "internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+struct cbio_async_op {
+    /* Must be the first member (the work queue passes us this) */
+    struct cbio_work work;
+    cbio_async_t async;
+    cbio_completion_t completion;
+    void *id;
+    size_t nid;
+    libcbio_document_t *docs;
+    size_t ndocs;
+    struct cbio_async_op *next;
+};
+
+struct cbio_async_st {
+    libcbio_t handle;
+    struct cbio_workqueue *wq;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /* The number of operations not yet posted to the completion queue */
+    size_t outstanding;
+
+    /* The write lane */
+    struct cbio_work writer;
+    struct cbio_async_op *whead;
+    struct cbio_async_op *wtail;
+    int writer_active;
+
+    /* The completion queue */
+    struct cbio_async_op *chead;
+    struct cbio_async_op *ctail;
+    int notify[2];
+};
+
+static void cbio_async_notify(cbio_async_t async)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    uint64_t val = 1;
+    if (write(async->notify[1], &val, sizeof(val)) == -1) {
+        /* The counter can't overflow as we drain it */
+    }
+#else
+    if (write(async->notify[1], "", 1) == -1) {
+        /* The pipe is full, but then it is readable anyway */
+    }
+#endif
+}
+
+static void cbio_async_drain(cbio_async_t async)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    uint64_t val;
+    if (read(async->notify[0], &val, sizeof(val)) == -1) {
+        /* Not signalled */
+    }
+#else
+    char buffer[64];
+    while (read(async->notify[0], buffer, sizeof(buffer)) > 0) {
+        /* empty */
+    }
+#endif
+}
+
+static void cbio_async_complete(struct cbio_async_op *op,
+                                cbio_error_t status)
+{
+    cbio_async_t async = op->async;
+
+    op->completion.status = status;
+    op->next = NULL;
+
+    pthread_mutex_lock(&async->mutex);
+    if (async->ctail == NULL) {
+        async->chead = op;
+        cbio_async_notify(async);
+    } else {
+        async->ctail->next = op;
+    }
+    async->ctail = op;
+    if (--async->outstanding == 0) {
+        pthread_cond_broadcast(&async->cond);
+    }
+    pthread_mutex_unlock(&async->mutex);
+}
+
+/*
+ * Get the document and read the value so that the client won't block
+ * on disk when it calls cbio_document_get_value()
+ */
+static cbio_error_t cbio_async_get_document(struct cbio_async_op *op)
+{
+    libcbio_t handle = op->async->handle;
+    libcbio_document_t doc;
+    cbio_error_t err;
+    const void *ptr;
+    size_t nb;
+
+    err = cbio_get_document(handle, op->id, op->nid, &doc);
+    if (err != CBIO_SUCCESS) {
+        return err;
+    }
+
+    if ((err = cbio_document_get_value(doc, &ptr, &nb)) != CBIO_SUCCESS) {
+        cbio_document_release(doc);
+        return err;
+    }
+
+    op->completion.doc = doc;
+    return CBIO_SUCCESS;
+}
+
+static void cbio_async_get_job(struct cbio_work *work)
+{
+    struct cbio_async_op *op = (struct cbio_async_op *)work;
+    cbio_async_complete(op, cbio_async_get_document(op));
+}
+
+/*
+ * Store the stores at the head of the list with a single call, and
+ * return the first operation that isn't part of the batch
+ */
+static struct cbio_async_op *cbio_async_write_stores(libcbio_t handle,
+                                                     struct cbio_async_op *op)
+{
+    struct cbio_async_op *end;
+    struct cbio_async_op *next;
+    libcbio_document_t *docs = op->docs;
+    size_t ndocs = 0;
+    cbio_error_t err;
+
+    if (handle->dedup != CBIO_DEDUP_NONE) {
+        /* Only the documents of a single store are deduplicated */
+        end = op->next;
+        ndocs = op->ndocs;
+    } else {
+        for (end = op; end && end->completion.op == CBIO_ASYNC_STORE;
+             end = end->next) {
+            ndocs += end->ndocs;
+        }
+    }
+
+    if (end != op->next) {
+        docs = cbio_malloc(handle, ndocs * sizeof(libcbio_document_t));
+        if (docs != NULL) {
+            ndocs = 0;
+            for (next = op; next != end; next = next->next) {
+                memcpy(docs + ndocs, next->docs,
+                       next->ndocs * sizeof(libcbio_document_t));
+                ndocs += next->ndocs;
+            }
+        } else {
+            /* Store them one by one */
+            docs = op->docs;
+            ndocs = op->ndocs;
+            end = op->next;
+        }
+    }
+
+    err = cbio_store_documents(handle, docs, ndocs);
+    if (docs != op->docs) {
+        cbio_free(docs);
+    }
+
+    for (; op != end; op = next) {
+        next = op->next;
+        cbio_async_complete(op, err);
+    }
+
+    return end;
+}
+
+static void cbio_async_writer_job(struct cbio_work *work)
+{
+    cbio_async_t async = (cbio_async_t)((char *)work -
+                                        offsetof(struct cbio_async_st, writer));
+    struct cbio_async_op *op;
+    struct cbio_async_op *next;
+
+    for (;;) {
+        pthread_mutex_lock(&async->mutex);
+        if ((op = async->whead) == NULL) {
+            async->writer_active = 0;
+            pthread_mutex_unlock(&async->mutex);
+            return;
+        }
+        async->whead = async->wtail = NULL;
+        pthread_mutex_unlock(&async->mutex);
+
+        while (op != NULL) {
+            switch (op->completion.op) {
+            case CBIO_ASYNC_STORE:
+                op = cbio_async_write_stores(async->handle, op);
+                break;
+            case CBIO_ASYNC_COMMIT:
+                next = op->next;
+                cbio_async_complete(op, cbio_commit(async->handle));
+                op = next;
+                break;
+            case CBIO_ASYNC_GET:
+            default:
+                next = op->next;
+                cbio_async_complete(op, cbio_async_get_document(op));
+                op = next;
+                break;
+            }
+        }
+    }
+}
+
+static cbio_error_t cbio_async_submit(cbio_async_t async,
+                                      struct cbio_async_op *op)
+{
+    int writer = 0;
+
+    op->async = async;
+    pthread_mutex_lock(&async->mutex);
+    ++async->outstanding;
+    if (op->completion.op == CBIO_ASYNC_GET && async->handle->shared != NULL) {
+        pthread_mutex_unlock(&async->mutex);
+        op->work.fn = cbio_async_get_job;
+        cbio_workqueue_submit(async->wq, &op->work);
+        return CBIO_SUCCESS;
+    }
+
+    op->next = NULL;
+    if (async->wtail == NULL) {
+        async->whead = op;
+    } else {
+        async->wtail->next = op;
+    }
+    async->wtail = op;
+    if (!async->writer_active) {
+        async->writer_active = writer = 1;
+    }
+    pthread_mutex_unlock(&async->mutex);
+
+    if (writer) {
+        cbio_workqueue_submit(async->wq, &async->writer);
+    }
+
+    return CBIO_SUCCESS;
+}
+
+static struct cbio_async_op *cbio_async_op_create(cbio_async_t async,
+                                                  cbio_async_op_t type,
+                                                  const void *cookie)
+{
+    struct cbio_async_op *op = cbio_calloc(async->handle, 1, sizeof(*op));
+    if (op != NULL) {
+        op->completion.op = type;
+        op->completion.cookie = cookie;
+    }
+    return op;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_async_create(libcbio_t handle,
+                               unsigned int nthreads,
+                               cbio_async_t *async)
+{
+    cbio_async_t ret;
+    cbio_error_t err;
+
+    if (handle == NULL || async == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((ret = cbio_calloc(handle, 1, sizeof(*ret))) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+#ifdef HAVE_SYS_EVENTFD_H
+    ret->notify[0] = ret->notify[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ret->notify[0] == -1) {
+        cbio_free(ret);
+        return CBIO_ERROR_INTERNAL;
+    }
+#else
+    if (pipe(ret->notify) == -1) {
+        cbio_free(ret);
+        return CBIO_ERROR_INTERNAL;
+    }
+    (void)fcntl(ret->notify[0], F_SETFL, O_NONBLOCK);
+    (void)fcntl(ret->notify[1], F_SETFL, O_NONBLOCK);
+    (void)fcntl(ret->notify[0], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(ret->notify[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+    if ((err = cbio_workqueue_create(nthreads, &ret->wq)) != CBIO_SUCCESS) {
+        close(ret->notify[0]);
+        if (ret->notify[1] != ret->notify[0]) {
+            close(ret->notify[1]);
+        }
+        cbio_free(ret);
+        return err;
+    }
+
+    ret->handle = handle;
+    ret->writer.fn = cbio_async_writer_job;
+    pthread_mutex_init(&ret->mutex, NULL);
+    pthread_cond_init(&ret->cond, NULL);
+
+    *async = ret;
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+int cbio_async_get_fd(cbio_async_t async)
+{
+    return async->notify[0];
+}
+
+LIBCBIO_API
+cbio_error_t cbio_async_get(cbio_async_t async,
+                            const void *id,
+                            size_t nid,
+                            const void *cookie)
+{
+    struct cbio_async_op *op;
+
+    if (id == NULL || nid == 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((op = cbio_async_op_create(async, CBIO_ASYNC_GET, cookie)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    if ((op->id = cbio_malloc(async->handle, nid)) == NULL) {
+        cbio_free(op);
+        return CBIO_ERROR_ENOMEM;
+    }
+    memcpy(op->id, id, nid);
+    op->nid = nid;
+
+    return cbio_async_submit(async, op);
+}
+
+LIBCBIO_API
+cbio_error_t cbio_async_store(cbio_async_t async,
+                              libcbio_document_t *doc,
+                              size_t ndocs,
+                              const void *cookie)
+{
+    struct cbio_async_op *op;
+
+    if (doc == NULL || ndocs == 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((op = cbio_async_op_create(async, CBIO_ASYNC_STORE,
+                                   cookie)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    op->docs = cbio_malloc(async->handle, ndocs * sizeof(libcbio_document_t));
+    if (op->docs == NULL) {
+        cbio_free(op);
+        return CBIO_ERROR_ENOMEM;
+    }
+    memcpy(op->docs, doc, ndocs * sizeof(libcbio_document_t));
+    op->ndocs = ndocs;
+
+    return cbio_async_submit(async, op);
+}
+
+LIBCBIO_API
+cbio_error_t cbio_async_commit(cbio_async_t async, const void *cookie)
+{
+    struct cbio_async_op *op;
+
+    if ((op = cbio_async_op_create(async, CBIO_ASYNC_COMMIT,
+                                   cookie)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    return cbio_async_submit(async, op);
+}
+
+static void cbio_async_op_destroy(struct cbio_async_op *op)
+{
+    cbio_free(op->id);
+    cbio_free(op->docs);
+    cbio_free(op);
+}
+
+LIBCBIO_API
+size_t cbio_async_reap(cbio_async_t async,
+                       cbio_completion_t *completions,
+                       size_t max)
+{
+    struct cbio_async_op *op;
+    size_t ret = 0;
+
+    pthread_mutex_lock(&async->mutex);
+    while (ret < max && (op = async->chead) != NULL) {
+        if ((async->chead = op->next) == NULL) {
+            async->ctail = NULL;
+        }
+        completions[ret++] = op->completion;
+        cbio_async_op_destroy(op);
+    }
+
+    if (async->chead == NULL) {
+        /* We notify when the queue goes from empty to non-empty */
+        cbio_async_drain(async);
+    }
+    pthread_mutex_unlock(&async->mutex);
+
+    return ret;
+}
+
+LIBCBIO_API
+void cbio_async_destroy(cbio_async_t async)
+{
+    struct cbio_async_op *op;
+
+    pthread_mutex_lock(&async->mutex);
+    while (async->outstanding != 0) {
+        pthread_cond_wait(&async->cond, &async->mutex);
+    }
+    pthread_mutex_unlock(&async->mutex);
+
+    /* Wait for the write lane to notice that it is done */
+    cbio_workqueue_destroy(async->wq);
+
+    while ((op = async->chead) != NULL) {
+        async->chead = op->next;
+        if (op->completion.doc != NULL) {
+            cbio_document_release(op->completion.doc);
+        }
+        cbio_async_op_destroy(op);
+    }
+
+    close(async->notify[0]);
+    if (async->notify[1] != async->notify[0]) {
+        close(async->notify[1]);
+    }
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->mutex);
+    cbio_free(async);
+}
@@ -0,0 +1,354 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * A batch keeps the ids, meta and values of its entries in one buffer
+ * (the arena) and the DocInfo and Doc of every entry in the items
+ * array. The arena may move as it grows, so the items only record the
+ * offsets of their data until the batch is submitted. All of the
+ * buffers are kept when the batch is reset.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CBIO_BATCH_MIN_ARENA 4096
+#define CBIO_BATCH_MIN_ITEMS 64
+
+struct cbio_batch_item {
+    /* Must be the first member (we sort pointers to it) */
+    DocInfo info;
+    Doc doc;
+    /* The offsets in the arena */
+    size_t id;
+    size_t meta;
+    size_t value;
+    /* The order the entries were appended (to keep the sort stable) */
+    size_t seq;
+};
+
+struct cbio_batch_st {
+    libcbio_t handle;
+    char *arena;
+    size_t used;
+    size_t size;
+    struct cbio_batch_item *items;
+    size_t count;
+    size_t capacity;
+    /* The arrays passed to couchstore, with room for nprepared */
+    DocInfo **info;
+    Doc **docs;
+    Doc *shadow;
+    size_t nprepared;
+    /* The number of bytes in the values (for the probes) */
+    size_t nbytes;
+};
+
+static cbio_error_t cbio_batch_reserve(cbio_batch_t batch, size_t nb)
+{
+    size_t size;
+    char *arena;
+
+    if (batch->size - batch->used >= nb) {
+        return CBIO_SUCCESS;
+    }
+
+    if (nb > (size_t)-1 / 2 - batch->used) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    size = batch->size < CBIO_BATCH_MIN_ARENA ?
+           CBIO_BATCH_MIN_ARENA : batch->size;
+    while (size < batch->used + nb) {
+        size *= 2;
+    }
+
+    if ((arena = cbio_realloc(batch->handle, batch->arena, size)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    batch->arena = arena;
+    batch->size = size;
+
+    return CBIO_SUCCESS;
+}
+
+static cbio_error_t cbio_batch_grow(cbio_batch_t batch)
+{
+    struct cbio_batch_item *items;
+    size_t capacity;
+
+    if (batch->count < batch->capacity) {
+        return CBIO_SUCCESS;
+    }
+
+    capacity = batch->capacity == 0 ?
+               CBIO_BATCH_MIN_ITEMS : batch->capacity * 2;
+    if (capacity > (size_t)-1 / sizeof(*items)) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    items = cbio_realloc(batch->handle, batch->items,
+                         capacity * sizeof(*items));
+    if (items == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    batch->items = items;
+    batch->capacity = capacity;
+
+    return CBIO_SUCCESS;
+}
+
+/* Make room for all of the entries in the arrays passed to couchstore */
+static cbio_error_t cbio_batch_prepare_arrays(cbio_batch_t batch)
+{
+    size_t nb = batch->capacity;
+    DocInfo **info;
+    Doc **docs;
+    Doc *shadow;
+
+    if (batch->nprepared >= batch->count) {
+        return CBIO_SUCCESS;
+    }
+
+    info = cbio_realloc(batch->handle, batch->info, nb * sizeof(DocInfo *));
+    if (info == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    batch->info = info;
+
+    docs = cbio_realloc(batch->handle, batch->docs, nb * sizeof(Doc *));
+    if (docs == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    batch->docs = docs;
+
+    shadow = cbio_realloc(batch->handle, batch->shadow, nb * sizeof(Doc));
+    if (shadow == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    batch->shadow = shadow;
+    batch->nprepared = nb;
+
+    return CBIO_SUCCESS;
+}
+
+static int cbio_batch_compare(const void *a, const void *b)
+{
+    const struct cbio_batch_item *x;
+    const struct cbio_batch_item *y;
+    size_t nb;
+    int ret;
+
+    x = (const struct cbio_batch_item *)*(DocInfo *const *)a;
+    y = (const struct cbio_batch_item *)*(DocInfo *const *)b;
+    nb = x->info.id.size < y->info.id.size ?
+         x->info.id.size : y->info.id.size;
+
+    if ((ret = memcmp(x->info.id.buf, y->info.id.buf, nb)) != 0) {
+        return ret;
+    }
+    if (x->info.id.size != y->info.id.size) {
+        return x->info.id.size < y->info.id.size ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : (x->seq > y->seq ? 1 : 0);
+}
+
+LIBCBIO_API
+cbio_error_t cbio_batch_create(libcbio_t handle, cbio_batch_t *batch)
+{
+    cbio_batch_t ret;
+
+    if (handle == NULL || batch == NULL ||
+        handle->mode == CBIO_OPEN_RDONLY) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((ret = cbio_calloc(handle, 1, sizeof(*ret))) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    ret->handle = handle;
+
+    *batch = ret;
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_batch_append(cbio_batch_t batch,
+                               const cbio_batch_entry_t *entry)
+{
+    struct cbio_batch_item *item;
+    size_t nvalue;
+    size_t nb;
+    cbio_error_t err;
+
+    if (entry == NULL || entry->id == NULL || entry->nid == 0 ||
+        (entry->meta == NULL && entry->nmeta != 0) ||
+        cbio_is_local_id(entry->id, entry->nid)) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    nvalue = entry->deleted ? 0 : entry->nvalue;
+    if (entry->value == NULL && nvalue != 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    nb = entry->nid + entry->nmeta;
+    if (nb < entry->nid || nb + nvalue < nb) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    if ((err = cbio_batch_reserve(batch, nb + nvalue)) != CBIO_SUCCESS) {
+        return err;
+    }
+    if ((err = cbio_batch_grow(batch)) != CBIO_SUCCESS) {
+        return err;
+    }
+
+    item = batch->items + batch->count;
+    memset(item, 0, sizeof(*item));
+    item->seq = batch->count;
+
+    item->id = batch->used;
+    memcpy(batch->arena + batch->used, entry->id, entry->nid);
+    batch->used += entry->nid;
+    item->info.id.size = entry->nid;
+
+    item->meta = batch->used;
+    if (entry->nmeta > 0) {
+        memcpy(batch->arena + batch->used, entry->meta, entry->nmeta);
+        batch->used += entry->nmeta;
+    }
+    item->info.rev_meta.size = entry->nmeta;
+
+    item->value = batch->used;
+    if (nvalue > 0) {
+        memcpy(batch->arena + batch->used, entry->value, nvalue);
+        batch->used += nvalue;
+    }
+    item->doc.data.size = nvalue;
+
+    item->info.rev_seq = entry->revno;
+    item->info.content_meta = entry->content_type;
+    item->info.deleted = entry->deleted ? 1 : 0;
+
+    ++batch->count;
+    batch->nbytes += nvalue;
+
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+size_t cbio_batch_count(cbio_batch_t batch)
+{
+    return batch->count;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_batch_submit(cbio_batch_t batch)
+{
+    libcbio_t handle = batch->handle;
+    struct cbio_save_batch save;
+    uint64_t start = 0;
+    cbio_error_t ret;
+    size_t ndocs;
+    size_t ii;
+
+    if (batch->count == 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((ret = cbio_batch_prepare_arrays(batch)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    CBIO_PROBE_ENTRY(store_documents, CBIO_PROBE_STORE_DOCUMENTS, handle,
+                     0, batch->count, batch->nbytes);
+    if (handle->trace != NULL) {
+        start = cbio_trace_now();
+    }
+
+    /* The arena doesn't move until the next append */
+    for (ii = 0; ii < batch->count; ++ii) {
+        struct cbio_batch_item *item = batch->items + ii;
+        item->info.id.buf = batch->arena + item->id;
+        item->info.rev_meta.buf = batch->arena + item->meta;
+        item->doc.id = item->info.id;
+        item->doc.data.buf = batch->arena + item->value;
+        batch->info[ii] = &item->info;
+    }
+
+    qsort(batch->info, batch->count, sizeof(DocInfo *), cbio_batch_compare);
+    ndocs = batch->count;
+    if (handle->dedup != CBIO_DEDUP_NONE) {
+        /* The duplicates are sorted in the order they were appended */
+        ndocs = cbio_dedup_sorted(handle, batch->info, ndocs);
+    }
+    for (ii = 0; ii < ndocs; ++ii) {
+        struct cbio_batch_item *item =
+            (struct cbio_batch_item *)batch->info[ii];
+        batch->docs[ii] = item->info.deleted ? NULL : &item->doc;
+    }
+
+    memset(&save, 0, sizeof(save));
+    save.docs = batch->docs;
+    save.info = batch->info;
+    save.ndocs = ndocs;
+    if (handle->compression.codec != CBIO_COMPRESSION_NONE) {
+        memset(batch->shadow, 0, ndocs * sizeof(Doc));
+        save.shadow = batch->shadow;
+    }
+
+    ret = cbio_save_batch_prepare(handle, &save, 0, save.ndocs);
+    if (ret == CBIO_SUCCESS) {
+        ret = cbio_save_batch_write(handle, &save);
+    }
+    cbio_save_batch_restore(&save);
+
+    if (handle->trace != NULL) {
+        /* Record the size of the values, not the compressed bodies */
+        for (ii = 0; ii < ndocs; ++ii) {
+            struct cbio_batch_item *item =
+                (struct cbio_batch_item *)batch->info[ii];
+            batch->docs[ii] = item->info.deleted ? NULL : &item->doc;
+        }
+        cbio_trace_store_info(handle, start, ret, batch->info, batch->docs,
+                              ndocs);
+    }
+    CBIO_PROBE_RETURN(store_documents, CBIO_PROBE_STORE_DOCUMENTS, handle,
+                      0, batch->count, 0, ret);
+
+    return ret;
+}
+
+LIBCBIO_API
+void cbio_batch_reset(cbio_batch_t batch)
+{
+    batch->used = 0;
+    batch->count = 0;
+    batch->nbytes = 0;
+}
+
+LIBCBIO_API
+void cbio_batch_destroy(cbio_batch_t batch)
+{
+    cbio_free(batch->arena);
+    cbio_free(batch->items);
+    cbio_free(batch->info);
+    cbio_free(batch->docs);
+    cbio_free(batch->shadow);
+    cbio_free(batch);
+}
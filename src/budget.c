@@ -0,0 +1,222 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * A memory budget for the documents retained from changes scans.
+ * Every document a callback retains is charged to the budget (its
+ * metadata and the size of its body, which the consumer is likely to
+ * read), and the charge is returned when the document is released.
+ * The scan waits before delivering a document that doesn't fit in
+ * the budget until the consumer releases enough documents.
+ */
+#include "internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+struct cbio_budget_st {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t limit;
+    size_t used;
+};
+
+struct cbio_budget_ctx {
+    libcbio_t handle;
+    cbio_budget_t budget;
+    int timeout;
+    cbio_changes_callback_fn callback;
+    void *ctx;
+    cbio_error_t status;
+};
+
+LIBCBIO_API
+cbio_error_t cbio_budget_create(size_t limit, cbio_budget_t *budget)
+{
+    cbio_budget_t ret;
+
+    if (limit == 0 || budget == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((ret = cbio_calloc(NULL, 1, sizeof(*ret))) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    pthread_mutex_init(&ret->mutex, NULL);
+    pthread_cond_init(&ret->cond, NULL);
+    ret->limit = limit;
+    *budget = ret;
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+size_t cbio_budget_get_used(cbio_budget_t budget)
+{
+    size_t ret;
+
+    pthread_mutex_lock(&budget->mutex);
+    ret = budget->used;
+    pthread_mutex_unlock(&budget->mutex);
+
+    return ret;
+}
+
+LIBCBIO_API
+void cbio_budget_destroy(cbio_budget_t budget)
+{
+    if (budget != NULL) {
+        pthread_cond_destroy(&budget->cond);
+        pthread_mutex_destroy(&budget->mutex);
+        cbio_free(budget);
+    }
+}
+
+/*
+ * Reserve nbytes from the budget. A document larger than the whole
+ * budget is let through when nothing else is charged, so it can't
+ * block the scan forever.
+ */
+static cbio_error_t cbio_budget_reserve(cbio_budget_t budget,
+                                        size_t nbytes,
+                                        int timeout)
+{
+    struct timespec deadline;
+    cbio_error_t ret = CBIO_SUCCESS;
+
+    if (timeout > 0) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        deadline.tv_sec = tv.tv_sec + timeout / 1000;
+        deadline.tv_nsec = (long)tv.tv_usec * 1000 +
+                           (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&budget->mutex);
+    while (budget->used != 0 && budget->used + nbytes > budget->limit) {
+        if (timeout == 0) {
+            ret = CBIO_ERROR_TIMEOUT;
+            break;
+        } else if (timeout < 0) {
+            pthread_cond_wait(&budget->cond, &budget->mutex);
+        } else if (pthread_cond_timedwait(&budget->cond, &budget->mutex,
+                                          &deadline) == ETIMEDOUT) {
+            ret = CBIO_ERROR_TIMEOUT;
+            break;
+        }
+    }
+
+    if (ret == CBIO_SUCCESS) {
+        budget->used += nbytes;
+    }
+    pthread_mutex_unlock(&budget->mutex);
+
+    return ret;
+}
+
+void cbio_budget_release(cbio_budget_t budget, size_t nbytes)
+{
+    pthread_mutex_lock(&budget->mutex);
+    budget->used -= nbytes;
+    pthread_cond_broadcast(&budget->cond);
+    pthread_mutex_unlock(&budget->mutex);
+}
+
+static int cbio_budget_callback(Db *db, DocInfo *docinfo, void *ctx)
+{
+    struct cbio_budget_ctx *bctx = ctx;
+    libcbio_document_t doc;
+    size_t charge;
+
+    (void)db;
+    /* Abort the scan on failures rather than walk the rest of the
+     * file, the status is reported instead */
+    if (bctx->status != CBIO_SUCCESS) {
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+
+    charge = sizeof(*doc) + sizeof(DocInfo) + docinfo->id.size +
+             docinfo->rev_meta.size + docinfo->size;
+    bctx->status = cbio_budget_reserve(bctx->budget, charge, bctx->timeout);
+    if (bctx->status != CBIO_SUCCESS) {
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+
+    if ((doc = cbio_calloc(bctx->handle, 1, sizeof(*doc))) == NULL) {
+        cbio_budget_release(bctx->budget, charge);
+        bctx->status = CBIO_ERROR_ENOMEM;
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+
+    doc->info = docinfo;
+    doc->handle = bctx->handle;
+    doc->budget = bctx->budget;
+    doc->charge = charge;
+
+    if (bctx->callback(bctx->handle, doc, bctx->ctx) == 0) {
+        /* couchstore frees the DocInfo. Releasing the document returns
+         * the charge and anything the callback read */
+        doc->info = NULL;
+        cbio_document_release(doc);
+        return 0;
+    }
+
+    return 1;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_changes_since_budget(libcbio_t handle,
+                                       uint64_t since,
+                                       cbio_budget_t budget,
+                                       int timeout,
+                                       cbio_changes_callback_fn callback,
+                                       void *ctx)
+{
+    struct cbio_budget_ctx bctx;
+    struct cbio_reader *reader;
+    couchstore_error_t err;
+    cbio_error_t ret;
+    Db *db;
+
+    if (handle == NULL || budget == NULL || callback == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    bctx.handle = handle;
+    bctx.budget = budget;
+    bctx.timeout = timeout;
+    bctx.callback = callback;
+    bctx.ctx = ctx;
+    bctx.status = CBIO_SUCCESS;
+
+    if ((ret = cbio_acquire_db(handle, &db, &reader)) != CBIO_SUCCESS) {
+        return ret;
+    }
+    err = couchstore_changes_since(db, since, 0, cbio_budget_callback, &bctx);
+    cbio_release_db(handle, db, reader);
+
+    if (bctx.status != CBIO_SUCCESS) {
+        return bctx.status;
+    }
+    return cbio_remap_error(err);
+}
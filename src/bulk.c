@@ -0,0 +1,254 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * The bulk writer runs a two stage pipeline: the bodies of the batch
+ * appended last are prepared (compressed) by the worker threads while
+ * the thread calling cbio_bulk_writer_append() writes the previous
+ * batch to the file. Only the calling thread touches the couchstore
+ * handle, so the batches are written in the order they were appended.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Don't split a batch in smaller pieces than this */
+#define CBIO_BULK_MIN_CHUNK 64
+
+struct cbio_bulk_batch;
+
+struct cbio_bulk_task {
+    /* Must be the first member (the work queue passes us this) */
+    struct cbio_work work;
+    struct cbio_bulk_batch *batch;
+    size_t offset;
+    size_t ndocs;
+};
+
+struct cbio_bulk_batch {
+    libcbio_t handle;
+    libcbio_document_t *docs;
+    size_t ndocs;
+    struct cbio_save_batch save;
+    struct cbio_bulk_task *tasks;
+    struct cbio_latch latch;
+    cbio_error_t error;
+};
+
+struct cbio_bulk_writer_st {
+    libcbio_t handle;
+    struct cbio_workqueue *wq;
+    unsigned int nthreads;
+    /* The batch currently being prepared by the workers */
+    struct cbio_bulk_batch *pending;
+    cbio_error_t error;
+};
+
+static void cbio_release_documents(libcbio_document_t *doc, size_t ndocs)
+{
+    size_t ii;
+    for (ii = 0; ii < ndocs; ++ii) {
+        cbio_document_release(doc[ii]);
+    }
+}
+
+static void cbio_bulk_prepare(struct cbio_work *work)
+{
+    struct cbio_bulk_task *task = (struct cbio_bulk_task *)work;
+    struct cbio_bulk_batch *batch = task->batch;
+    cbio_error_t err;
+
+    err = cbio_save_batch_prepare(batch->handle, &batch->save,
+                                   task->offset, task->ndocs);
+    if (err != CBIO_SUCCESS) {
+        pthread_mutex_lock(&batch->latch.mutex);
+        if (batch->error == CBIO_SUCCESS) {
+            batch->error = err;
+        }
+        pthread_mutex_unlock(&batch->latch.mutex);
+    }
+
+    cbio_latch_count_down(&batch->latch);
+}
+
+static void cbio_bulk_batch_destroy(struct cbio_bulk_batch *batch)
+{
+    cbio_save_batch_destroy(&batch->save);
+    cbio_release_documents(batch->docs, batch->ndocs);
+    cbio_latch_destroy(&batch->latch);
+    cbio_free(batch->tasks);
+    cbio_free(batch->docs);
+    cbio_free(batch);
+}
+
+static cbio_error_t cbio_bulk_batch_create(cbio_bulk_writer_t writer,
+                                           libcbio_document_t *doc,
+                                           size_t ndocs,
+                                           struct cbio_bulk_batch **ret)
+{
+    struct cbio_bulk_batch *batch;
+    size_t chunk;
+    size_t ntasks;
+    size_t ii;
+
+    if ((batch = cbio_calloc(writer->handle, 1, sizeof(*batch))) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    batch->handle = writer->handle;
+    batch->ndocs = ndocs;
+    batch->docs = cbio_malloc(writer->handle,
+                              ndocs * sizeof(libcbio_document_t));
+    if (batch->docs == NULL) {
+        cbio_free(batch);
+        return CBIO_ERROR_ENOMEM;
+    }
+    memcpy(batch->docs, doc, ndocs * sizeof(libcbio_document_t));
+
+    if (cbio_save_batch_init(writer->handle, &batch->save, batch->docs,
+                             ndocs) != CBIO_SUCCESS) {
+        cbio_free(batch->docs);
+        cbio_free(batch);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    /* Split the regular documents between the worker threads */
+    chunk = (batch->save.ndocs + writer->nthreads - 1) / writer->nthreads;
+    if (chunk < CBIO_BULK_MIN_CHUNK) {
+        chunk = CBIO_BULK_MIN_CHUNK;
+    }
+    ntasks = (batch->save.ndocs + chunk - 1) / chunk;
+
+    batch->tasks = cbio_calloc(writer->handle, ntasks,
+                               sizeof(struct cbio_bulk_task));
+    if (batch->tasks == NULL) {
+        cbio_save_batch_destroy(&batch->save);
+        cbio_free(batch->docs);
+        cbio_free(batch);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    cbio_latch_init(&batch->latch, ntasks);
+    for (ii = 0; ii < ntasks; ++ii) {
+        struct cbio_bulk_task *task = batch->tasks + ii;
+        task->work.fn = cbio_bulk_prepare;
+        task->batch = batch;
+        task->offset = ii * chunk;
+        task->ndocs = ii == ntasks - 1 ? batch->save.ndocs - task->offset : chunk;
+        cbio_workqueue_submit(writer->wq, &task->work);
+    }
+
+    *ret = batch;
+    return CBIO_SUCCESS;
+}
+
+static cbio_error_t cbio_bulk_batch_write(struct cbio_bulk_batch *batch)
+{
+    cbio_error_t ret;
+
+    cbio_latch_wait(&batch->latch);
+    ret = batch->error;
+    if (ret == CBIO_SUCCESS) {
+        ret = cbio_save_batch_write(batch->handle, &batch->save);
+    }
+    cbio_bulk_batch_destroy(batch);
+
+    return ret;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_bulk_writer_create(libcbio_t handle,
+                                     unsigned int nthreads,
+                                     cbio_bulk_writer_t *writer)
+{
+    cbio_bulk_writer_t ret;
+    cbio_error_t err;
+
+    if (handle == NULL || writer == NULL ||
+        handle->mode == CBIO_OPEN_RDONLY) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((ret = cbio_calloc(handle, 1, sizeof(*ret))) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    ret->handle = handle;
+    ret->nthreads = nthreads == 0 ? cbio_default_concurrency() : nthreads;
+    if ((err = cbio_workqueue_create(ret->nthreads, &ret->wq)) != CBIO_SUCCESS) {
+        cbio_free(ret);
+        return err;
+    }
+
+    *writer = ret;
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_bulk_writer_append(cbio_bulk_writer_t writer,
+                                     libcbio_document_t *doc,
+                                     size_t ndocs)
+{
+    struct cbio_bulk_batch *batch;
+    cbio_error_t err;
+
+    if (ndocs == 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if (writer->error != CBIO_SUCCESS) {
+        cbio_release_documents(doc, ndocs);
+        return writer->error;
+    }
+
+    if ((err = cbio_bulk_batch_create(writer, doc, ndocs,
+                                      &batch)) != CBIO_SUCCESS) {
+        cbio_release_documents(doc, ndocs);
+        return err;
+    }
+
+    err = cbio_bulk_writer_flush(writer);
+    writer->pending = batch;
+    return err;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_bulk_writer_flush(cbio_bulk_writer_t writer)
+{
+    if (writer->pending != NULL) {
+        if (writer->error == CBIO_SUCCESS) {
+            writer->error = cbio_bulk_batch_write(writer->pending);
+        } else {
+            /* Don't write anything after a failure */
+            cbio_latch_wait(&writer->pending->latch);
+            cbio_bulk_batch_destroy(writer->pending);
+        }
+        writer->pending = NULL;
+    }
+
+    return writer->error;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_bulk_writer_destroy(cbio_bulk_writer_t writer)
+{
+    cbio_error_t ret = cbio_bulk_writer_flush(writer);
+    cbio_workqueue_destroy(writer->wq);
+    cbio_free(writer);
+    return ret;
+}
@@ -0,0 +1,208 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Deliver the changes in batches. The DocInfo couchstore hands us
+ * for every row is copied (with the id and the revision meta) into an
+ * arena, and couchstore frees its copy as soon as we return. The
+ * documents passed to the callback are a preallocated array pointing
+ * into the arena, so delivering a batch doesn't allocate anything.
+ * The arena is reused for the next batch once the callback returns.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CBIO_ARENA_ALIGN(sz) (((sz) + 7) & ~(size_t)7)
+
+/* The initial size of the arena per document in the batch */
+#define CBIO_ARENA_ROW_SIZE 128
+
+struct cbio_changes_batch {
+    libcbio_t handle;
+    cbio_changes_batch_callback_fn callback;
+    void *ctx;
+    int stopped;
+    int nomem;
+    /* The number of documents delivered (for the trace) */
+    uint32_t delivered;
+
+    struct libcbio_document_st *docs;
+    libcbio_document_t *batch;
+    size_t ndocs;
+    size_t max;
+
+    char *arena;
+    size_t used;
+    size_t size;
+};
+
+static void cbio_changes_batch_flush(struct cbio_changes_batch *b)
+{
+    size_t ii;
+
+    if (b->ndocs == 0) {
+        return;
+    }
+
+    b->delivered += (uint32_t)b->ndocs;
+    if (b->callback(b->handle, b->batch, b->ndocs, b->ctx) != 0) {
+        b->stopped = 1;
+    }
+
+    for (ii = 0; ii < b->ndocs; ++ii) {
+        /* The DocInfo lives in the arena, but the callback may have
+         * read the body */
+        b->docs[ii].info = NULL;
+        cbio_document_reinitialize(b->docs + ii);
+    }
+
+    b->ndocs = 0;
+    b->used = 0;
+}
+
+static int cbio_changes_batch_callback(Db *db, DocInfo *docinfo, void *ctx)
+{
+    struct cbio_changes_batch *b = ctx;
+    size_t needed;
+    DocInfo *info;
+    char *ptr;
+
+    (void)db;
+    if (b->stopped) {
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+
+    needed = CBIO_ARENA_ALIGN(sizeof(DocInfo) + docinfo->id.size +
+                              docinfo->rev_meta.size);
+    if (b->size - b->used < needed) {
+        cbio_changes_batch_flush(b);
+        if (b->stopped) {
+            return COUCHSTORE_ERROR_CANCEL;
+        }
+        if (b->size < needed) {
+            /* The arena is empty, so it is safe to move it */
+            if ((ptr = cbio_realloc(b->handle, b->arena, needed)) == NULL) {
+                b->stopped = b->nomem = 1;
+                return COUCHSTORE_ERROR_CANCEL;
+            }
+            b->arena = ptr;
+            b->size = needed;
+        }
+    }
+
+    ptr = b->arena + b->used;
+    b->used += needed;
+
+    info = (DocInfo *)ptr;
+    *info = *docinfo;
+    ptr += sizeof(DocInfo);
+    info->id.buf = ptr;
+    memcpy(ptr, docinfo->id.buf, docinfo->id.size);
+    ptr += docinfo->id.size;
+    info->rev_meta.buf = ptr;
+    if (docinfo->rev_meta.size > 0) {
+        memcpy(ptr, docinfo->rev_meta.buf, docinfo->rev_meta.size);
+    }
+
+    b->docs[b->ndocs].info = info;
+    b->batch[b->ndocs] = b->docs + b->ndocs;
+    if (++b->ndocs == b->max) {
+        cbio_changes_batch_flush(b);
+    }
+
+    /* Abort the scan rather than walk the rest of the file */
+    return b->stopped ? COUCHSTORE_ERROR_CANCEL : 0;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_changes_since_batch(libcbio_t handle,
+                                      uint64_t since,
+                                      size_t batchsize,
+                                      cbio_changes_batch_callback_fn callback,
+                                      void *ctx)
+{
+    struct cbio_changes_batch b;
+    struct cbio_reader *reader;
+    couchstore_error_t err;
+    cbio_error_t ret;
+    uint64_t start = 0;
+    size_t ii;
+    Db *db;
+
+    if (handle == NULL || batchsize == 0 || callback == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    CBIO_PROBE_ENTRY(changes_since, CBIO_PROBE_CHANGES_SINCE, handle,
+                     0, 0, 0);
+    if (handle->trace != NULL) {
+        start = cbio_trace_now();
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.handle = handle;
+    b.callback = callback;
+    b.ctx = ctx;
+    b.max = batchsize;
+    b.size = batchsize * CBIO_ARENA_ROW_SIZE;
+    b.docs = cbio_calloc(handle, batchsize,
+                         sizeof(struct libcbio_document_st));
+    b.batch = cbio_calloc(handle, batchsize, sizeof(libcbio_document_t));
+    b.arena = cbio_malloc(handle, b.size);
+
+    if (b.docs == NULL || b.batch == NULL || b.arena == NULL) {
+        ret = CBIO_ERROR_ENOMEM;
+    } else if ((ret = cbio_acquire_db(handle, &db, &reader)) == CBIO_SUCCESS) {
+        for (ii = 0; ii < batchsize; ++ii) {
+            b.docs[ii].handle = handle;
+        }
+
+        err = couchstore_changes_since(db, since, 0,
+                                       cbio_changes_batch_callback, &b);
+        if (b.stopped && !b.nomem && err == COUCHSTORE_ERROR_CANCEL) {
+            /* The callback asked us to stop */
+            err = COUCHSTORE_SUCCESS;
+        }
+        if (err == COUCHSTORE_SUCCESS) {
+            cbio_changes_batch_flush(&b);
+        } else {
+            /* Don't deliver a partial batch after an error */
+            for (ii = 0; ii < b.ndocs; ++ii) {
+                b.docs[ii].info = NULL;
+                cbio_document_reinitialize(b.docs + ii);
+            }
+        }
+        cbio_release_db(handle, db, reader);
+
+        ret = b.nomem ? CBIO_ERROR_ENOMEM : cbio_remap_error(err);
+    }
+
+    cbio_free(b.docs);
+    cbio_free(b.batch);
+    cbio_free(b.arena);
+
+    if (handle->trace != NULL) {
+        cbio_trace_op(handle, CBIO_TRACE_CHANGES, start, ret, b.delivered,
+                      since);
+    }
+    CBIO_PROBE_RETURN(changes_since, CBIO_PROBE_CHANGES_SINCE, handle,
+                      0, b.delivered, 0, ret);
+
+    return ret;
+}
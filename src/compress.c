@@ -0,0 +1,655 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_SNAPPY_C_H
+#include <snappy-c.h>
+#endif
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_ZDICT_H)
+#define CBIO_HAVE_ZSTD 1
+#include <stdio.h>
+#include <zstd.h>
+#include <zdict.h>
+
+/*
+ * The dictionaries are stored as local documents named by their
+ * dictionary id, so that we may decompress documents compressed with
+ * an older dictionary after a new one is trained. The id of the
+ * dictionary to use for new documents is stored in CBIO_DICT_CURRENT
+ */
+#define CBIO_DICT_CURRENT "_local/cbio/dictionary"
+#define CBIO_DICT_PREFIX "_local/cbio/dictionary/"
+#define CBIO_DICT_LEVEL 3
+
+struct cbio_dictionary {
+    unsigned int id;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+    struct cbio_dictionary *next;
+};
+#endif
+
+#ifdef CBIO_HAVE_ZSTD
+/*
+ * The list of dictionaries only grows while the handle is open, and
+ * new dictionaries are pushed with a compare and swap so that readers
+ * of a shared handle may look up (and load) dictionaries concurrently.
+ */
+static cbio_error_t cbio_get_dictionary(libcbio_t handle,
+                                        Db *db,
+                                        unsigned int id,
+                                        struct cbio_dictionary **dict)
+{
+    struct cbio_dictionary *ret;
+    char name[sizeof(CBIO_DICT_PREFIX) + 10];
+    LocalDoc *ldoc;
+    couchstore_error_t err;
+    int nname;
+
+    for (ret = handle->compression.dictionaries; ret; ret = ret->next) {
+        if (ret->id == id) {
+            *dict = ret;
+            return CBIO_SUCCESS;
+        }
+    }
+
+    nname = sprintf(name, "%s%u", CBIO_DICT_PREFIX, id);
+    err = couchstore_open_local_document(db, name, (size_t)nname, &ldoc);
+    if (err != COUCHSTORE_SUCCESS) {
+        return cbio_remap_error(err);
+    }
+
+    if ((ret = cbio_calloc(handle, 1, sizeof(*ret))) == NULL) {
+        couchstore_free_local_document(ldoc);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    ret->id = id;
+    ret->cdict = ZSTD_createCDict(ldoc->json.buf, ldoc->json.size,
+                                  CBIO_DICT_LEVEL);
+    ret->ddict = ZSTD_createDDict(ldoc->json.buf, ldoc->json.size);
+    couchstore_free_local_document(ldoc);
+    if (ret->cdict == NULL || ret->ddict == NULL) {
+        ZSTD_freeCDict(ret->cdict);
+        ZSTD_freeDDict(ret->ddict);
+        cbio_free(ret);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    do {
+        struct cbio_dictionary *head = handle->compression.dictionaries;
+        struct cbio_dictionary *ptr;
+
+        for (ptr = head; ptr; ptr = ptr->next) {
+            if (ptr->id == id) {
+                /* Someone else loaded it in the meantime */
+                ZSTD_freeCDict(ret->cdict);
+                ZSTD_freeDDict(ret->ddict);
+                cbio_free(ret);
+                *dict = ptr;
+                return CBIO_SUCCESS;
+            }
+        }
+        ret->next = head;
+    } while (!__sync_bool_compare_and_swap(&handle->compression.dictionaries,
+                                           ret->next, ret));
+
+    *dict = ret;
+    return CBIO_SUCCESS;
+}
+
+static cbio_error_t cbio_load_current_dictionary(libcbio_t handle)
+{
+    LocalDoc *ldoc;
+    couchstore_error_t err;
+    char id[11];
+
+    err = couchstore_open_local_document(handle->couchstore_handle,
+                                         CBIO_DICT_CURRENT,
+                                         sizeof(CBIO_DICT_CURRENT) - 1,
+                                         &ldoc);
+    if (err != COUCHSTORE_SUCCESS) {
+        return cbio_remap_error(err);
+    }
+
+    if (ldoc->json.size == 0 || ldoc->json.size >= sizeof(id)) {
+        couchstore_free_local_document(ldoc);
+        return CBIO_ERROR_CORRUPT;
+    }
+    memcpy(id, ldoc->json.buf, ldoc->json.size);
+    id[ldoc->json.size] = '\0';
+    couchstore_free_local_document(ldoc);
+
+    return cbio_get_dictionary(handle, handle->couchstore_handle,
+                               (unsigned int)strtoul(id, NULL, 10),
+                               &handle->compression.dictionary);
+}
+
+struct cbio_samples {
+    char *data;
+    size_t used;
+    size_t size;
+    size_t *sizes;
+    size_t nsamples;
+    size_t max_samples;
+    cbio_error_t error;
+};
+
+static int cbio_collect_sample(libcbio_t handle,
+                               libcbio_document_t doc,
+                               void *ctx)
+{
+    struct cbio_samples *samples = ctx;
+    const void *value;
+    size_t nvalue;
+
+    if (samples->error != CBIO_SUCCESS ||
+        samples->nsamples == samples->max_samples ||
+        cbio_document_get_value(doc, &value, &nvalue) != CBIO_SUCCESS ||
+        nvalue == 0) {
+        return 0;
+    }
+
+    if (samples->used + nvalue > samples->size) {
+        size_t size = samples->size == 0 ? 65536 : samples->size;
+        char *ptr;
+        while (samples->used + nvalue > size) {
+            size *= 2;
+        }
+        if ((ptr = cbio_realloc(handle, samples->data, size)) == NULL) {
+            samples->error = CBIO_ERROR_ENOMEM;
+            return 0;
+        }
+        samples->data = ptr;
+        samples->size = size;
+    }
+
+    memcpy(samples->data + samples->used, value, nvalue);
+    samples->used += nvalue;
+    samples->sizes[samples->nsamples++] = nvalue;
+
+    return 0;
+}
+
+static cbio_error_t cbio_save_dictionary(libcbio_t handle,
+                                         const void *dict,
+                                         size_t ndict,
+                                         unsigned int id)
+{
+    char name[sizeof(CBIO_DICT_PREFIX) + 10];
+    LocalDoc ldoc;
+    couchstore_error_t err;
+
+    ldoc.id.buf = name;
+    ldoc.id.size = (size_t)sprintf(name, "%s%u", CBIO_DICT_PREFIX, id);
+    ldoc.json.buf = (char *)dict;
+    ldoc.json.size = ndict;
+    ldoc.deleted = 0;
+    err = couchstore_save_local_document(handle->couchstore_handle, &ldoc);
+    if (err == COUCHSTORE_SUCCESS) {
+        ldoc.id.buf = (char *)CBIO_DICT_CURRENT;
+        ldoc.id.size = sizeof(CBIO_DICT_CURRENT) - 1;
+        ldoc.json.buf = name + sizeof(CBIO_DICT_PREFIX) - 1;
+        ldoc.json.size = strlen(ldoc.json.buf);
+        err = couchstore_save_local_document(handle->couchstore_handle,
+                                             &ldoc);
+    }
+
+    if (err == COUCHSTORE_SUCCESS) {
+        handle->dirty = 1;
+    }
+
+    return cbio_remap_error(err);
+}
+#endif
+
+LIBCBIO_API
+cbio_error_t cbio_train_dictionary(libcbio_t handle,
+                                   uint64_t since,
+                                   size_t max_samples,
+                                   size_t dict_size)
+{
+#ifdef CBIO_HAVE_ZSTD
+    struct cbio_samples samples;
+    cbio_error_t ret;
+    void *dict;
+    size_t ndict;
+
+    if (handle == NULL || handle->mode == CBIO_OPEN_RDONLY ||
+        max_samples == 0 || dict_size == 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    memset(&samples, 0, sizeof(samples));
+    samples.max_samples = max_samples;
+    samples.sizes = cbio_calloc(handle, max_samples, sizeof(size_t));
+    if (samples.sizes == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    ret = cbio_changes_since(handle, since, cbio_collect_sample, &samples);
+    if (ret == CBIO_SUCCESS) {
+        ret = samples.error;
+    }
+
+    if (ret == CBIO_SUCCESS && samples.nsamples == 0) {
+        ret = CBIO_ERROR_ENOENT;
+    }
+
+    if (ret == CBIO_SUCCESS) {
+        if ((dict = cbio_malloc(handle, dict_size)) == NULL) {
+            ret = CBIO_ERROR_ENOMEM;
+        } else {
+            ndict = ZDICT_trainFromBuffer(dict, dict_size, samples.data,
+                                          samples.sizes,
+                                          (unsigned)samples.nsamples);
+            if (ZDICT_isError(ndict)) {
+                ret = CBIO_ERROR_EINVAL;
+            } else {
+                unsigned int id = ZDICT_getDictID(dict, ndict);
+                ret = cbio_save_dictionary(handle, dict, ndict, id);
+                if (ret == CBIO_SUCCESS) {
+                    ret = cbio_get_dictionary(handle,
+                                              handle->couchstore_handle, id,
+                                              &handle->compression.dictionary);
+                }
+            }
+            cbio_free(dict);
+        }
+    }
+
+    cbio_free(samples.data);
+    cbio_free(samples.sizes);
+    return ret;
+#else
+    (void)handle;
+    (void)since;
+    (void)max_samples;
+    (void)dict_size;
+    return CBIO_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+void cbio_release_dictionaries(libcbio_t handle)
+{
+#ifdef CBIO_HAVE_ZSTD
+    struct cbio_dictionary *dict = handle->compression.dictionaries;
+    while (dict != NULL) {
+        struct cbio_dictionary *next = dict->next;
+        ZSTD_freeCDict(dict->cdict);
+        ZSTD_freeDDict(dict->ddict);
+        cbio_free(dict);
+        dict = next;
+    }
+    handle->compression.dictionaries = NULL;
+    handle->compression.dictionary = NULL;
+#else
+    (void)handle;
+#endif
+}
+
+void cbio_reload_dictionary(libcbio_t handle)
+{
+#ifdef CBIO_HAVE_ZSTD
+    handle->compression.dictionary = NULL;
+    if (handle->compression.codec == CBIO_COMPRESSION_ZSTD_DICT &&
+        cbio_load_current_dictionary(handle) != CBIO_SUCCESS) {
+        /* The dictionary was trained after the header we rolled back to */
+        handle->compression.codec = CBIO_COMPRESSION_NONE;
+    }
+#else
+    (void)handle;
+#endif
+}
+
+cbio_error_t cbio_decompress_document(libcbio_t handle,
+                                      Db *db,
+                                      libcbio_document_t doc)
+{
+#ifdef CBIO_HAVE_ZSTD
+    struct cbio_dictionary *dict;
+    uint64_t size;
+    ZSTD_DCtx *dctx;
+    cbio_error_t ret;
+    sized_buf *data = &doc->doc->data;
+    void *ptr;
+    size_t nb;
+
+    ret = cbio_get_dictionary(handle, db,
+                              ZSTD_getDictID_fromFrame(data->buf, data->size),
+                              &dict);
+    if (ret != CBIO_SUCCESS) {
+        return ret == CBIO_ERROR_ENOENT ? CBIO_ERROR_CORRUPT : ret;
+    }
+
+    size = ZSTD_getFrameContentSize(data->buf, data->size);
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR) {
+        return CBIO_ERROR_CORRUPT;
+    }
+
+    if ((ptr = cbio_malloc(handle, size == 0 ? 1 : (size_t)size)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    if ((dctx = ZSTD_createDCtx()) == NULL) {
+        cbio_free(ptr);
+        return CBIO_ERROR_ENOMEM;
+    }
+    nb = ZSTD_decompress_usingDDict(dctx, ptr, (size_t)size, data->buf,
+                                    data->size, dict->ddict);
+    ZSTD_freeDCtx(dctx);
+
+    if (ZSTD_isError(nb) || nb != size) {
+        cbio_free(ptr);
+        return CBIO_ERROR_CORRUPT;
+    }
+
+    cbio_free(doc->tmp_alloc_bp);
+    doc->tmp_alloc_bp = ptr;
+    data->buf = ptr;
+    data->size = nb;
+    return CBIO_SUCCESS;
+#else
+    (void)handle;
+    (void)db;
+    (void)doc;
+    return CBIO_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+LIBCBIO_API
+cbio_error_t cbio_set_compression(libcbio_t handle,
+                                  cbio_compression_t codec,
+                                  size_t min_size,
+                                  unsigned int max_ratio)
+{
+    if (handle == NULL || max_ratio > 100) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    switch (codec) {
+    case CBIO_COMPRESSION_NONE:
+        break;
+    case CBIO_COMPRESSION_SNAPPY:
+#ifdef HAVE_SNAPPY_C_H
+        break;
+#else
+        return CBIO_ERROR_NOT_SUPPORTED;
+#endif
+    case CBIO_COMPRESSION_ZSTD_DICT:
+#ifdef CBIO_HAVE_ZSTD
+        if (handle->compression.dictionary == NULL) {
+            cbio_error_t err = cbio_load_current_dictionary(handle);
+            if (err != CBIO_SUCCESS) {
+                return err;
+            }
+        }
+        break;
+#else
+        return CBIO_ERROR_NOT_SUPPORTED;
+#endif
+    default:
+        return CBIO_ERROR_EINVAL;
+    }
+
+    handle->compression.codec = codec;
+    handle->compression.min_size = min_size;
+    handle->compression.max_ratio = max_ratio;
+    return CBIO_SUCCESS;
+}
+
+cbio_error_t cbio_save_batch_init(libcbio_t handle,
+                                  struct cbio_save_batch *batch,
+                                  libcbio_document_t *doc,
+                                  size_t ndocs)
+{
+    size_t ii;
+    size_t jj;
+
+    memset(batch, 0, sizeof(*batch));
+    batch->source = doc;
+    batch->nsource = ndocs;
+    for (ii = 0; ii < ndocs; ++ii) {
+        if (cbio_is_local_id(doc[ii]->info->id.buf, doc[ii]->info->id.size)) {
+            ++batch->nlocal;
+        }
+    }
+
+    batch->ndocs = ndocs - batch->nlocal;
+    if (batch->ndocs == 0) {
+        return CBIO_SUCCESS;
+    }
+
+    batch->docs = cbio_calloc(handle, batch->ndocs, sizeof(Doc *));
+    batch->info = cbio_calloc(handle, batch->ndocs, sizeof(DocInfo *));
+    if (handle->compression.codec != CBIO_COMPRESSION_NONE) {
+        batch->shadow = cbio_calloc(handle, batch->ndocs, sizeof(Doc));
+    }
+
+    if (batch->docs == NULL || batch->info == NULL ||
+        (handle->compression.codec != CBIO_COMPRESSION_NONE &&
+         batch->shadow == NULL)) {
+        cbio_free(batch->docs);
+        cbio_free(batch->info);
+        cbio_free(batch->shadow);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    for (ii = jj = 0; ii < ndocs; ++ii) {
+        if (cbio_is_local_id(doc[ii]->info->id.buf, doc[ii]->info->id.size)) {
+            continue;
+        }
+
+        batch->info[jj] = doc[ii]->info;
+        if (batch->info[jj]->deleted == 0) {
+            /* We don't want to store any document information for a deleted
+             * document (but we updated the id in there for simplicity in the
+             * code elsewhere ;)
+             */
+            batch->docs[jj] = doc[ii]->doc;
+        }
+        ++jj;
+    }
+
+    if (handle->dedup != CBIO_DEDUP_NONE &&
+        cbio_save_batch_dedup(handle, batch) != CBIO_SUCCESS) {
+        cbio_free(batch->docs);
+        cbio_free(batch->info);
+        cbio_free(batch->shadow);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    return CBIO_SUCCESS;
+}
+
+void cbio_save_batch_restore(struct cbio_save_batch *batch)
+{
+    size_t ii;
+
+    if (batch->shadow == NULL) {
+        return;
+    }
+
+    for (ii = 0; ii < batch->ndocs; ++ii) {
+        if (batch->docs[ii] == batch->shadow + ii &&
+            batch->shadow[ii].data.buf != NULL) {
+            batch->info[ii]->content_meta &=
+                ~(CBIO_DOC_IS_COMPRESSED | CBIO_DOC_IS_DICT_COMPRESSED);
+            cbio_free(batch->shadow[ii].data.buf);
+            batch->shadow[ii].data.buf = NULL;
+        }
+    }
+}
+
+void cbio_save_batch_destroy(struct cbio_save_batch *batch)
+{
+    cbio_save_batch_restore(batch);
+    cbio_free(batch->shadow);
+    cbio_free(batch->docs);
+    cbio_free(batch->info);
+}
+
+#if defined(HAVE_SNAPPY_C_H) || defined(CBIO_HAVE_ZSTD)
+/*
+ * Should the compressed body be used instead of the original body?
+ */
+static int cbio_use_compressed(size_t size, size_t compressed,
+                               unsigned int max_ratio)
+{
+    size_t limit = size * (max_ratio == 0 ? 100 : max_ratio) / 100;
+    return compressed < size && compressed <= limit;
+}
+#endif
+
+/*
+ * Compress the body into a newly allocated buffer. Returns 1 if the
+ * compressed body should be used, 0 if the document should be stored
+ * as is, and -1 if we failed to allocate memory.
+ */
+#ifdef HAVE_SNAPPY_C_H
+static int cbio_snappy_compress(libcbio_t handle,
+                                const sized_buf *in,
+                                sized_buf *out)
+{
+    unsigned int max_ratio = handle->compression.max_ratio;
+
+    out->size = snappy_max_compressed_length(in->size);
+    if ((out->buf = cbio_malloc(handle, out->size)) == NULL) {
+        return -1;
+    }
+
+    if (snappy_compress(in->buf, in->size, out->buf,
+                        &out->size) == SNAPPY_OK &&
+        cbio_use_compressed(in->size, out->size, max_ratio)) {
+        return 1;
+    }
+
+    cbio_free(out->buf);
+    out->buf = NULL;
+    return 0;
+}
+#endif
+
+#ifdef CBIO_HAVE_ZSTD
+static int cbio_zstd_compress(libcbio_t handle,
+                              ZSTD_CCtx *cctx,
+                              const sized_buf *in,
+                              sized_buf *out)
+{
+    const struct cbio_dictionary *dict = handle->compression.dictionary;
+    unsigned int max_ratio = handle->compression.max_ratio;
+    size_t nb;
+
+    out->size = ZSTD_compressBound(in->size);
+    if ((out->buf = cbio_malloc(handle, out->size)) == NULL) {
+        return -1;
+    }
+
+    nb = ZSTD_compress_usingCDict(cctx, out->buf, out->size,
+                                  in->buf, in->size, dict->cdict);
+    if (!ZSTD_isError(nb) && cbio_use_compressed(in->size, nb, max_ratio)) {
+        out->size = nb;
+        return 1;
+    }
+
+    cbio_free(out->buf);
+    out->buf = NULL;
+    return 0;
+}
+#endif
+
+cbio_error_t cbio_save_batch_prepare(libcbio_t handle,
+                                      struct cbio_save_batch *batch,
+                                      size_t offset,
+                                      size_t ndocs)
+{
+    cbio_error_t ret = CBIO_SUCCESS;
+    size_t ii;
+#ifdef CBIO_HAVE_ZSTD
+    ZSTD_CCtx *cctx = NULL;
+#endif
+
+    if (batch->shadow == NULL && !handle->json_validation) {
+        return CBIO_SUCCESS;
+    }
+
+#ifdef CBIO_HAVE_ZSTD
+    if (handle->compression.codec == CBIO_COMPRESSION_ZSTD_DICT &&
+        (cctx = ZSTD_createCCtx()) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+#endif
+
+    for (ii = offset; ii < offset + ndocs && ret == CBIO_SUCCESS; ++ii) {
+        Doc *doc = batch->docs[ii];
+        DocInfo *info = batch->info[ii];
+        uint8_t flag = CBIO_DOC_IS_COMPRESSED;
+        sized_buf body;
+        int compressed = 0;
+
+        if (doc == NULL || info->deleted ||
+            (info->content_meta & (CBIO_DOC_IS_COMPRESSED |
+                                   CBIO_DOC_IS_DICT_COMPRESSED))) {
+            continue;
+        }
+
+        if (handle->json_validation) {
+            info->content_meta = (uint8_t)((info->content_meta & 0xf0) |
+                                           cbio_json_classify(doc->data.buf,
+                                                              doc->data.size));
+        }
+
+        if (batch->shadow == NULL || doc->data.size == 0 ||
+            doc->data.size < handle->compression.min_size) {
+            continue;
+        }
+
+        switch (handle->compression.codec) {
+#ifdef HAVE_SNAPPY_C_H
+        case CBIO_COMPRESSION_SNAPPY:
+            compressed = cbio_snappy_compress(handle, &doc->data, &body);
+            break;
+#endif
+#ifdef CBIO_HAVE_ZSTD
+        case CBIO_COMPRESSION_ZSTD_DICT:
+            flag = CBIO_DOC_IS_DICT_COMPRESSED;
+            compressed = cbio_zstd_compress(handle, cctx, &doc->data, &body);
+            break;
+#endif
+        default:
+            break;
+        }
+
+        if (compressed == -1) {
+            ret = CBIO_ERROR_ENOMEM;
+        } else if (compressed == 1) {
+            batch->shadow[ii].id = doc->id;
+            batch->shadow[ii].data = body;
+            batch->docs[ii] = batch->shadow + ii;
+            info->content_meta |= flag;
+        }
+    }
+
+#ifdef CBIO_HAVE_ZSTD
+    ZSTD_freeCCtx(cctx);
+#endif
+    return ret;
+}
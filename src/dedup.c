@@ -0,0 +1,133 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Remove the documents with the same id from a batch before it's
+ * handed to couchstore, so only one of them is written. The batches
+ * built with cbio_batch_t are sorted by id, so the duplicates are
+ * next to each other. Otherwise we look the ids up in an open
+ * addressing hash table (keyed by the crc32 of the id) mapping them to
+ * their position in the compacted batch.
+ */
+#include "internal.h"
+
+#include <string.h>
+
+static int cbio_dedup_same_id(const DocInfo *a, const DocInfo *b)
+{
+    return a->id.size == b->id.size &&
+           memcmp(a->id.buf, b->id.buf, a->id.size) == 0;
+}
+
+/*
+ * Should the document `info` (stored after `old`) replace `old`?
+ */
+static int cbio_dedup_replaces(libcbio_t handle,
+                               const DocInfo *old,
+                               const DocInfo *info)
+{
+    if (handle->dedup == CBIO_DEDUP_REVISION) {
+        return info->rev_seq >= old->rev_seq;
+    }
+    return 1;
+}
+
+cbio_error_t cbio_save_batch_dedup(libcbio_t handle,
+                                   struct cbio_save_batch *batch)
+{
+    size_t *slots;
+    size_t nslots = 16;
+    size_t mask;
+    size_t nout = 0;
+    size_t ii;
+
+    if (batch->ndocs < 2) {
+        return CBIO_SUCCESS;
+    }
+
+    while (nslots < batch->ndocs * 2) {
+        nslots *= 2;
+    }
+    /* The position in the batch + 1 (0 is a free slot) */
+    if ((slots = cbio_calloc(handle, nslots, sizeof(size_t))) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    mask = nslots - 1;
+
+    for (ii = 0; ii < batch->ndocs; ++ii) {
+        DocInfo *info = batch->info[ii];
+        Doc *doc = batch->docs[ii];
+        size_t slot = cbio_crc32(info->id.buf, info->id.size) & mask;
+
+        while (slots[slot] != 0 &&
+               !cbio_dedup_same_id(batch->info[slots[slot] - 1], info)) {
+            slot = (slot + 1) & mask;
+        }
+
+        if (slots[slot] == 0) {
+            slots[slot] = nout + 1;
+            batch->info[nout] = info;
+            batch->docs[nout] = doc;
+            ++nout;
+        } else if (cbio_dedup_replaces(handle, batch->info[slots[slot] - 1],
+                                       info)) {
+            batch->info[slots[slot] - 1] = info;
+            batch->docs[slots[slot] - 1] = doc;
+        }
+    }
+
+    cbio_free(slots);
+    batch->ndocs = nout;
+
+    return CBIO_SUCCESS;
+}
+
+size_t cbio_dedup_sorted(libcbio_t handle, DocInfo **info, size_t ndocs)
+{
+    size_t nout = 0;
+    size_t ii;
+
+    for (ii = 0; ii < ndocs; ++ii) {
+        if (nout > 0 && cbio_dedup_same_id(info[nout - 1], info[ii])) {
+            if (cbio_dedup_replaces(handle, info[nout - 1], info[ii])) {
+                info[nout - 1] = info[ii];
+            }
+        } else {
+            info[nout++] = info[ii];
+        }
+    }
+
+    return nout;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_set_deduplication(libcbio_t handle, cbio_dedup_t mode)
+{
+    if (handle == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    switch (mode) {
+    case CBIO_DEDUP_NONE:
+    case CBIO_DEDUP_LAST:
+    case CBIO_DEDUP_REVISION:
+        handle->dedup = mode;
+        return CBIO_SUCCESS;
+    default:
+        return CBIO_ERROR_EINVAL;
+    }
+}
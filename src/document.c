@@ -24,7 +24,7 @@ LIBCBIO_API
 void cbio_document_release(libcbio_document_t doc)
 {
     cbio_document_reinitialize(doc);
-    free(doc);
+    cbio_free(doc);
 }
 
 LIBCBIO_API
@@ -36,8 +36,7 @@ cbio_error_t cbio_create_empty_document(libcbio_t handle,
         return CBIO_ERROR_EINVAL;
     }
 
-    ret = calloc(1, sizeof(*ret));
-    (void)handle;
+    ret = cbio_calloc(handle, 1, sizeof(*ret));
     *doc = ret;
     if (*doc != NULL) {
         ret->scratch = 1;
@@ -52,8 +51,8 @@ LIBCBIO_API
 void cbio_document_reinitialize(libcbio_document_t doc)
 {
     if (doc->scratch == 1) {
-        free(doc->info);
-        free(doc->doc);
+        cbio_free(doc->info);
+        cbio_free(doc->doc);
     } else {
         if (doc->info != NULL) {
             couchstore_free_docinfo(doc->info);
@@ -62,13 +61,19 @@ void cbio_document_reinitialize(libcbio_document_t doc)
             couchstore_free_document(doc->doc);
         }
     }
-    free(doc->tmp_alloc_id);
-    free(doc->tmp_alloc_meta);
-    free(doc->tmp_alloc_bp);
+    cbio_free(doc->tmp_alloc_id);
+    cbio_free(doc->tmp_alloc_meta);
+    cbio_free(doc->tmp_alloc_bp);
 
     doc->info = NULL;
     doc->doc = NULL;
     doc->tmp_alloc_id = doc->tmp_alloc_meta = doc->tmp_alloc_bp = NULL;
+
+    if (doc->budget != NULL) {
+        cbio_budget_release(doc->budget, doc->charge);
+        doc->budget = NULL;
+        doc->charge = 0;
+    }
 }
 
 LIBCBIO_API
@@ -82,20 +87,23 @@ cbio_error_t cbio_document_set_id(libcbio_document_t doc,
     assert(doc);
 
     if (doc->doc == NULL) {
-        if ((doc->doc = calloc(1, sizeof(*doc->doc))) == NULL) {
+        doc->doc = cbio_calloc(doc->handle, 1, sizeof(*doc->doc));
+        if (doc->doc == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
 
     if (doc->info == NULL) {
-        if ((doc->info = calloc(1, sizeof(*doc->info))) == NULL) {
+        doc->info = cbio_calloc(doc->handle, 1, sizeof(*doc->info));
+        if (doc->info == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
 
     if (allocate) {
-        free(doc->tmp_alloc_id);
-        if ((doc->tmp_alloc_id = ptr = malloc(nid)) == NULL) {
+        cbio_free(doc->tmp_alloc_id);
+        doc->tmp_alloc_id = ptr = cbio_malloc(doc->handle, nid);
+        if (ptr == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
         memcpy(ptr, id, nid);
@@ -118,14 +126,16 @@ cbio_error_t cbio_document_set_meta(libcbio_document_t doc,
     assert(doc);
 
     if (doc->info == NULL) {
-        if ((doc->info = calloc(1, sizeof(*doc->info))) == NULL) {
+        doc->info = cbio_calloc(doc->handle, 1, sizeof(*doc->info));
+        if (doc->info == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
 
     if (allocate) {
-        free(doc->tmp_alloc_meta);
-        if ((doc->tmp_alloc_meta = ptr = malloc(nmeta)) == NULL) {
+        cbio_free(doc->tmp_alloc_meta);
+        doc->tmp_alloc_meta = ptr = cbio_malloc(doc->handle, nmeta);
+        if (ptr == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
         memcpy(ptr, meta, nmeta);
@@ -143,7 +153,8 @@ cbio_error_t cbio_document_set_revision(libcbio_document_t doc, uint64_t revno)
     assert(doc);
 
     if (doc->info == NULL) {
-        if ((doc->info = calloc(1, sizeof(*doc->info))) == NULL) {
+        doc->info = cbio_calloc(doc->handle, 1, sizeof(*doc->info));
+        if (doc->info == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
@@ -158,7 +169,8 @@ cbio_error_t cbio_document_set_deleted(libcbio_document_t doc, int deleted)
     assert(doc);
 
     if (doc->info == NULL) {
-        if ((doc->info = calloc(1, sizeof(*doc->info))) == NULL) {
+        doc->info = cbio_calloc(doc->handle, 1, sizeof(*doc->info));
+        if (doc->info == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
@@ -178,20 +190,23 @@ cbio_error_t cbio_document_set_value(libcbio_document_t doc,
     assert(doc);
 
     if (doc->doc == NULL) {
-        if ((doc->doc = calloc(1, sizeof(*doc->doc))) == NULL) {
+        doc->doc = cbio_calloc(doc->handle, 1, sizeof(*doc->doc));
+        if (doc->doc == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
 
     if (doc->info == NULL) {
-        if ((doc->info = calloc(1, sizeof(*doc->info))) == NULL) {
+        doc->info = cbio_calloc(doc->handle, 1, sizeof(*doc->info));
+        if (doc->info == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
 
     if (allocate) {
-        free(doc->tmp_alloc_bp);
-        if ((doc->tmp_alloc_bp = ptr = malloc(nvalue)) == NULL) {
+        cbio_free(doc->tmp_alloc_bp);
+        doc->tmp_alloc_bp = ptr = cbio_malloc(doc->handle, nvalue);
+        if (ptr == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
         memcpy(ptr, value, nvalue);
@@ -210,7 +225,8 @@ cbio_error_t cbio_document_set_content_type(libcbio_document_t doc,
     assert(doc);
 
     if (doc->info == NULL) {
-        if ((doc->info = calloc(1, sizeof(*doc->info))) == NULL) {
+        doc->info = cbio_calloc(doc->handle, 1, sizeof(*doc->info));
+        if (doc->info == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
@@ -266,6 +282,18 @@ cbio_error_t cbio_document_get_revision(libcbio_document_t doc, uint64_t *revno)
     return CBIO_SUCCESS;
 }
 
+LIBCBIO_API
+cbio_error_t cbio_document_get_sequence(libcbio_document_t doc,
+                                        uint64_t *sequence)
+{
+    if (doc == NULL || doc->info == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    *sequence = doc->info->db_seq;
+    return CBIO_SUCCESS;
+}
+
 LIBCBIO_API
 cbio_error_t cbio_document_get_deleted(libcbio_document_t doc, int *deleted)
 {
@@ -277,10 +305,9 @@ cbio_error_t cbio_document_get_deleted(libcbio_document_t doc, int *deleted)
     return CBIO_SUCCESS;
 }
 
-LIBCBIO_API
-cbio_error_t cbio_document_get_value(libcbio_document_t doc,
-                                     const void **value,
-                                     size_t *nvalue)
+static cbio_error_t cbio_read_value(libcbio_document_t doc,
+                                    const void **value,
+                                    size_t *nvalue)
 {
     if (doc == NULL) {
         return CBIO_ERROR_EINVAL;
@@ -295,12 +322,32 @@ cbio_error_t cbio_document_get_value(libcbio_document_t doc,
     }
 
     if (doc->doc == NULL) {
+        struct cbio_reader *reader;
         couchstore_error_t err;
-        err = couchstore_open_doc_with_docinfo(doc->handle->couchstore_handle,
-                                               doc->info,
-                                               &doc->doc, 0);
+        cbio_error_t ret;
+        Db *db;
+
+        ret = cbio_acquire_db(doc->handle, &db, &reader);
+        if (ret != CBIO_SUCCESS) {
+            return ret;
+        }
+
+        err = couchstore_open_doc_with_docinfo(db, doc->info, &doc->doc,
+                                               DECOMPRESS_DOC_BODIES);
         if (err != COUCHSTORE_SUCCESS) {
-            return cbio_remap_error(err);
+            doc->doc = NULL;
+            ret = cbio_remap_error(err);
+        } else if (doc->info->content_meta & CBIO_DOC_IS_DICT_COMPRESSED) {
+            ret = cbio_decompress_document(doc->handle, db, doc);
+            if (ret != CBIO_SUCCESS) {
+                couchstore_free_document(doc->doc);
+                doc->doc = NULL;
+            }
+        }
+        cbio_release_db(doc->handle, db, reader);
+
+        if (ret != CBIO_SUCCESS) {
+            return ret;
         }
     }
 
@@ -312,6 +359,27 @@ cbio_error_t cbio_document_get_value(libcbio_document_t doc,
     return CBIO_SUCCESS;
 }
 
+LIBCBIO_API
+cbio_error_t cbio_document_get_value(libcbio_document_t doc,
+                                     const void **value,
+                                     size_t *nvalue)
+{
+    libcbio_t handle = doc == NULL ? NULL : doc->handle;
+    size_t nid = 0;
+    cbio_error_t err;
+
+    if (handle != NULL && doc->info != NULL) {
+        nid = doc->info->id.size;
+    }
+
+    CBIO_PROBE_ENTRY(get_value, CBIO_PROBE_GET_VALUE, handle, nid, 1, 0);
+    err = cbio_read_value(doc, value, nvalue);
+    CBIO_PROBE_RETURN(get_value, CBIO_PROBE_GET_VALUE, handle, nid, 1,
+                      err == CBIO_SUCCESS ? *nvalue : 0, err);
+
+    return err;
+}
+
 LIBCBIO_API
 cbio_error_t cbio_document_get_content_type(libcbio_document_t doc,
                                             uint8_t *content_type)
@@ -0,0 +1,217 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Access to the older headers in the file. Every commit appends a new
+ * header, and couchstore can step backwards from one header to the
+ * previous. Rolling back is done by rewinding the writers Db to an
+ * older header and committing it again as the newest header.
+ */
+#include "internal.h"
+
+static cbio_error_t cbio_get_header_info(Db *db, cbio_header_info_t *info)
+{
+    couchstore_error_t err;
+    DbInfo dbinfo;
+
+    if ((err = couchstore_db_info(db, &dbinfo)) != COUCHSTORE_SUCCESS) {
+        return cbio_remap_error(err);
+    }
+
+    /* LINTED */
+    info->position = (off_t)couchstore_get_header_position(db);
+    info->last_sequence = dbinfo.last_sequence;
+    info->doc_count = dbinfo.doc_count;
+    info->deleted_count = dbinfo.deleted_count;
+    return CBIO_SUCCESS;
+}
+
+/*
+ * Walk the headers backwards until we find the newest header with no
+ * changes after sequence.
+ */
+static cbio_error_t cbio_rewind_to_sequence(Db **db, uint64_t sequence)
+{
+    couchstore_error_t err;
+    cbio_error_t ret;
+    DbInfo dbinfo;
+
+    for (;;) {
+        if ((err = couchstore_db_info(*db, &dbinfo)) != COUCHSTORE_SUCCESS) {
+            return cbio_remap_error(err);
+        }
+
+        if (dbinfo.last_sequence <= sequence) {
+            return CBIO_SUCCESS;
+        }
+
+        if ((ret = cbio_rewind_header(db)) != CBIO_SUCCESS) {
+            return ret;
+        }
+    }
+}
+
+LIBCBIO_API
+cbio_error_t cbio_foreach_header(libcbio_t handle,
+                                 cbio_header_callback_fn callback,
+                                 void *ctx)
+{
+    cbio_header_info_t info;
+    couchstore_error_t err;
+    cbio_error_t ret;
+    Db *db;
+
+    if (handle == NULL || callback == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    /* Use a separate instance so the handle isn't affected */
+    err = couchstore_open_db(handle->filename, COUCHSTORE_OPEN_FLAG_RDONLY,
+                             &db);
+    if (err != COUCHSTORE_SUCCESS) {
+        return cbio_remap_error(err);
+    }
+
+    for (;;) {
+        if ((ret = cbio_get_header_info(db, &info)) != CBIO_SUCCESS) {
+            break;
+        }
+
+        if (callback(handle, &info, ctx) != 0) {
+            break;
+        }
+
+        if ((ret = cbio_rewind_header(&db)) != CBIO_SUCCESS) {
+            /* The db is closed, and there are no more headers */
+            return ret == CBIO_ERROR_NO_HEADER ? CBIO_SUCCESS : ret;
+        }
+    }
+
+    couchstore_close_db(db);
+    return ret;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_open_handle_at(const char *name,
+                                 off_t position,
+                                 libcbio_t *handle)
+{
+    cbio_error_t err;
+
+    if (position < 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((err = cbio_open_handle(name, CBIO_OPEN_RDONLY, handle)) != CBIO_SUCCESS) {
+        return err;
+    }
+
+    err = cbio_rewind_to(&(*handle)->couchstore_handle, (uint64_t)position);
+    if (err != CBIO_SUCCESS) {
+        cbio_close_handle(*handle);
+        *handle = NULL;
+    }
+
+    return err;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_open_handle_at_sequence(const char *name,
+                                          uint64_t sequence,
+                                          libcbio_t *handle)
+{
+    cbio_error_t err;
+
+    if ((err = cbio_open_handle(name, CBIO_OPEN_RDONLY, handle)) != CBIO_SUCCESS) {
+        return err;
+    }
+
+    err = cbio_rewind_to_sequence(&(*handle)->couchstore_handle, sequence);
+    if (err != CBIO_SUCCESS) {
+        cbio_close_handle(*handle);
+        *handle = NULL;
+    }
+
+    return err;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_rollback(libcbio_t handle, uint64_t sequence)
+{
+    couchstore_error_t err;
+    cbio_error_t ret;
+    uint64_t position;
+    Db *db;
+
+    if (handle == NULL || handle->mode == CBIO_OPEN_RDONLY) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    /*
+     * Look for the header with a read only instance first, so that the
+     * handle is left untouched if there is no such header
+     */
+    err = couchstore_open_db(handle->filename, COUCHSTORE_OPEN_FLAG_RDONLY,
+                             &db);
+    if (err != COUCHSTORE_SUCCESS) {
+        return cbio_remap_error(err);
+    }
+
+    if ((ret = cbio_rewind_to_sequence(&db, sequence)) != CBIO_SUCCESS) {
+        if (db != NULL) {
+            couchstore_close_db(db);
+        }
+        return ret;
+    }
+    position = couchstore_get_header_position(db);
+    couchstore_close_db(db);
+
+    /*
+     * The uncommitted changes in the handle are discarded, but closing
+     * the Db flushes its buffered writes. Close it before the new
+     * instance finds the end of the file, so they don't land in the
+     * space the new instance writes to.
+     */
+    couchstore_close_db(handle->couchstore_handle);
+    handle->couchstore_handle = NULL;
+    handle->dirty = 0;
+
+    err = couchstore_open_db(handle->filename, 0, &db);
+    if (err != COUCHSTORE_SUCCESS) {
+        ret = cbio_remap_error(err);
+    } else if ((ret = cbio_rewind_to(&db, position)) != CBIO_SUCCESS &&
+               db != NULL) {
+        couchstore_close_db(db);
+    }
+
+    if (ret != CBIO_SUCCESS) {
+        /* Leave the handle at the newest header */
+        err = couchstore_open_db(handle->filename, 0,
+                                 &handle->couchstore_handle);
+        if (err != COUCHSTORE_SUCCESS) {
+            handle->couchstore_handle = NULL;
+        }
+        return ret;
+    }
+
+    handle->couchstore_handle = db;
+    handle->dirty = 1;
+    cbio_reload_dictionary(handle);
+
+    /* Make the header the newest one in the file */
+    return cbio_commit(handle);
+}
@@ -19,7 +19,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-static int cbio_is_local_id(const void *data, size_t nb)
+int cbio_is_local_id(const void *data, size_t nb)
 {
     return (nb > 6 && memcmp(data, "_local/", 7) == 0) ? 1 : 0;
 }
@@ -38,11 +38,20 @@ cbio_error_t cbio_open_handle(const char *name,
     uint64_t flags;
     libcbio_t ret;
 
-    ret = calloc(1, sizeof(*ret));
+    if (name == NULL || handle == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    ret = cbio_calloc(NULL, 1, sizeof(*ret));
     if (ret == NULL) {
         return CBIO_ERROR_ENOMEM;
     }
 
+    if (cbio_memory_init(ret) != CBIO_SUCCESS) {
+        cbio_free(ret);
+        return CBIO_ERROR_ENOMEM;
+    }
+
     ret->mode = mode;
     if (mode == CBIO_OPEN_RDONLY) {
         flags = COUCHSTORE_OPEN_FLAG_RDONLY;
@@ -52,16 +61,107 @@ cbio_error_t cbio_open_handle(const char *name,
         flags = 0;
     }
 
+    /* Get the size before the header search so we never miss a commit */
+    ret->file_size = cbio_get_file_size(name);
     err = couchstore_open_db(name, flags, &ret->couchstore_handle);
     if (err != COUCHSTORE_SUCCESS) {
-        free(ret);
+        cbio_memory_release(ret);
+        cbio_free(ret);
         return cbio_remap_error(err);
     }
 
+    /* Keep the name around so we can open more instances of the file */
+    if ((ret->filename = cbio_malloc(NULL, strlen(name) + 1)) == NULL) {
+        couchstore_close_db(ret->couchstore_handle);
+        cbio_memory_release(ret);
+        cbio_free(ret);
+        return CBIO_ERROR_ENOMEM;
+    }
+    strcpy(ret->filename, name);
+
     *handle = ret;
     return CBIO_SUCCESS;
 }
 
+struct cbio_open_job {
+    /* Must be the first member (the work queue passes us this) */
+    struct cbio_work work;
+    const char *name;
+    libcbio_open_mode_t mode;
+    libcbio_t *handle;
+    cbio_error_t *status;
+    struct cbio_latch *latch;
+};
+
+static void cbio_open_job(struct cbio_work *work)
+{
+    struct cbio_open_job *job = (struct cbio_open_job *)work;
+
+    *job->status = cbio_open_handle(job->name, job->mode, job->handle);
+    if (*job->status != CBIO_SUCCESS) {
+        *job->handle = NULL;
+    }
+    cbio_latch_count_down(job->latch);
+}
+
+LIBCBIO_API
+cbio_error_t cbio_open_handles(const char *const *names,
+                               size_t nfiles,
+                               libcbio_open_mode_t mode,
+                               unsigned int nthreads,
+                               libcbio_t *handles,
+                               cbio_error_t *status)
+{
+    struct cbio_open_job *jobs;
+    struct cbio_workqueue *wq;
+    struct cbio_latch latch;
+    cbio_error_t err;
+    size_t ii;
+
+    if (names == NULL || nfiles == 0 || handles == NULL || status == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if (nthreads == 0) {
+        nthreads = cbio_default_concurrency();
+    }
+    if (nthreads > nfiles) {
+        nthreads = (unsigned int)nfiles;
+    }
+
+    if ((jobs = cbio_calloc(NULL, nfiles, sizeof(*jobs))) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    if ((err = cbio_workqueue_create(nthreads, &wq)) != CBIO_SUCCESS) {
+        cbio_free(jobs);
+        return err;
+    }
+
+    cbio_latch_init(&latch, nfiles);
+    for (ii = 0; ii < nfiles; ++ii) {
+        jobs[ii].work.fn = cbio_open_job;
+        jobs[ii].name = names[ii];
+        jobs[ii].mode = mode;
+        jobs[ii].handle = handles + ii;
+        jobs[ii].status = status + ii;
+        jobs[ii].latch = &latch;
+        cbio_workqueue_submit(wq, &jobs[ii].work);
+    }
+    cbio_latch_wait(&latch);
+    cbio_latch_destroy(&latch);
+    cbio_workqueue_destroy(wq);
+    cbio_free(jobs);
+
+    for (ii = 0; ii < nfiles; ++ii) {
+        if (status[ii] != CBIO_SUCCESS) {
+            return status[ii];
+        }
+    }
+
+    return CBIO_SUCCESS;
+}
+
 LIBCBIO_API
 void cbio_close_handle(libcbio_t handle)
 {
@@ -69,8 +169,19 @@ void cbio_close_handle(libcbio_t handle)
         (void)cbio_commit(handle);
     }
 
-    couchstore_close_db(handle->couchstore_handle);
-    free(handle);
+    if (handle->trace != NULL) {
+        (void)cbio_trace_stop(handle);
+    }
+
+    cbio_shared_release(handle);
+    cbio_release_dictionaries(handle);
+    if (handle->couchstore_handle != NULL) {
+        /* NULL if a rewind failed (and couchstore closed it) */
+        couchstore_close_db(handle->couchstore_handle);
+    }
+    cbio_memory_release(handle);
+    cbio_free(handle->filename);
+    cbio_free(handle);
 }
 
 LIBCBIO_API
@@ -99,13 +210,20 @@ static cbio_error_t cbio_get_local_document(libcbio_t handle,
                                             size_t nid,
                                             libcbio_document_t *doc)
 {
+    struct cbio_reader *reader;
     couchstore_error_t err;
+    cbio_error_t ret;
     LocalDoc *ldoc;
+    Db *db;
+
+    if ((ret = cbio_acquire_db(handle, &db, &reader)) != CBIO_SUCCESS) {
+        return ret;
+    }
+    err = couchstore_open_local_document(db, id, nid, &ldoc);
+    cbio_release_db(handle, db, reader);
 
-    err = couchstore_open_local_document(handle->couchstore_handle, id,
-                                         nid, &ldoc);
     if (err == COUCHSTORE_SUCCESS) {
-        cbio_error_t ret = cbio_ldoc2doc(handle, ldoc, doc);
+        ret = cbio_ldoc2doc(handle, ldoc, doc);
         couchstore_free_local_document(ldoc);
         return ret;
     }
@@ -113,34 +231,55 @@ static cbio_error_t cbio_get_local_document(libcbio_t handle,
     return cbio_remap_error(err);
 }
 
-LIBCBIO_API
-cbio_error_t cbio_get_document(libcbio_t handle,
-                               const void *id,
-                               size_t nid,
-                               libcbio_document_t *doc)
+static cbio_error_t cbio_docinfo_by_id(libcbio_t handle,
+                                       const void *id,
+                                       size_t nid,
+                                       DocInfo **info)
 {
-    libcbio_document_t ret;
+    struct cbio_reader *reader;
     couchstore_error_t err;
+    cbio_error_t ret;
+    Db *db;
+
+    if ((ret = cbio_acquire_db(handle, &db, &reader)) != CBIO_SUCCESS) {
+        return ret;
+    }
+    err = couchstore_docinfo_by_id(db, id, nid, info);
+    cbio_release_db(handle, db, reader);
+
+    return cbio_remap_error(err);
+}
+
+/*
+ * Look up the document with the given id. Deleted documents are only
+ * returned if `deleted` is set.
+ */
+static cbio_error_t cbio_lookup_document(libcbio_t handle,
+                                         const void *id,
+                                         size_t nid,
+                                         int deleted,
+                                         libcbio_document_t *doc)
+{
+    libcbio_document_t ret;
+    cbio_error_t err;
 
     if (cbio_is_local_id(id, nid)) {
         return cbio_get_local_document(handle, id, nid, doc);
     }
 
-    ret = calloc(1, sizeof(*ret));
-
+    ret = cbio_calloc(handle, 1, sizeof(*ret));
     if (ret == NULL) {
         return CBIO_ERROR_ENOMEM;
     }
 
     ret->handle = handle;
-    err = couchstore_docinfo_by_id(handle->couchstore_handle, id,
-                                   nid, &ret->info);
-    if (err != COUCHSTORE_SUCCESS) {
+    err = cbio_docinfo_by_id(handle, id, nid, &ret->info);
+    if (err != CBIO_SUCCESS) {
         cbio_document_release(ret);
-        return cbio_remap_error(err);
+        return err;
     }
 
-    if (ret->info->deleted) {
+    if (ret->info->deleted && !deleted) {
         cbio_document_release(ret);
         return CBIO_ERROR_ENOENT;
     }
@@ -149,34 +288,57 @@ cbio_error_t cbio_get_document(libcbio_t handle,
     return CBIO_SUCCESS;
 }
 
-LIBCBIO_API
-cbio_error_t cbio_get_document_ex(libcbio_t handle,
-                                  const void *id,
-                                  size_t nid,
-                                  libcbio_document_t *doc)
+static cbio_error_t cbio_traced_lookup(libcbio_t handle,
+                                       const void *id,
+                                       size_t nid,
+                                       int deleted,
+                                       libcbio_document_t *doc)
 {
-    libcbio_document_t ret;
-    couchstore_error_t err;
+    uint64_t start = cbio_trace_now();
+    cbio_error_t err = cbio_lookup_document(handle, id, nid, deleted, doc);
+    cbio_trace_get(handle, start, err, id, nid,
+                   err == CBIO_SUCCESS ? *doc : NULL);
+    return err;
+}
 
-    if (cbio_is_local_id(id, nid)) {
-        return cbio_get_local_document(handle, id, nid, doc);
-    }
+static cbio_error_t cbio_get(libcbio_t handle,
+                             const void *id,
+                             size_t nid,
+                             int deleted,
+                             libcbio_document_t *doc)
+{
+    cbio_error_t err;
 
-    ret = calloc(1, sizeof(*ret));
-    if (ret == NULL) {
-        return CBIO_ERROR_ENOMEM;
+    CBIO_PROBE_ENTRY(get_document, CBIO_PROBE_GET_DOCUMENT, handle,
+                     nid, 1, 0);
+    if (handle->trace != NULL) {
+        err = cbio_traced_lookup(handle, id, nid, deleted, doc);
+    } else {
+        err = cbio_lookup_document(handle, id, nid, deleted, doc);
     }
+    CBIO_PROBE_RETURN(get_document, CBIO_PROBE_GET_DOCUMENT, handle, nid, 1,
+                      err == CBIO_SUCCESS && (*doc)->info != NULL ?
+                      (*doc)->info->size : 0, err);
 
-    ret->handle = handle;
-    err = couchstore_docinfo_by_id(handle->couchstore_handle, id,
-                                   nid, &ret->info);
-    if (err != COUCHSTORE_SUCCESS) {
-        cbio_document_release(ret);
-        return cbio_remap_error(err);
-    }
+    return err;
+}
 
-    *doc = ret;
-    return CBIO_SUCCESS;
+LIBCBIO_API
+cbio_error_t cbio_get_document(libcbio_t handle,
+                               const void *id,
+                               size_t nid,
+                               libcbio_document_t *doc)
+{
+    return cbio_get(handle, id, nid, 0, doc);
+}
+
+LIBCBIO_API
+cbio_error_t cbio_get_document_ex(libcbio_t handle,
+                                  const void *id,
+                                  size_t nid,
+                                  libcbio_document_t *doc)
+{
+    return cbio_get(handle, id, nid, 1, doc);
 }
 
 LIBCBIO_API
@@ -191,9 +353,16 @@ static cbio_error_t cbio_store_local_documents(libcbio_t handle,
                                                size_t ndocs)
 {
     size_t ii;
+
+    /* couchstore doesn't provide a bulk interface for local documents */
     for (ii = 0; ii < ndocs; ++ii) {
         couchstore_error_t err;
         LocalDoc mydoc;
+
+        if (!cbio_is_local_document(doc[ii]->info)) {
+            continue;
+        }
+
         mydoc.id = doc[ii]->info->id;
         mydoc.json = doc[ii]->doc->data;
         mydoc.deleted = doc[ii]->info->deleted;
@@ -203,77 +372,117 @@ static cbio_error_t cbio_store_local_documents(libcbio_t handle,
         if (err != COUCHSTORE_SUCCESS) {
             return cbio_remap_error(err);
         }
+        handle->dirty = 1;
     }
-    handle->dirty = 1;
+
     return CBIO_SUCCESS;
 }
 
+static cbio_error_t cbio_save_documents(libcbio_t handle,
+                                        libcbio_document_t *doc,
+                                        size_t ndocs)
+{
+    struct cbio_save_batch batch;
+    cbio_error_t ret;
+
+    ret = cbio_save_batch_init(handle, &batch, doc, ndocs);
+    if (ret != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    ret = cbio_save_batch_prepare(handle, &batch, 0, batch.ndocs);
+    if (ret == CBIO_SUCCESS) {
+        ret = cbio_save_batch_write(handle, &batch);
+    }
+    cbio_save_batch_destroy(&batch);
+
+    return ret;
+}
+
 LIBCBIO_API
 cbio_error_t cbio_store_documents(libcbio_t handle,
                                   libcbio_document_t *doc,
                                   size_t ndocs)
 {
-    Doc **docs;
-    DocInfo **info;
-    size_t ii;
-    couchstore_error_t err;
+    uint64_t start;
+    cbio_error_t ret;
 
     if (handle->mode == CBIO_OPEN_RDONLY || ndocs == 0) {
         return CBIO_ERROR_EINVAL;
     }
 
-    if (cbio_is_local_document(doc[0]->info)) {
-        return cbio_store_local_documents(handle, doc, ndocs);
+    CBIO_PROBE_ENTRY(store_documents, CBIO_PROBE_STORE_DOCUMENTS, handle,
+                     0, ndocs, cbio_probe_value_bytes(doc, ndocs));
+    if (handle->trace == NULL) {
+        ret = cbio_save_documents(handle, doc, ndocs);
+    } else {
+        start = cbio_trace_now();
+        ret = cbio_save_documents(handle, doc, ndocs);
+        cbio_trace_store(handle, start, ret, doc, ndocs);
     }
+    CBIO_PROBE_RETURN(store_documents, CBIO_PROBE_STORE_DOCUMENTS, handle,
+                      0, ndocs, 0, ret);
 
-    docs = calloc(ndocs, sizeof(Doc *));
-    info = calloc(ndocs, sizeof(DocInfo *));
-    if (docs == NULL || info == NULL) {
-        free(docs);
-        free(info);
-        return CBIO_ERROR_ENOMEM;
-    }
+    return ret;
+}
 
-    for (ii = 0; ii < ndocs; ++ii) {
-        info[ii] = doc[ii]->info;
-
-        if (info[ii]->deleted == 0) {
-            /* We don't want to store any document information for a deleted
-             * document (but we updated the id in there for simplicity in the
-             * code elsewhere ;)
-             */
-            docs[ii] = doc[ii]->doc;
+/*
+ * Store the regular documents in one bulk operation followed by the
+ * local documents. Both are persisted by the same (next) commit.
+ */
+cbio_error_t cbio_save_batch_write(libcbio_t handle,
+                                   struct cbio_save_batch *batch)
+{
+    couchstore_error_t err;
+
+    if (batch->ndocs > 0) {
+        err = couchstore_save_documents(handle->couchstore_handle,
+                                        batch->docs, batch->info,
+                                        (unsigned int)batch->ndocs, 0);
+        if (err != COUCHSTORE_SUCCESS) {
+            return cbio_remap_error(err);
         }
+        handle->dirty = 1;
     }
 
-    err = couchstore_save_documents(handle->couchstore_handle, docs, info,
-                                    (unsigned int)ndocs, 0);
-    free(docs);
-    free(info);
-
-    if (err == COUCHSTORE_SUCCESS) {
-        handle->dirty = 1;
+    if (batch->nlocal > 0) {
+        return cbio_store_local_documents(handle, batch->source,
+                                          batch->nsource);
     }
 
-    return cbio_remap_error(err);
+    return CBIO_SUCCESS;
 }
 
 LIBCBIO_API
 cbio_error_t cbio_commit(libcbio_t handle)
 {
     couchstore_error_t err = COUCHSTORE_SUCCESS;
+    uint64_t start = 0;
 
     if (handle->mode == CBIO_OPEN_RDONLY) {
         return CBIO_ERROR_EINVAL;
     }
 
+    CBIO_PROBE_ENTRY(commit, CBIO_PROBE_COMMIT, handle, 0, 0, 0);
+    if (handle->trace != NULL) {
+        start = cbio_trace_now();
+    }
+
     if (handle->dirty) {
         err = couchstore_commit(handle->couchstore_handle);
         if (err == COUCHSTORE_SUCCESS) {
             handle->dirty = 0;
+            cbio_shared_committed(handle);
         }
     }
 
+    if (handle->trace != NULL) {
+        cbio_trace_op(handle, CBIO_TRACE_COMMIT, start,
+                      cbio_remap_error(err), 0, 0);
+    }
+    CBIO_PROBE_RETURN(commit, CBIO_PROBE_COMMIT, handle, 0, 0, 0,
+                      cbio_remap_error(err));
+
     return cbio_remap_error(err);
 }
 
@@ -281,20 +490,26 @@ struct cbio_wrap_ctx {
     cbio_changes_callback_fn callback;
     libcbio_t handle;
     void *ctx;
+    /* The number of documents delivered (for the trace) */
+    uint32_t count;
 };
 
 static int couchstore_changes_callback(Db *db, DocInfo *docinfo, void *ctx)
 {
     int ret = 0;
-    libcbio_document_t doc = calloc(1, sizeof(*doc));
+    struct cbio_wrap_ctx *uctx = ctx;
+    libcbio_document_t doc = cbio_calloc(uctx->handle, 1, sizeof(*doc));
     if (doc) {
-        struct cbio_wrap_ctx *uctx = ctx;
         doc->info = docinfo;
         doc->handle = uctx->handle;
 
+        ++uctx->count;
         ret = uctx->callback(uctx->handle, doc, uctx->ctx);
         if (ret == 0) {
-            free(doc);
+            /* couchstore frees the DocInfo, but the callback may have
+             * read the body */
+            doc->info = NULL;
+            cbio_document_release(doc);
         }
     }
 
@@ -309,15 +524,37 @@ cbio_error_t cbio_changes_since(libcbio_t handle,
                                 void *ctx)
 {
     struct cbio_wrap_ctx uctx;
+    struct cbio_reader *reader;
     couchstore_error_t err;
+    cbio_error_t ret;
+    uint64_t start = 0;
+    Db *db;
+
     uctx.callback = callback;
     uctx.handle = handle;
     uctx.ctx = ctx;
+    uctx.count = 0;
 
-    err = couchstore_changes_since(handle->couchstore_handle,
-                                   since, 0,
-                                   couchstore_changes_callback,
-                                   &uctx);
+    CBIO_PROBE_ENTRY(changes_since, CBIO_PROBE_CHANGES_SINCE, handle,
+                     0, 0, 0);
+    if (handle->trace != NULL) {
+        start = cbio_trace_now();
+    }
 
-    return cbio_remap_error(err);
+    if ((ret = cbio_acquire_db(handle, &db, &reader)) == CBIO_SUCCESS) {
+        err = couchstore_changes_since(db, since, 0,
+                                       couchstore_changes_callback,
+                                       &uctx);
+        cbio_release_db(handle, db, reader);
+        ret = cbio_remap_error(err);
+    }
+
+    if (handle->trace != NULL) {
+        cbio_trace_op(handle, CBIO_TRACE_CHANGES, start, ret, uctx.count,
+                      since);
+    }
+    CBIO_PROBE_RETURN(changes_since, CBIO_PROBE_CHANGES_SINCE, handle,
+                      0, uctx.count, 0, ret);
+
+    return ret;
 }
@@ -18,8 +18,14 @@
 #error "This is a private interface to libcbio!"
 #endif
 
+#include "config.h"
+
 #include <libcbio/cbio.h>
 #include <libcouchstore/couch_db.h>
+#include <pthread.h>
+
+#include "probes.h"
+#include "trace.h"
 
 #ifndef INTERNAL_H
 #define INTERNAL_H 1
@@ -28,10 +34,42 @@
 #error "What are you thinking?? this is a C project"
 #endif
 
+struct cbio_dictionary;
+struct cbio_memory;
+struct cbio_shared;
+struct cbio_reader;
+struct cbio_trace;
+
 struct libcbio_st {
     Db *couchstore_handle;
+    char *filename;
+    /* The size of the file when the Db was opened (see cbio_refresh) */
+    off_t file_size;
     int dirty;
     libcbio_open_mode_t mode;
+    int json_validation;
+    /* How duplicate ids in a store are handled (see dedup.c) */
+    cbio_dedup_t dedup;
+    struct {
+        cbio_compression_t codec;
+        size_t min_size;
+        unsigned int max_ratio;
+        /* The dictionary used for CBIO_COMPRESSION_ZSTD_DICT */
+        struct cbio_dictionary *dictionary;
+        /* All of the dictionaries we've loaded */
+        struct cbio_dictionary *dictionaries;
+    } compression;
+    /* Reader slots for handles opened with cbio_open_shared_handle */
+    struct cbio_shared *shared;
+    /* The operation recorder (see cbio_trace_start) */
+    struct cbio_trace *trace;
+    /* The allocator for everything owned by the handle */
+    struct cbio_memory *memory;
+    /* See cbio_set_probe_callback */
+    struct {
+        cbio_probe_callback_fn callback;
+        void *cookie;
+    } probe;
 };
 
 struct libcbio_document_st {
@@ -43,8 +81,163 @@ struct libcbio_document_st {
     void *tmp_alloc_meta;
     void *tmp_alloc_bp;
     int scratch;
+
+    /* The budget the document is charged to (if retained from a scan) */
+    cbio_budget_t budget;
+    size_t charge;
+};
+
+/*
+ * A batch of documents to store. The regular documents are placed in
+ * the arrays passed to couchstore_save_documents, and the local
+ * documents are stored one by one from the source array. The regular
+ * documents are classified and compressed by cbio_save_batch_prepare
+ * (which may be called for different ranges of the batch in
+ * parallel). Compressed bodies live in the shadow array (only
+ * allocated if compression is enabled) so that the callers documents
+ * aren't modified (except for the content_meta which is restored by
+ * cbio_save_batch_restore)
+ */
+struct cbio_save_batch {
+    Doc **docs;
+    DocInfo **info;
+    Doc *shadow;
+    size_t ndocs;
+    libcbio_document_t *source;
+    size_t nsource;
+    size_t nlocal;
+};
+
+/*
+ * A unit of work to be executed by a thread in the work queue. The
+ * structure is typically embedded as the first member of a larger
+ * structure describing the job.
+ */
+struct cbio_work {
+    void (*fn)(struct cbio_work *work);
+    struct cbio_work *next;
+};
+
+struct cbio_workqueue;
+
+/*
+ * Count down latch used to wait for a number of jobs to complete
+ */
+struct cbio_latch {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t count;
 };
 
 cbio_error_t cbio_remap_error(couchstore_error_t in);
+int cbio_is_local_id(const void *data, size_t nb);
+uint32_t cbio_crc32(const void *data, size_t nb);
+
+cbio_error_t cbio_save_batch_init(libcbio_t handle,
+                                  struct cbio_save_batch *batch,
+                                  libcbio_document_t *doc,
+                                  size_t ndocs);
+cbio_error_t cbio_save_batch_prepare(libcbio_t handle,
+                                      struct cbio_save_batch *batch,
+                                      size_t offset,
+                                      size_t ndocs);
+/* Release the compressed bodies, but not the arrays */
+void cbio_save_batch_restore(struct cbio_save_batch *batch);
+void cbio_save_batch_destroy(struct cbio_save_batch *batch);
+cbio_error_t cbio_save_batch_write(libcbio_t handle,
+                                   struct cbio_save_batch *batch);
+cbio_error_t cbio_save_batch_dedup(libcbio_t handle,
+                                   struct cbio_save_batch *batch);
+/* Compact an array sorted by id, returns the new number of entries */
+size_t cbio_dedup_sorted(libcbio_t handle, DocInfo **info, size_t ndocs);
+
+cbio_error_t cbio_decompress_document(libcbio_t handle,
+                                      Db *db,
+                                      libcbio_document_t doc);
+void cbio_release_dictionaries(libcbio_t handle);
+void cbio_reload_dictionary(libcbio_t handle);
+
+/*
+ * Get the Db to use for a read operation (and release it when the
+ * operation is done). For shared handles this is one of the reader
+ * slots, otherwise it is the handles own Db.
+ */
+cbio_error_t cbio_acquire_db(libcbio_t handle,
+                             Db **db,
+                             struct cbio_reader **reader);
+void cbio_release_db(libcbio_t handle, Db *db, struct cbio_reader *reader);
+void cbio_shared_committed(libcbio_t handle);
+void cbio_shared_release(libcbio_t handle);
+
+cbio_error_t cbio_rewind_header(Db **db);
+cbio_error_t cbio_rewind_to(Db **db, uint64_t position);
+off_t cbio_get_file_size(const char *name);
+void cbio_budget_release(cbio_budget_t budget, size_t nbytes);
+
+uint8_t cbio_json_classify(const void *data, size_t nb);
+
+/*
+ * Record an operation started at `start` (see cbio_trace_now) to the
+ * trace of the handle. Only call these if handle->trace is set.
+ */
+uint64_t cbio_trace_now(void);
+void cbio_trace_get(libcbio_t handle,
+                    uint64_t start,
+                    cbio_error_t status,
+                    const void *id,
+                    size_t nid,
+                    libcbio_document_t doc);
+void cbio_trace_store(libcbio_t handle,
+                      uint64_t start,
+                      cbio_error_t status,
+                      libcbio_document_t *doc,
+                      size_t ndocs);
+/* As cbio_trace_store, doc[ii] is NULL for deletions */
+void cbio_trace_store_info(libcbio_t handle,
+                           uint64_t start,
+                           cbio_error_t status,
+                           DocInfo *const *info,
+                           Doc *const *doc,
+                           size_t ndocs);
+void cbio_trace_op(libcbio_t handle,
+                   cbio_trace_op_t op,
+                   uint64_t start,
+                   cbio_error_t status,
+                   uint32_t count,
+                   uint64_t arg);
+
+/*
+ * All of the memory is allocated with these (from the allocator of the
+ * handle, or the global allocator if handle is NULL) and released with
+ * cbio_free (see memory.c)
+ */
+void *cbio_malloc(libcbio_t handle, size_t size);
+void *cbio_calloc(libcbio_t handle, size_t nmemb, size_t size);
+void *cbio_realloc(libcbio_t handle, void *ptr, size_t size);
+void cbio_free(void *ptr);
+cbio_error_t cbio_memory_init(libcbio_t handle);
+void cbio_memory_release(libcbio_t handle);
+
+void cbio_probe_fire(libcbio_t handle,
+                     cbio_probe_t probe,
+                     int exit,
+                     size_t nid,
+                     size_t count,
+                     size_t nbytes,
+                     cbio_error_t status);
+/* The total size of the values of the documents (for the probes) */
+size_t cbio_probe_value_bytes(libcbio_document_t *doc, size_t ndocs);
+
+unsigned int cbio_default_concurrency(void);
+cbio_error_t cbio_workqueue_create(unsigned int nthreads,
+                                   struct cbio_workqueue **wq);
+void cbio_workqueue_submit(struct cbio_workqueue *wq,
+                           struct cbio_work *work);
+void cbio_workqueue_destroy(struct cbio_workqueue *wq);
+
+void cbio_latch_init(struct cbio_latch *latch, size_t count);
+void cbio_latch_count_down(struct cbio_latch *latch);
+void cbio_latch_wait(struct cbio_latch *latch);
+void cbio_latch_destroy(struct cbio_latch *latch);
 
 #endif
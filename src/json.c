@@ -0,0 +1,438 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * A validating JSON scanner used to classify the documents we store.
+ * Most of the bytes in a typical JSON document live inside strings, so
+ * the string scanning is done with SSE4.2 or AVX2 (picked at runtime
+ * depending on the cpu) to skip the characters that don't need any
+ * special treatment. The rest of the grammar is checked by a small
+ * state machine.
+ */
+#include "internal.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && !defined(__SUNPRO_C) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CBIO_JSON_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* We don't accept documents nested deeper than this */
+#define CBIO_JSON_MAX_DEPTH 1024
+
+/*
+ * Get the offset of the first character in the string that needs
+ * special treatment: the terminating quote, an escape, a control
+ * character or a non-ascii character.
+ */
+typedef size_t (*cbio_json_scan_fn)(const unsigned char *ptr, size_t nb);
+
+static size_t cbio_json_scan_scalar(const unsigned char *ptr, size_t nb)
+{
+    size_t ii;
+    for (ii = 0; ii < nb; ++ii) {
+        unsigned char c = ptr[ii];
+        if (c < 0x20 || c == '"' || c == '\\' || c > 0x7f) {
+            break;
+        }
+    }
+    return ii;
+}
+
+#ifdef CBIO_JSON_SIMD
+__attribute__((target("sse4.2")))
+static size_t cbio_json_scan_sse42(const unsigned char *ptr, size_t nb)
+{
+    const __m128i ranges = _mm_setr_epi8(0x00, 0x1f, '"', '"',
+                                         '\\', '\\', (char)0x80, (char)0xff,
+                                         0, 0, 0, 0, 0, 0, 0, 0);
+    size_t ii = 0;
+
+    while (ii + 16 <= nb) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(ptr + ii));
+        int idx = _mm_cmpestri(ranges, 8, chunk, 16,
+                               _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                               _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16) {
+            return ii + (size_t)idx;
+        }
+        ii += 16;
+    }
+
+    return ii + cbio_json_scan_scalar(ptr + ii, nb - ii);
+}
+
+__attribute__((target("avx2")))
+static size_t cbio_json_scan_avx2(const unsigned char *ptr, size_t nb)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i escape = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    size_t ii = 0;
+
+    while (ii + 32 <= nb) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(ptr + ii));
+        __m256i special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                            _mm256_cmpeq_epi8(chunk, escape)),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, control), chunk));
+        /* The sign bit is set for all non-ascii characters */
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(special) |
+                            (unsigned int)_mm256_movemask_epi8(chunk);
+        if (mask != 0) {
+            return ii + (size_t)__builtin_ctz(mask);
+        }
+        ii += 32;
+    }
+
+    return ii + cbio_json_scan_sse42(ptr + ii, nb - ii);
+}
+#endif
+
+static cbio_json_scan_fn cbio_json_scan = cbio_json_scan_scalar;
+static pthread_once_t cbio_json_once = PTHREAD_ONCE_INIT;
+
+static void cbio_json_init(void)
+{
+#ifdef CBIO_JSON_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        cbio_json_scan = cbio_json_scan_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        cbio_json_scan = cbio_json_scan_sse42;
+    }
+#endif
+}
+
+/*
+ * Get the length of the UTF-8 sequence starting at ptr, or 0 if it
+ * isn't a valid sequence (overlong encodings and surrogates are
+ * invalid)
+ */
+static size_t cbio_utf8_length(const unsigned char *ptr, size_t nb)
+{
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xbf;
+    size_t len;
+    size_t ii;
+
+    if (ptr[0] < 0x80) {
+        return 1;
+    } else if (ptr[0] >= 0xc2 && ptr[0] <= 0xdf) {
+        len = 2;
+    } else if (ptr[0] >= 0xe0 && ptr[0] <= 0xef) {
+        len = 3;
+        if (ptr[0] == 0xe0) {
+            lo = 0xa0;
+        } else if (ptr[0] == 0xed) {
+            hi = 0x9f;
+        }
+    } else if (ptr[0] >= 0xf0 && ptr[0] <= 0xf4) {
+        len = 4;
+        if (ptr[0] == 0xf0) {
+            lo = 0x90;
+        } else if (ptr[0] == 0xf4) {
+            hi = 0x8f;
+        }
+    } else {
+        return 0;
+    }
+
+    if (nb < len || ptr[1] < lo || ptr[1] > hi) {
+        return 0;
+    }
+
+    for (ii = 2; ii < len; ++ii) {
+        if (ptr[ii] < 0x80 || ptr[ii] > 0xbf) {
+            return 0;
+        }
+    }
+
+    return len;
+}
+
+static int cbio_is_hex(unsigned char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+           (c >= 'A' && c <= 'F');
+}
+
+static int cbio_is_digit(unsigned char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+/*
+ * Parse the string starting at *offset (which points to the opening
+ * quote). Upon success *offset is moved past the closing quote.
+ */
+static int cbio_json_string(const unsigned char *ptr, size_t nb,
+                            size_t *offset)
+{
+    size_t ii = *offset + 1;
+
+    for (;;) {
+        size_t len;
+
+        ii += cbio_json_scan(ptr + ii, nb - ii);
+        if (ii == nb) {
+            return 0;
+        }
+
+        switch (ptr[ii]) {
+        case '"':
+            *offset = ii + 1;
+            return 1;
+        case '\\':
+            if (ii + 1 == nb) {
+                return 0;
+            }
+            switch (ptr[ii + 1]) {
+            case '"':
+            case '\\':
+            case '/':
+            case 'b':
+            case 'f':
+            case 'n':
+            case 'r':
+            case 't':
+                ii += 2;
+                break;
+            case 'u':
+                if (ii + 6 > nb || !cbio_is_hex(ptr[ii + 2]) ||
+                    !cbio_is_hex(ptr[ii + 3]) || !cbio_is_hex(ptr[ii + 4]) ||
+                    !cbio_is_hex(ptr[ii + 5])) {
+                    return 0;
+                }
+                ii += 6;
+                break;
+            default:
+                return 0;
+            }
+            break;
+        default:
+            if ((len = cbio_utf8_length(ptr + ii, nb - ii)) < 2) {
+                /* control character or illegal UTF-8 */
+                return 0;
+            }
+            ii += len;
+        }
+    }
+}
+
+static int cbio_json_number(const unsigned char *ptr, size_t nb,
+                            size_t *offset)
+{
+    size_t ii = *offset;
+
+    if (ptr[ii] == '-') {
+        ++ii;
+    }
+
+    if (ii < nb && ptr[ii] == '0') {
+        ++ii;
+    } else if (ii < nb && cbio_is_digit(ptr[ii])) {
+        while (ii < nb && cbio_is_digit(ptr[ii])) {
+            ++ii;
+        }
+    } else {
+        return 0;
+    }
+
+    if (ii < nb && ptr[ii] == '.') {
+        if (++ii == nb || !cbio_is_digit(ptr[ii])) {
+            return 0;
+        }
+        while (ii < nb && cbio_is_digit(ptr[ii])) {
+            ++ii;
+        }
+    }
+
+    if (ii < nb && (ptr[ii] == 'e' || ptr[ii] == 'E')) {
+        if (++ii < nb && (ptr[ii] == '+' || ptr[ii] == '-')) {
+            ++ii;
+        }
+        if (ii == nb || !cbio_is_digit(ptr[ii])) {
+            return 0;
+        }
+        while (ii < nb && cbio_is_digit(ptr[ii])) {
+            ++ii;
+        }
+    }
+
+    *offset = ii;
+    return 1;
+}
+
+static int cbio_json_literal(const unsigned char *ptr, size_t nb,
+                             size_t *offset, const char *literal)
+{
+    size_t len = strlen(literal);
+    if (nb - *offset < len || memcmp(ptr + *offset, literal, len) != 0) {
+        return 0;
+    }
+    *offset += len;
+    return 1;
+}
+
+static size_t cbio_json_skip_ws(const unsigned char *ptr, size_t nb,
+                                size_t ii)
+{
+    while (ii < nb && (ptr[ii] == ' ' || ptr[ii] == '\n' ||
+                       ptr[ii] == '\r' || ptr[ii] == '\t')) {
+        ++ii;
+    }
+    return ii;
+}
+
+/*
+ * Parse an object key and the following colon. Keys starting with an
+ * underscore are reserved in the top level object (reserved is NULL
+ * for the nested objects).
+ */
+static int cbio_json_key(const unsigned char *ptr, size_t nb,
+                         size_t *offset, int *reserved)
+{
+    size_t ii = cbio_json_skip_ws(ptr, nb, *offset);
+
+    if (ii == nb || ptr[ii] != '"') {
+        return 0;
+    }
+
+    if (reserved != NULL && ii + 1 < nb && ptr[ii + 1] == '_') {
+        *reserved = 1;
+    }
+
+    if (!cbio_json_string(ptr, nb, &ii)) {
+        return 0;
+    }
+
+    ii = cbio_json_skip_ws(ptr, nb, ii);
+    if (ii == nb || ptr[ii] != ':') {
+        return 0;
+    }
+
+    *offset = ii + 1;
+    return 1;
+}
+
+uint8_t cbio_json_classify(const void *data, size_t nb)
+{
+    const unsigned char *ptr = data;
+    unsigned char stack[CBIO_JSON_MAX_DEPTH];
+    size_t depth = 0;
+    size_t ii = 0;
+    int reserved = 0;
+
+    pthread_once(&cbio_json_once, cbio_json_init);
+
+    for (;;) {
+        /* We're expecting a value */
+        ii = cbio_json_skip_ws(ptr, nb, ii);
+        if (ii == nb) {
+            return CBIO_DOC_INVALID_JSON;
+        }
+
+        switch (ptr[ii]) {
+        case '{':
+        case '[':
+            if (depth == CBIO_JSON_MAX_DEPTH) {
+                return CBIO_DOC_INVALID_JSON;
+            }
+            stack[depth++] = ptr[ii];
+            ii = cbio_json_skip_ws(ptr, nb, ii + 1);
+            if (ii < nb && ptr[ii] == (stack[depth - 1] == '{' ? '}' : ']')) {
+                /* empty container */
+                --depth;
+                ++ii;
+                break;
+            }
+            if (stack[depth - 1] == '{' &&
+                !cbio_json_key(ptr, nb, &ii, depth == 1 ? &reserved : NULL)) {
+                return CBIO_DOC_INVALID_JSON;
+            }
+            continue;
+        case '"':
+            if (!cbio_json_string(ptr, nb, &ii)) {
+                return CBIO_DOC_INVALID_JSON;
+            }
+            break;
+        case 't':
+            if (!cbio_json_literal(ptr, nb, &ii, "true")) {
+                return CBIO_DOC_INVALID_JSON;
+            }
+            break;
+        case 'f':
+            if (!cbio_json_literal(ptr, nb, &ii, "false")) {
+                return CBIO_DOC_INVALID_JSON;
+            }
+            break;
+        case 'n':
+            if (!cbio_json_literal(ptr, nb, &ii, "null")) {
+                return CBIO_DOC_INVALID_JSON;
+            }
+            break;
+        default:
+            if (!cbio_json_number(ptr, nb, &ii)) {
+                return CBIO_DOC_INVALID_JSON;
+            }
+        }
+
+        /* A value is complete, close all of the containers we can */
+        for (;;) {
+            ii = cbio_json_skip_ws(ptr, nb, ii);
+            if (depth == 0) {
+                if (ii != nb) {
+                    return CBIO_DOC_INVALID_JSON;
+                }
+                return reserved ? CBIO_DOC_INVALID_JSON_KEY : CBIO_DOC_IS_JSON;
+            }
+
+            if (ii == nb) {
+                return CBIO_DOC_INVALID_JSON;
+            }
+
+            if (ptr[ii] == (stack[depth - 1] == '{' ? '}' : ']')) {
+                --depth;
+                ++ii;
+            } else if (ptr[ii] == ',') {
+                ++ii;
+                break;
+            } else {
+                return CBIO_DOC_INVALID_JSON;
+            }
+        }
+
+        if (stack[depth - 1] == '{' &&
+            !cbio_json_key(ptr, nb, &ii, depth == 1 ? &reserved : NULL)) {
+            return CBIO_DOC_INVALID_JSON;
+        }
+    }
+}
+
+LIBCBIO_API
+cbio_error_t cbio_set_json_validation(libcbio_t handle, int enable)
+{
+    if (handle == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    handle->json_validation = enable ? 1 : 0;
+    return CBIO_SUCCESS;
+}
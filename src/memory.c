@@ -0,0 +1,291 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * All of the memory allocated by libcbio is allocated through the
+ * functions in this file, from the allocator of a handle or from the
+ * global allocator (see cbio_set_allocator). Every block is prefixed
+ * with a header recording its size and the arena (struct cbio_memory)
+ * it was allocated from, so it's always returned to the allocator it
+ * came from and accounted to the right handle.
+ *
+ * Every handle has an arena of its own (created when it's opened,
+ * with the global allocator). The handles themselves and the objects
+ * not owned by a handle (sets, documents created without a handle
+ * etc) are allocated from the global arena. The arena of a handle is
+ * reference counted by the handle and by every block allocated from
+ * it, so the documents of a handle may be released after the handle
+ * is closed.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+
+struct cbio_memory {
+    cbio_allocator_t allocator;
+    /* The handle and every live block */
+    size_t refs;
+    size_t allocated;
+    size_t peak;
+    size_t allocations;
+    uint64_t total_allocations;
+};
+
+/* Aligned for any type, as malloc */
+union cbio_memory_header {
+    struct {
+        struct cbio_memory *memory;
+        size_t size;
+    } block;
+    double d;
+    long l;
+    void *p;
+};
+
+#define CBIO_MEMORY_HEADER sizeof(union cbio_memory_header)
+#define CBIO_MEMORY_MAX ((size_t)-1 - CBIO_MEMORY_HEADER)
+
+static void *cbio_libc_malloc(size_t size, void *ctx)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void *cbio_libc_calloc(size_t nmemb, size_t size, void *ctx)
+{
+    (void)ctx;
+    return calloc(nmemb, size);
+}
+
+static void *cbio_libc_realloc(void *ptr, size_t size, void *ctx)
+{
+    (void)ctx;
+    return realloc(ptr, size);
+}
+
+static void cbio_libc_free(void *ptr, void *ctx)
+{
+    (void)ctx;
+    free(ptr);
+}
+
+static struct cbio_memory cbio_global_memory = {
+    {
+        cbio_libc_malloc, cbio_libc_calloc, cbio_libc_realloc,
+        cbio_libc_free, NULL
+    },
+    1, 0, 0, 0, 0
+};
+
+static struct cbio_memory *cbio_memory_of(libcbio_t handle)
+{
+    if (handle == NULL || handle->memory == NULL) {
+        return &cbio_global_memory;
+    }
+    return handle->memory;
+}
+
+static void cbio_memory_unref(struct cbio_memory *memory)
+{
+    if (__sync_sub_and_fetch(&memory->refs, 1) == 0) {
+        /* The global arena is never released */
+        cbio_free(memory);
+    }
+}
+
+static void cbio_memory_charge(struct cbio_memory *memory, size_t size)
+{
+    size_t allocated = __sync_add_and_fetch(&memory->allocated, size);
+    size_t peak = memory->peak;
+
+    while (allocated > peak) {
+        if (__sync_bool_compare_and_swap(&memory->peak, peak, allocated)) {
+            break;
+        }
+        peak = memory->peak;
+    }
+}
+
+static void *cbio_memory_track(struct cbio_memory *memory,
+                               union cbio_memory_header *header,
+                               size_t size)
+{
+    if (header == NULL) {
+        return NULL;
+    }
+
+    header->block.memory = memory;
+    header->block.size = size;
+    (void)__sync_add_and_fetch(&memory->refs, 1);
+    (void)__sync_add_and_fetch(&memory->allocations, 1);
+    (void)__sync_add_and_fetch(&memory->total_allocations, 1);
+    cbio_memory_charge(memory, size);
+
+    return header + 1;
+}
+
+void *cbio_malloc(libcbio_t handle, size_t size)
+{
+    struct cbio_memory *memory = cbio_memory_of(handle);
+    cbio_allocator_t *allocator = &memory->allocator;
+
+    if (size > CBIO_MEMORY_MAX) {
+        return NULL;
+    }
+
+    return cbio_memory_track(memory,
+                             allocator->malloc_fn(size + CBIO_MEMORY_HEADER,
+                                                  allocator->ctx),
+                             size);
+}
+
+void *cbio_calloc(libcbio_t handle, size_t nmemb, size_t size)
+{
+    struct cbio_memory *memory = cbio_memory_of(handle);
+    cbio_allocator_t *allocator = &memory->allocator;
+    size_t nb;
+
+    if (size != 0 && nmemb > CBIO_MEMORY_MAX / size) {
+        return NULL;
+    }
+    nb = nmemb * size;
+
+    return cbio_memory_track(memory,
+                             allocator->calloc_fn(1, nb + CBIO_MEMORY_HEADER,
+                                                  allocator->ctx),
+                             nb);
+}
+
+void *cbio_realloc(libcbio_t handle, void *ptr, size_t size)
+{
+    union cbio_memory_header *header;
+    struct cbio_memory *memory;
+    size_t old;
+
+    if (ptr == NULL) {
+        return cbio_malloc(handle, size);
+    }
+
+    if (size > CBIO_MEMORY_MAX) {
+        return NULL;
+    }
+
+    /* The block stays with the allocator it was allocated from */
+    header = (union cbio_memory_header *)ptr - 1;
+    memory = header->block.memory;
+    old = header->block.size;
+    header = memory->allocator.realloc_fn(header, size + CBIO_MEMORY_HEADER,
+                                          memory->allocator.ctx);
+    if (header == NULL) {
+        return NULL;
+    }
+
+    header->block.size = size;
+    (void)__sync_sub_and_fetch(&memory->allocated, old);
+    cbio_memory_charge(memory, size);
+
+    return header + 1;
+}
+
+void cbio_free(void *ptr)
+{
+    union cbio_memory_header *header;
+    struct cbio_memory *memory;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    header = (union cbio_memory_header *)ptr - 1;
+    memory = header->block.memory;
+    (void)__sync_sub_and_fetch(&memory->allocated, header->block.size);
+    (void)__sync_sub_and_fetch(&memory->allocations, 1);
+    memory->allocator.free_fn(header, memory->allocator.ctx);
+    cbio_memory_unref(memory);
+}
+
+cbio_error_t cbio_memory_init(libcbio_t handle)
+{
+    struct cbio_memory *memory;
+
+    if ((memory = cbio_calloc(NULL, 1, sizeof(*memory))) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    memory->allocator = cbio_global_memory.allocator;
+    memory->refs = 1;
+    handle->memory = memory;
+
+    return CBIO_SUCCESS;
+}
+
+void cbio_memory_release(libcbio_t handle)
+{
+    if (handle->memory != NULL) {
+        cbio_memory_unref(handle->memory);
+        handle->memory = NULL;
+    }
+}
+
+LIBCBIO_API
+cbio_error_t cbio_set_allocator(libcbio_t handle,
+                                const cbio_allocator_t *allocator)
+{
+    struct cbio_memory *memory = cbio_memory_of(handle);
+
+    if (allocator != NULL &&
+        (allocator->malloc_fn == NULL || allocator->calloc_fn == NULL ||
+         allocator->realloc_fn == NULL || allocator->free_fn == NULL)) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    /* The live blocks must be returned to the allocator they came from */
+    if (__sync_fetch_and_add(&memory->allocations, 0) != 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if (allocator == NULL) {
+        memory->allocator.malloc_fn = cbio_libc_malloc;
+        memory->allocator.calloc_fn = cbio_libc_calloc;
+        memory->allocator.realloc_fn = cbio_libc_realloc;
+        memory->allocator.free_fn = cbio_libc_free;
+        memory->allocator.ctx = NULL;
+    } else {
+        memory->allocator = *allocator;
+    }
+
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_get_memory_stats(libcbio_t handle,
+                                   cbio_memory_stats_t *stats)
+{
+    struct cbio_memory *memory;
+
+    if (stats == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    memory = cbio_memory_of(handle);
+    stats->allocated = __sync_fetch_and_add(&memory->allocated, 0);
+    stats->peak = memory->peak;
+    stats->allocations = __sync_fetch_and_add(&memory->allocations, 0);
+    stats->total_allocations = __sync_fetch_and_add(&memory->total_allocations,
+                                                    0);
+
+    return CBIO_SUCCESS;
+}
@@ -0,0 +1,64 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "internal.h"
+
+LIBCBIO_API
+cbio_error_t cbio_set_probe_callback(libcbio_t handle,
+                                     cbio_probe_callback_fn callback,
+                                     void *cookie)
+{
+    if (handle == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    handle->probe.callback = callback;
+    handle->probe.cookie = cookie;
+    return CBIO_SUCCESS;
+}
+
+void cbio_probe_fire(libcbio_t handle,
+                     cbio_probe_t probe,
+                     int exit,
+                     size_t nid,
+                     size_t count,
+                     size_t nbytes,
+                     cbio_error_t status)
+{
+    cbio_probe_info_t info;
+
+    info.probe = probe;
+    info.exit = exit;
+    info.nid = nid;
+    info.count = count;
+    info.nbytes = nbytes;
+    info.status = status;
+    handle->probe.callback(handle, &info, handle->probe.cookie);
+}
+
+size_t cbio_probe_value_bytes(libcbio_document_t *doc, size_t ndocs)
+{
+    size_t nbytes = 0;
+    size_t ii;
+
+    for (ii = 0; ii < ndocs; ++ii) {
+        if (doc[ii]->doc != NULL) {
+            nbytes += doc[ii]->doc->data.size;
+        }
+    }
+
+    return nbytes;
+}
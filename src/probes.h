@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * The probes at the entry and exit of the API functions. Every probe
+ * fires a USDT probe (provider libcbio) when built with sys/sdt.h and
+ * calls the callback installed with cbio_set_probe_callback(). The
+ * arguments of the USDT probes are
+ *
+ *   entry:  handle, nid, count
+ *   return: handle, nid, count, nbytes, status
+ *
+ * (see cbio_probe_info_t). A USDT probe is a nop until it is traced,
+ * but its arguments are evaluated, so they should be cheap. The
+ * nbytes of an entry may have to be computed (cbio_store_documents
+ * sums the values), so only the callback gets it.
+ */
+#ifndef LIBCBIO_PROBES_H
+#define LIBCBIO_PROBES_H 1
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define CBIO_USDT_ENTRY(name, handle, nid, count) \
+    DTRACE_PROBE3(libcbio, name##_entry, handle, nid, count)
+#define CBIO_USDT_RETURN(name, handle, nid, count, nbytes, status) \
+    DTRACE_PROBE5(libcbio, name##_return, handle, nid, count, nbytes, \
+                  (int)(status))
+#else
+#define CBIO_USDT_ENTRY(name, handle, nid, count)
+#define CBIO_USDT_RETURN(name, handle, nid, count, nbytes, status)
+#endif
+
+#define CBIO_PROBE_ENTRY(name, point, handle, nid, count, nbytes) \
+    do { \
+        CBIO_USDT_ENTRY(name, handle, nid, count); \
+        if ((handle) != NULL && (handle)->probe.callback != NULL) { \
+            cbio_probe_fire(handle, point, 0, nid, count, nbytes, \
+                            CBIO_SUCCESS); \
+        } \
+    } while (0)
+
+#define CBIO_PROBE_RETURN(name, point, handle, nid, count, nbytes, status) \
+    do { \
+        CBIO_USDT_RETURN(name, handle, nid, count, nbytes, status); \
+        if ((handle) != NULL && (handle)->probe.callback != NULL) { \
+            cbio_probe_fire(handle, point, 1, nid, count, nbytes, status); \
+        } \
+    } while (0)
+
+#endif
@@ -0,0 +1,355 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * A vbucket set is a directory with one database file per vbucket
+ * named <vbucket>.couch. The documents are routed to the files with
+ * the same hash function as the clients use. Batches touching more
+ * than one file are stored (and committed) by the work queue so that
+ * the files are written in parallel.
+ */
+#include "internal.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* The hash function only provides 15 bits */
+#define CBIO_SET_MAX_VBUCKETS 0x8000
+
+struct cbio_set_st {
+    libcbio_t *handles;
+    uint16_t nvbuckets;
+    struct cbio_workqueue *wq;
+};
+
+/*
+ * The per file operation run on the work queue. The first error
+ * encountered is stored in the shared error (protected by the
+ * mutex in the latch).
+ */
+struct cbio_set_job {
+    /* Must be the first member (the work queue passes us this) */
+    struct cbio_work work;
+    libcbio_t handle;
+    libcbio_document_t *doc;
+    size_t ndocs;
+    struct cbio_latch *latch;
+    cbio_error_t *error;
+};
+
+static void cbio_set_job_done(struct cbio_set_job *job, cbio_error_t err)
+{
+    if (err != CBIO_SUCCESS) {
+        pthread_mutex_lock(&job->latch->mutex);
+        if (*job->error == CBIO_SUCCESS) {
+            *job->error = err;
+        }
+        pthread_mutex_unlock(&job->latch->mutex);
+    }
+
+    cbio_latch_count_down(job->latch);
+}
+
+static void cbio_set_store_job(struct cbio_work *work)
+{
+    struct cbio_set_job *job = (struct cbio_set_job *)work;
+    cbio_set_job_done(job, cbio_store_documents(job->handle, job->doc,
+                                                job->ndocs));
+}
+
+static void cbio_set_commit_job(struct cbio_work *work)
+{
+    struct cbio_set_job *job = (struct cbio_set_job *)work;
+    cbio_set_job_done(job, cbio_commit(job->handle));
+}
+
+LIBCBIO_API
+cbio_error_t cbio_set_open(const char *dirname,
+                           uint16_t nvbuckets,
+                           libcbio_open_mode_t mode,
+                           cbio_set_t *set)
+{
+    cbio_set_t ret;
+    cbio_error_t err;
+    cbio_error_t *status;
+    char **names;
+    char *buffer;
+    size_t nb;
+    uint16_t ii;
+
+    if (dirname == NULL || set == NULL || nvbuckets == 0 ||
+        nvbuckets > CBIO_SET_MAX_VBUCKETS) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if (mode == CBIO_OPEN_CREATE && mkdir(dirname, 0755) == -1 &&
+        errno != EEXIST) {
+        return CBIO_ERROR_OPEN_FILE;
+    }
+
+    if ((ret = cbio_calloc(NULL, 1, sizeof(*ret))) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    nb = strlen(dirname) + 32;
+    ret->nvbuckets = nvbuckets;
+    ret->handles = cbio_calloc(NULL, nvbuckets, sizeof(libcbio_t));
+    status = cbio_calloc(NULL, nvbuckets, sizeof(cbio_error_t));
+    names = cbio_calloc(NULL, nvbuckets, sizeof(char *));
+    buffer = cbio_malloc(NULL, nvbuckets * nb);
+    if (ret->handles == NULL || status == NULL || names == NULL ||
+        buffer == NULL) {
+        cbio_free(status);
+        cbio_free(names);
+        cbio_free(buffer);
+        cbio_set_close(ret);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    for (ii = 0; ii < nvbuckets; ++ii) {
+        names[ii] = buffer + ii * nb;
+        sprintf(names[ii], "%s/%u.couch", dirname, (unsigned int)ii);
+    }
+
+    /* cbio_set_close skips the files that failed to open */
+    err = cbio_open_handles((const char *const *)names, nvbuckets, mode, 0,
+                            ret->handles, status);
+    cbio_free(status);
+    cbio_free(names);
+    cbio_free(buffer);
+    if (err != CBIO_SUCCESS) {
+        cbio_set_close(ret);
+        return err;
+    }
+
+    if (mode != CBIO_OPEN_RDONLY && nvbuckets > 1) {
+        unsigned int nthreads = cbio_default_concurrency();
+        if (nthreads > nvbuckets) {
+            nthreads = nvbuckets;
+        }
+        err = cbio_workqueue_create(nthreads, &ret->wq);
+        if (err != CBIO_SUCCESS) {
+            cbio_set_close(ret);
+            return err;
+        }
+    }
+
+    *set = ret;
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+void cbio_set_close(cbio_set_t set)
+{
+    uint16_t ii;
+
+    if (set->wq != NULL) {
+        cbio_workqueue_destroy(set->wq);
+    }
+
+    if (set->handles != NULL) {
+        for (ii = 0; ii < set->nvbuckets; ++ii) {
+            if (set->handles[ii] != NULL) {
+                cbio_close_handle(set->handles[ii]);
+            }
+        }
+        cbio_free(set->handles);
+    }
+    cbio_free(set);
+}
+
+LIBCBIO_API
+uint16_t cbio_set_get_vbucket(cbio_set_t set, const void *id, size_t nid)
+{
+    return (uint16_t)(((cbio_crc32(id, nid) >> 16) & 0x7fff) % set->nvbuckets);
+}
+
+LIBCBIO_API
+libcbio_t cbio_set_get_handle(cbio_set_t set, uint16_t vbucket)
+{
+    if (vbucket >= set->nvbuckets) {
+        return NULL;
+    }
+    return set->handles[vbucket];
+}
+
+LIBCBIO_API
+cbio_error_t cbio_set_get_document(cbio_set_t set,
+                                   const void *id,
+                                   size_t nid,
+                                   libcbio_document_t *doc)
+{
+    return cbio_get_document(set->handles[cbio_set_get_vbucket(set, id, nid)],
+                             id, nid, doc);
+}
+
+/*
+ * Run the job for all of the files with something to do, and wait for
+ * them to complete. A single job is run on the calling thread.
+ */
+static cbio_error_t cbio_set_run(cbio_set_t set,
+                                 struct cbio_set_job *jobs,
+                                 size_t njobs)
+{
+    struct cbio_latch latch;
+    cbio_error_t err = CBIO_SUCCESS;
+    size_t ii;
+
+    if (njobs == 0) {
+        return CBIO_SUCCESS;
+    }
+
+    cbio_latch_init(&latch, njobs);
+    for (ii = 0; ii < njobs; ++ii) {
+        jobs[ii].latch = &latch;
+        jobs[ii].error = &err;
+        if (njobs == 1) {
+            jobs[ii].work.fn(&jobs[ii].work);
+        } else {
+            cbio_workqueue_submit(set->wq, &jobs[ii].work);
+        }
+    }
+    cbio_latch_wait(&latch);
+    cbio_latch_destroy(&latch);
+
+    return err;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_set_store_documents(cbio_set_t set,
+                                      libcbio_document_t *doc,
+                                      size_t ndocs)
+{
+    libcbio_document_t *sorted;
+    struct cbio_set_job *jobs;
+    uint16_t *vbucket;
+    size_t *offset;
+    size_t njobs;
+    size_t ii;
+    cbio_error_t err;
+
+    if (set->wq == NULL && set->nvbuckets > 1) {
+        /* Opened read only */
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if (set->nvbuckets == 1) {
+        return cbio_store_documents(set->handles[0], doc, ndocs);
+    }
+
+    if (ndocs == 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    sorted = cbio_malloc(NULL, ndocs * sizeof(libcbio_document_t));
+    vbucket = cbio_malloc(NULL, ndocs * sizeof(uint16_t));
+    offset = cbio_calloc(NULL, (size_t)set->nvbuckets + 1, sizeof(size_t));
+    jobs = cbio_calloc(NULL, ndocs < set->nvbuckets ? ndocs : set->nvbuckets,
+                       sizeof(struct cbio_set_job));
+    if (sorted == NULL || vbucket == NULL || offset == NULL || jobs == NULL) {
+        cbio_free(sorted);
+        cbio_free(vbucket);
+        cbio_free(offset);
+        cbio_free(jobs);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    /* Group the documents per vbucket (keeping their order) */
+    for (ii = 0; ii < ndocs; ++ii) {
+        vbucket[ii] = cbio_set_get_vbucket(set, doc[ii]->info->id.buf,
+                                           doc[ii]->info->id.size);
+        ++offset[vbucket[ii] + 1];
+    }
+
+    njobs = 0;
+    for (ii = 0; ii < set->nvbuckets; ++ii) {
+        if (offset[ii + 1] != 0) {
+            jobs[njobs].work.fn = cbio_set_store_job;
+            jobs[njobs].handle = set->handles[ii];
+            jobs[njobs].doc = sorted + offset[ii];
+            jobs[njobs].ndocs = offset[ii + 1];
+            ++njobs;
+        }
+        offset[ii + 1] += offset[ii];
+    }
+
+    for (ii = 0; ii < ndocs; ++ii) {
+        sorted[offset[vbucket[ii]]++] = doc[ii];
+    }
+
+    err = cbio_set_run(set, jobs, njobs);
+
+    cbio_free(sorted);
+    cbio_free(vbucket);
+    cbio_free(offset);
+    cbio_free(jobs);
+
+    return err;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_set_commit(cbio_set_t set)
+{
+    struct cbio_set_job *jobs;
+    size_t njobs = 0;
+    uint16_t ii;
+    cbio_error_t err;
+
+    if (set->wq == NULL) {
+        return cbio_commit(set->handles[0]);
+    }
+
+    jobs = cbio_calloc(NULL, set->nvbuckets, sizeof(struct cbio_set_job));
+    if (jobs == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    for (ii = 0; ii < set->nvbuckets; ++ii) {
+        if (set->handles[ii]->dirty) {
+            jobs[njobs].work.fn = cbio_set_commit_job;
+            jobs[njobs].handle = set->handles[ii];
+            ++njobs;
+        }
+    }
+
+    err = cbio_set_run(set, jobs, njobs);
+    cbio_free(jobs);
+
+    return err;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_set_changes_since(cbio_set_t set,
+                                    uint64_t since,
+                                    cbio_changes_callback_fn callback,
+                                    void *ctx)
+{
+    uint16_t ii;
+    cbio_error_t err;
+
+    for (ii = 0; ii < set->nvbuckets; ++ii) {
+        err = cbio_changes_since(set->handles[ii], since, callback, ctx);
+        if (err != CBIO_SUCCESS) {
+            return err;
+        }
+    }
+
+    return CBIO_SUCCESS;
+}
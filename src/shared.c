@@ -0,0 +1,170 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * A shared handle lets multiple threads read through the same handle
+ * while a single thread writes to it. The couchstore Db isn't thread
+ * safe, so the readers use a fixed number of read only Db instances
+ * (reader slots) instead of the Db owned by the writer. A reader grabs
+ * a free slot with an atomic compare and swap, so there is no lock on
+ * the read path. If all of the slots are busy the reader opens a
+ * temporary Db rather than waiting for a slot (a reader may need a
+ * second slot while it holds one, for instance when it reads a
+ * document body from a changes callback).
+ *
+ * The writer bumps the generation counter every time it commits. A
+ * slot opened for an older generation is reopened the next time it
+ * is acquired so that the readers always see the last committed
+ * header.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+
+struct cbio_reader {
+    Db *db;
+    uint64_t generation;
+    int busy;
+};
+
+struct cbio_shared {
+    struct cbio_reader *readers;
+    unsigned int nreaders;
+    unsigned int next;
+    uint64_t generation;
+};
+
+static void cbio_shared_destroy(struct cbio_shared *shared)
+{
+    unsigned int ii;
+
+    if (shared->readers != NULL) {
+        for (ii = 0; ii < shared->nreaders; ++ii) {
+            if (shared->readers[ii].db != NULL) {
+                couchstore_close_db(shared->readers[ii].db);
+            }
+        }
+        cbio_free(shared->readers);
+    }
+    cbio_free(shared);
+}
+
+LIBCBIO_API
+cbio_error_t cbio_open_shared_handle(const char *name,
+                                     libcbio_open_mode_t mode,
+                                     unsigned int nreaders,
+                                     libcbio_t *handle)
+{
+    struct cbio_shared *shared;
+    cbio_error_t err;
+
+    if ((err = cbio_open_handle(name, mode, handle)) != CBIO_SUCCESS) {
+        return err;
+    }
+
+    if ((shared = cbio_calloc(NULL, 1, sizeof(*shared))) == NULL) {
+        cbio_close_handle(*handle);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    shared->nreaders = nreaders == 0 ? cbio_default_concurrency() : nreaders;
+    shared->readers = cbio_calloc(NULL, shared->nreaders,
+                                  sizeof(struct cbio_reader));
+    if (shared->readers == NULL) {
+        cbio_shared_destroy(shared);
+        cbio_close_handle(*handle);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    (*handle)->shared = shared;
+    return CBIO_SUCCESS;
+}
+
+cbio_error_t cbio_acquire_db(libcbio_t handle,
+                             Db **db,
+                             struct cbio_reader **reader)
+{
+    struct cbio_shared *shared = handle->shared;
+    struct cbio_reader *slot;
+    couchstore_error_t err;
+    uint64_t generation;
+    unsigned int start;
+    unsigned int ii;
+
+    *reader = NULL;
+    if (shared == NULL) {
+        *db = handle->couchstore_handle;
+        return CBIO_SUCCESS;
+    }
+
+    generation = __sync_fetch_and_add(&shared->generation, 0);
+    start = __sync_fetch_and_add(&shared->next, 1);
+    for (ii = 0; ii < shared->nreaders; ++ii) {
+        slot = shared->readers + ((start + ii) % shared->nreaders);
+        if (__sync_bool_compare_and_swap(&slot->busy, 0, 1)) {
+            if (slot->db != NULL && slot->generation != generation) {
+                couchstore_close_db(slot->db);
+                slot->db = NULL;
+            }
+
+            if (slot->db == NULL) {
+                err = couchstore_open_db(handle->filename,
+                                         COUCHSTORE_OPEN_FLAG_RDONLY,
+                                         &slot->db);
+                if (err != COUCHSTORE_SUCCESS) {
+                    slot->db = NULL;
+                    __sync_lock_release(&slot->busy);
+                    return cbio_remap_error(err);
+                }
+                slot->generation = generation;
+            }
+
+            *db = slot->db;
+            *reader = slot;
+            return CBIO_SUCCESS;
+        }
+    }
+
+    /* All of the slots are in use */
+    err = couchstore_open_db(handle->filename, COUCHSTORE_OPEN_FLAG_RDONLY,
+                             db);
+    return cbio_remap_error(err);
+}
+
+void cbio_release_db(libcbio_t handle, Db *db, struct cbio_reader *reader)
+{
+    if (reader != NULL) {
+        __sync_lock_release(&reader->busy);
+    } else if (db != handle->couchstore_handle) {
+        couchstore_close_db(db);
+    }
+}
+
+void cbio_shared_committed(libcbio_t handle)
+{
+    if (handle->shared != NULL) {
+        (void)__sync_fetch_and_add(&handle->shared->generation, 1);
+    }
+}
+
+void cbio_shared_release(libcbio_t handle)
+{
+    if (handle->shared != NULL) {
+        cbio_shared_destroy(handle->shared);
+        handle->shared = NULL;
+    }
+}
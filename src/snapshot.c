@@ -0,0 +1,102 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * A snapshot is a read only handle with its own instance of the
+ * database file, pinned to a header. The file is append only so the
+ * header (and everything it refers to) stays valid while the writer
+ * keeps appending to the file.
+ */
+#include "internal.h"
+
+/*
+ * Rewind to the previous header in the file. couchstore closes the Db
+ * if it fails to rewind, and it reports every failure (including
+ * stepping past the oldest header) as COUCHSTORE_ERROR_DB_NO_LONGER_VALID.
+ */
+cbio_error_t cbio_rewind_header(Db **db)
+{
+    couchstore_error_t err;
+
+    if ((err = couchstore_rewind_db_header(*db)) == COUCHSTORE_SUCCESS) {
+        return CBIO_SUCCESS;
+    }
+
+    *db = NULL;
+    if (err == COUCHSTORE_ERROR_DB_NO_LONGER_VALID ||
+        err == COUCHSTORE_ERROR_NO_HEADER) {
+        return CBIO_ERROR_NO_HEADER;
+    }
+    return cbio_remap_error(err);
+}
+
+/*
+ * Walk the headers in the file backwards until we reach the header
+ * at the requested position.
+ */
+cbio_error_t cbio_rewind_to(Db **db, uint64_t position)
+{
+    cbio_error_t err;
+
+    while (couchstore_get_header_position(*db) > position) {
+        if ((err = cbio_rewind_header(db)) != CBIO_SUCCESS) {
+            return err;
+        }
+    }
+
+    if (couchstore_get_header_position(*db) != position) {
+        return CBIO_ERROR_NO_HEADER;
+    }
+
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_snapshot_open(libcbio_t handle, libcbio_t *snapshot)
+{
+    cbio_error_t err;
+    uint64_t position;
+
+    if (handle == NULL || snapshot == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    /* Pin the last header committed through the handle (a commit from
+     * another thread or process may have added a newer one before we
+     * open the file)
+     */
+    position = couchstore_get_header_position(handle->couchstore_handle);
+    err = cbio_open_handle(handle->filename, CBIO_OPEN_RDONLY, snapshot);
+    if (err != CBIO_SUCCESS) {
+        return err;
+    }
+
+    err = cbio_rewind_to(&(*snapshot)->couchstore_handle, position);
+    if (err != CBIO_SUCCESS) {
+        cbio_close_handle(*snapshot);
+        *snapshot = NULL;
+        return err;
+    }
+
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+void cbio_snapshot_close(libcbio_t snapshot)
+{
+    cbio_close_handle(snapshot);
+}
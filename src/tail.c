@@ -0,0 +1,205 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Follow a file written by someone else. The file is append only, and
+ * every commit appends a new header, so the file can't have a new
+ * header unless it grew since we looked for the header. That makes
+ * detecting new commits a stat(2), and we only search for the header
+ * when the file did grow.
+ */
+#include "internal.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+/* How often we check the file size without inotify (in ms) */
+#define CBIO_POLL_INTERVAL 10
+
+off_t cbio_get_file_size(const char *name)
+{
+    struct stat st;
+    if (stat(name, &st) == -1) {
+        return 0;
+    }
+    return st.st_size;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_refresh(libcbio_t handle)
+{
+    couchstore_error_t err;
+    off_t size;
+    Db *db;
+
+    if (handle == NULL || handle->mode != CBIO_OPEN_RDONLY) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    size = cbio_get_file_size(handle->filename);
+    if (size == handle->file_size) {
+        return CBIO_SUCCESS;
+    }
+
+    err = couchstore_open_db(handle->filename, COUCHSTORE_OPEN_FLAG_RDONLY,
+                             &db);
+    if (err != COUCHSTORE_SUCCESS) {
+        return cbio_remap_error(err);
+    }
+
+    handle->file_size = size;
+    if (couchstore_get_header_position(db) ==
+        couchstore_get_header_position(handle->couchstore_handle)) {
+        /* The file grew, but the writer hasn't committed yet */
+        couchstore_close_db(db);
+        return CBIO_SUCCESS;
+    }
+
+    couchstore_close_db(handle->couchstore_handle);
+    handle->couchstore_handle = db;
+    cbio_shared_committed(handle);
+
+    return CBIO_SUCCESS;
+}
+
+static long cbio_time_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long)tv.tv_sec * 1000 + (long)(tv.tv_usec / 1000);
+}
+
+LIBCBIO_API
+cbio_error_t cbio_wait_for_commit(libcbio_t handle, int timeout)
+{
+    long deadline;
+    int fd = -1;
+
+    if (handle == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    deadline = timeout < 0 ? -1 : cbio_time_ms() + timeout;
+
+#ifdef HAVE_SYS_INOTIFY_H
+    /* Add the watch before we look at the size so we can't miss it */
+    if ((fd = inotify_init()) != -1 &&
+        inotify_add_watch(fd, handle->filename, IN_MODIFY) == -1) {
+        close(fd);
+        fd = -1;
+    }
+#endif
+
+    for (;;) {
+        struct pollfd pfd;
+        int wait;
+
+        if (cbio_get_file_size(handle->filename) != handle->file_size) {
+            break;
+        }
+
+        wait = CBIO_POLL_INTERVAL;
+        if (deadline != -1) {
+            long left = deadline - cbio_time_ms();
+            if (left <= 0) {
+                if (fd != -1) {
+                    close(fd);
+                }
+                return CBIO_ERROR_TIMEOUT;
+            }
+            if (fd != -1 || left < wait) {
+                wait = (int)left;
+            }
+        } else if (fd != -1) {
+            wait = -1;
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, fd == -1 ? 0 : 1, wait) == -1 && errno != EINTR) {
+            break;
+        }
+
+#ifdef HAVE_SYS_INOTIFY_H
+        if (pfd.revents & POLLIN) {
+            char buffer[sizeof(struct inotify_event) + 256];
+            /* Drain the events, the size check tells us what we need */
+            if (read(fd, buffer, sizeof(buffer)) == -1) {
+                break;
+            }
+        }
+#endif
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_tail_changes(libcbio_t handle,
+                               uint64_t *since,
+                               int timeout,
+                               cbio_changes_callback_fn callback,
+                               void *ctx)
+{
+    couchstore_error_t err;
+    cbio_error_t ret;
+    DbInfo info;
+
+    if (handle == NULL || since == NULL || callback == NULL ||
+        handle->mode != CBIO_OPEN_RDONLY) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    for (;;) {
+        err = couchstore_db_info(handle->couchstore_handle, &info);
+        if (err != COUCHSTORE_SUCCESS) {
+            return cbio_remap_error(err);
+        }
+
+        if (info.last_sequence >= *since) {
+            ret = cbio_changes_since(handle, *since, callback, ctx);
+            if (ret != CBIO_SUCCESS) {
+                return ret;
+            }
+            *since = info.last_sequence + 1;
+        }
+
+        do {
+            if ((ret = cbio_wait_for_commit(handle, timeout)) != CBIO_SUCCESS) {
+                return ret;
+            }
+            if ((ret = cbio_refresh(handle)) != CBIO_SUCCESS) {
+                return ret;
+            }
+            err = couchstore_db_info(handle->couchstore_handle, &info);
+            if (err != COUCHSTORE_SUCCESS) {
+                return cbio_remap_error(err);
+            }
+        } while (info.last_sequence < *since);
+    }
+}
@@ -0,0 +1,289 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Record the operations performed through a handle to a trace file
+ * (see trace.h for the format). The records are buffered by stdio
+ * and written under a mutex, as the readers of a shared handle may
+ * be used from multiple threads.
+ */
+#include "internal.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+struct cbio_trace {
+    pthread_mutex_t mutex;
+    FILE *fp;
+    uint64_t start;
+    /* Set if a write failed (we stop recording) */
+    int failed;
+};
+
+static void cbio_trace_put32(uint8_t *ptr, uint32_t val)
+{
+    int ii;
+    for (ii = 0; ii < 4; ++ii) {
+        ptr[ii] = (uint8_t)(val >> (ii * 8));
+    }
+}
+
+static void cbio_trace_put64(uint8_t *ptr, uint64_t val)
+{
+    int ii;
+    for (ii = 0; ii < 8; ++ii) {
+        ptr[ii] = (uint8_t)(val >> (ii * 8));
+    }
+}
+
+static uint64_t cbio_trace_hash(const void *data, size_t nb)
+{
+    const uint8_t *ptr = data;
+    uint64_t hash;
+    size_t ii;
+
+    CBIO_TRACE_HASH_INIT(hash);
+    for (ii = 0; ii < nb; ++ii) {
+        CBIO_TRACE_HASH(hash, ptr[ii]);
+    }
+
+    return hash;
+}
+
+uint64_t cbio_trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_trace_start(libcbio_t handle, const char *name)
+{
+    uint8_t header[CBIO_TRACE_HEADER_SIZE];
+    struct cbio_trace *trace;
+    struct timeval tv;
+
+    if (handle == NULL || name == NULL || handle->trace != NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((trace = cbio_calloc(handle, 1, sizeof(*trace))) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    if ((trace->fp = fopen(name, "wb")) == NULL) {
+        cbio_free(trace);
+        return CBIO_ERROR_OPEN_FILE;
+    }
+
+    gettimeofday(&tv, NULL);
+    memcpy(header, CBIO_TRACE_MAGIC, 8);
+    cbio_trace_put64(header + 8, (uint64_t)tv.tv_sec * 1000000 +
+                     (uint64_t)tv.tv_usec);
+    if (fwrite(header, sizeof(header), 1, trace->fp) != 1) {
+        fclose(trace->fp);
+        cbio_free(trace);
+        return CBIO_ERROR_EIO;
+    }
+
+    pthread_mutex_init(&trace->mutex, NULL);
+    trace->start = cbio_trace_now();
+    handle->trace = trace;
+
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_trace_stop(libcbio_t handle)
+{
+    struct cbio_trace *trace = handle->trace;
+    int failed;
+
+    if (trace == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    handle->trace = NULL;
+    failed = trace->failed;
+    if (fclose(trace->fp) != 0) {
+        failed = 1;
+    }
+    pthread_mutex_destroy(&trace->mutex);
+    cbio_free(trace);
+
+    return failed ? CBIO_ERROR_EIO : CBIO_SUCCESS;
+}
+
+/*
+ * Write the record header for an operation started at `start`. The
+ * caller holds the mutex.
+ */
+static void cbio_trace_write_record(struct cbio_trace *trace,
+                                    cbio_trace_op_t op,
+                                    uint64_t start,
+                                    cbio_error_t status,
+                                    uint32_t count,
+                                    uint64_t arg)
+{
+    uint8_t record[CBIO_TRACE_RECORD_SIZE];
+    uint64_t now = cbio_trace_now();
+
+    memset(record, 0, sizeof(record));
+    record[0] = (uint8_t)op;
+    record[1] = (uint8_t)status;
+    cbio_trace_put32(record + 4, count);
+    cbio_trace_put64(record + 8, start - trace->start);
+    cbio_trace_put64(record + 16, now - start);
+    cbio_trace_put64(record + 24, arg);
+
+    if (fwrite(record, sizeof(record), 1, trace->fp) != 1) {
+        trace->failed = 1;
+    }
+}
+
+static void cbio_trace_write_entry(struct cbio_trace *trace,
+                                   const void *id,
+                                   size_t nid,
+                                   size_t nvalue,
+                                   int deleted)
+{
+    uint8_t entry[CBIO_TRACE_ENTRY_SIZE];
+    uint32_t flags = 0;
+
+    if (deleted) {
+        flags |= CBIO_TRACE_DELETED;
+    }
+    if (cbio_is_local_id(id, nid)) {
+        flags |= CBIO_TRACE_LOCAL;
+    }
+
+    memset(entry, 0, sizeof(entry));
+    cbio_trace_put64(entry, cbio_trace_hash(id, nid));
+    cbio_trace_put32(entry + 8, (uint32_t)nid);
+    cbio_trace_put32(entry + 12, (uint32_t)nvalue);
+    cbio_trace_put32(entry + 16, flags);
+
+    if (fwrite(entry, sizeof(entry), 1, trace->fp) != 1) {
+        trace->failed = 1;
+    }
+}
+
+/* The value of a regular document isn't read by a get */
+static size_t cbio_trace_value_size(libcbio_document_t doc)
+{
+    if (doc->doc != NULL) {
+        return doc->doc->data.size;
+    }
+    return doc->info == NULL ? 0 : doc->info->size;
+}
+
+void cbio_trace_get(libcbio_t handle,
+                    uint64_t start,
+                    cbio_error_t status,
+                    const void *id,
+                    size_t nid,
+                    libcbio_document_t doc)
+{
+    struct cbio_trace *trace = handle->trace;
+
+    pthread_mutex_lock(&trace->mutex);
+    if (!trace->failed) {
+        cbio_trace_write_record(trace, CBIO_TRACE_GET, start, status, 1, 0);
+        if (doc != NULL) {
+            int deleted = doc->info != NULL && doc->info->deleted;
+            cbio_trace_write_entry(trace, id, nid,
+                                   cbio_trace_value_size(doc), deleted);
+        } else {
+            cbio_trace_write_entry(trace, id, nid, 0, 0);
+        }
+    }
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+void cbio_trace_store(libcbio_t handle,
+                      uint64_t start,
+                      cbio_error_t status,
+                      libcbio_document_t *doc,
+                      size_t ndocs)
+{
+    struct cbio_trace *trace = handle->trace;
+    size_t ii;
+
+    pthread_mutex_lock(&trace->mutex);
+    if (!trace->failed) {
+        cbio_trace_write_record(trace, CBIO_TRACE_STORE, start, status,
+                                (uint32_t)ndocs, 0);
+        for (ii = 0; ii < ndocs; ++ii) {
+            /* The fields are allocated as they are set */
+            const DocInfo *info = doc[ii]->info;
+            const Doc *body = doc[ii]->doc;
+            if (info != NULL) {
+                cbio_trace_write_entry(trace, info->id.buf, info->id.size,
+                                       body == NULL ? 0 : body->data.size,
+                                       info->deleted);
+            } else {
+                cbio_trace_write_entry(trace, "", 0,
+                                       body == NULL ? 0 : body->data.size, 0);
+            }
+        }
+    }
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+void cbio_trace_store_info(libcbio_t handle,
+                           uint64_t start,
+                           cbio_error_t status,
+                           DocInfo *const *info,
+                           Doc *const *doc,
+                           size_t ndocs)
+{
+    struct cbio_trace *trace = handle->trace;
+    size_t ii;
+
+    pthread_mutex_lock(&trace->mutex);
+    if (!trace->failed) {
+        cbio_trace_write_record(trace, CBIO_TRACE_STORE, start, status,
+                                (uint32_t)ndocs, 0);
+        for (ii = 0; ii < ndocs; ++ii) {
+            cbio_trace_write_entry(trace, info[ii]->id.buf, info[ii]->id.size,
+                                   doc[ii] == NULL ? 0 : doc[ii]->data.size,
+                                   info[ii]->deleted);
+        }
+    }
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+void cbio_trace_op(libcbio_t handle,
+                   cbio_trace_op_t op,
+                   uint64_t start,
+                   cbio_error_t status,
+                   uint32_t count,
+                   uint64_t arg)
+{
+    struct cbio_trace *trace = handle->trace;
+
+    pthread_mutex_lock(&trace->mutex);
+    if (!trace->failed) {
+        cbio_trace_write_record(trace, op, start, status, count, arg);
+    }
+    pthread_mutex_unlock(&trace->mutex);
+}
@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * The format of the operation traces written by cbio_trace_start()
+ * (and read by tools/cbio_replay). All integers are little endian.
+ *
+ * The file starts with a header:
+ *
+ *    0  8 bytes  CBIO_TRACE_MAGIC
+ *    8  uint64   the wall clock time the trace started (usec since epoch)
+ *
+ * followed by a record per operation:
+ *
+ *    0  uint8    the operation (cbio_trace_op_t)
+ *    1  uint8    the result (cbio_error_t)
+ *    2  uint16   reserved
+ *    4  uint32   the number of documents
+ *    8  uint64   the start of the operation (nsec since the trace started)
+ *   16  uint64   the duration of the operation in nsec
+ *   24  uint64   an argument (the sequence number for changes)
+ *
+ * Get and store records are followed by an entry per document (and
+ * the documents count is the number of entries). The number of
+ * documents in a changes record is the number of documents delivered
+ * to the callback, and isn't followed by any entries.
+ *
+ *    0  uint64   the hash of the id (see CBIO_TRACE_HASH)
+ *    8  uint32   the size of the id
+ *   12  uint32   the size of the value (on disk for gets)
+ *   16  uint32   flags (CBIO_TRACE_DELETED, CBIO_TRACE_LOCAL)
+ *   20  uint32   reserved
+ *
+ * The ids aren't recorded, so the traces may be taken off the machine
+ * without leaking any data.
+ */
+#ifndef LIBCBIO_TRACE_H
+#define LIBCBIO_TRACE_H 1
+
+#define CBIO_TRACE_MAGIC "CBIOTRC1"
+#define CBIO_TRACE_HEADER_SIZE 16
+#define CBIO_TRACE_RECORD_SIZE 32
+#define CBIO_TRACE_ENTRY_SIZE 24
+
+#define CBIO_TRACE_DELETED 0x01
+#define CBIO_TRACE_LOCAL 0x02
+
+typedef enum {
+    CBIO_TRACE_GET = 1,
+    CBIO_TRACE_STORE,
+    CBIO_TRACE_COMMIT,
+    CBIO_TRACE_CHANGES
+} cbio_trace_op_t;
+
+/* 64 bit FNV-1a, fed one byte of the id at a time */
+#define CBIO_TRACE_HASH_INIT(h) \
+    ((h) = ((uint64_t)0xcbf29ce4 << 32) | (uint64_t)0x84222325)
+#define CBIO_TRACE_HASH(h, c) \
+    ((h) = ((h) ^ (uint8_t)(c)) * (((uint64_t)1 << 40) | (uint64_t)0x1b3))
+
+#endif
@@ -0,0 +1,165 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+struct cbio_workqueue {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct cbio_work *head;
+    struct cbio_work *tail;
+    int shutdown;
+    unsigned int nthreads;
+    pthread_t *threads;
+};
+
+static void *cbio_worker_main(void *arg)
+{
+    struct cbio_workqueue *wq = arg;
+
+    pthread_mutex_lock(&wq->mutex);
+    for (;;) {
+        struct cbio_work *work;
+
+        while (wq->head == NULL && !wq->shutdown) {
+            pthread_cond_wait(&wq->cond, &wq->mutex);
+        }
+
+        if ((work = wq->head) == NULL) {
+            /* shutdown, and all of the work is done */
+            break;
+        }
+
+        if ((wq->head = work->next) == NULL) {
+            wq->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&wq->mutex);
+        work->fn(work);
+        pthread_mutex_lock(&wq->mutex);
+    }
+    pthread_mutex_unlock(&wq->mutex);
+
+    return NULL;
+}
+
+unsigned int cbio_default_concurrency(void)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return ncpu < 1 ? 1 : (unsigned int)ncpu;
+}
+
+cbio_error_t cbio_workqueue_create(unsigned int nthreads,
+                                   struct cbio_workqueue **wq)
+{
+    struct cbio_workqueue *ret;
+
+    if (nthreads == 0) {
+        nthreads = cbio_default_concurrency();
+    }
+
+    if ((ret = cbio_calloc(NULL, 1, sizeof(*ret))) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    ret->threads = cbio_calloc(NULL, nthreads, sizeof(pthread_t));
+    if (ret->threads == NULL) {
+        cbio_free(ret);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    pthread_mutex_init(&ret->mutex, NULL);
+    pthread_cond_init(&ret->cond, NULL);
+
+    for (ret->nthreads = 0; ret->nthreads < nthreads; ++ret->nthreads) {
+        if (pthread_create(ret->threads + ret->nthreads, NULL,
+                           cbio_worker_main, ret) != 0) {
+            cbio_workqueue_destroy(ret);
+            return CBIO_ERROR_INTERNAL;
+        }
+    }
+
+    *wq = ret;
+    return CBIO_SUCCESS;
+}
+
+void cbio_workqueue_submit(struct cbio_workqueue *wq,
+                           struct cbio_work *work)
+{
+    work->next = NULL;
+    pthread_mutex_lock(&wq->mutex);
+    if (wq->tail == NULL) {
+        wq->head = work;
+    } else {
+        wq->tail->next = work;
+    }
+    wq->tail = work;
+    pthread_cond_signal(&wq->cond);
+    pthread_mutex_unlock(&wq->mutex);
+}
+
+void cbio_workqueue_destroy(struct cbio_workqueue *wq)
+{
+    unsigned int ii;
+
+    pthread_mutex_lock(&wq->mutex);
+    wq->shutdown = 1;
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->mutex);
+
+    for (ii = 0; ii < wq->nthreads; ++ii) {
+        pthread_join(wq->threads[ii], NULL);
+    }
+
+    pthread_cond_destroy(&wq->cond);
+    pthread_mutex_destroy(&wq->mutex);
+    cbio_free(wq->threads);
+    cbio_free(wq);
+}
+
+void cbio_latch_init(struct cbio_latch *latch, size_t count)
+{
+    pthread_mutex_init(&latch->mutex, NULL);
+    pthread_cond_init(&latch->cond, NULL);
+    latch->count = count;
+}
+
+void cbio_latch_count_down(struct cbio_latch *latch)
+{
+    pthread_mutex_lock(&latch->mutex);
+    if (--latch->count == 0) {
+        pthread_cond_broadcast(&latch->cond);
+    }
+    pthread_mutex_unlock(&latch->mutex);
+}
+
+void cbio_latch_wait(struct cbio_latch *latch)
+{
+    pthread_mutex_lock(&latch->mutex);
+    while (latch->count != 0) {
+        pthread_cond_wait(&latch->cond, &latch->mutex);
+    }
+    pthread_mutex_unlock(&latch->mutex);
+}
+
+void cbio_latch_destroy(struct cbio_latch *latch)
+{
+    pthread_cond_destroy(&latch->cond);
+    pthread_mutex_destroy(&latch->mutex);
+}
@@ -0,0 +1,73 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "alloc_counter.h"
+
+#include <cstdlib>
+
+static uint64_t allocations;
+static uint64_t bytes;
+
+#ifdef __GLIBC__
+/*
+ * The definitions in the executable take precedence over the ones in
+ * libc, also for the calls made from libcbio.so.
+ */
+extern "C" {
+    extern void *__libc_malloc(size_t size);
+    extern void *__libc_calloc(size_t nmemb, size_t size);
+    extern void *__libc_realloc(void *ptr, size_t size);
+
+    void *malloc(size_t size)
+    {
+        __sync_fetch_and_add(&allocations, 1);
+        __sync_fetch_and_add(&bytes, size);
+        return __libc_malloc(size);
+    }
+
+    void *calloc(size_t nmemb, size_t size)
+    {
+        __sync_fetch_and_add(&allocations, 1);
+        __sync_fetch_and_add(&bytes, nmemb * size);
+        return __libc_calloc(nmemb, size);
+    }
+
+    void *realloc(void *ptr, size_t size)
+    {
+        __sync_fetch_and_add(&allocations, 1);
+        __sync_fetch_and_add(&bytes, size);
+        return __libc_realloc(ptr, size);
+    }
+}
+
+bool AllocCounter::available()
+{
+    return true;
+}
+#else
+bool AllocCounter::available()
+{
+    return false;
+}
+#endif
+
+AllocCounter::Snapshot AllocCounter::snapshot()
+{
+    Snapshot ret;
+    ret.allocations = __sync_fetch_and_add(&allocations, 0);
+    ret.bytes = __sync_fetch_and_add(&bytes, 0);
+    return ret;
+}
@@ -0,0 +1,42 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef LIBCBIO_TESTS_ALLOC_COUNTER_H
+#define LIBCBIO_TESTS_ALLOC_COUNTER_H 1
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Count the calls to malloc, calloc and realloc (and the number of
+ * bytes requested) made by the process, including the ones made from
+ * inside libcbio. The counting replaces the allocator functions, so
+ * it is only available with glibc.
+ */
+class AllocCounter {
+public:
+    struct Snapshot {
+        uint64_t allocations;
+        uint64_t bytes;
+    };
+
+    /* Whether the counting works on this platform */
+    static bool available();
+
+    static Snapshot snapshot();
+};
+
+#endif
@@ -0,0 +1,165 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <libcbio/cbio.hpp>
+#include <cerrno>
+#include <cstdio>
+#include <exception>
+#include <poll.h>
+#include <gtest/gtest.h>
+
+using namespace std;
+
+static const char cxxdbfile[] = "testcase.cxx.couch";
+
+/* A coroutine which starts immediately and can't be awaited */
+struct task {
+    struct promise_type {
+        task get_return_object() {
+            return task();
+        }
+        std::suspend_never initial_suspend() noexcept {
+            return std::suspend_never();
+        }
+        std::suspend_never final_suspend() noexcept {
+            return std::suspend_never();
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+class LibcbioCxxTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp(void) {
+        removeDb();
+        db = cbio::handle(cxxdbfile, CBIO_OPEN_CREATE);
+    }
+
+    virtual void TearDown(void) {
+        db.close();
+        removeDb();
+    }
+
+    void removeDb(void) {
+        EXPECT_EQ(0, (remove(cxxdbfile) == -1 && errno != ENOENT));
+    }
+
+    void store(string_view key, string_view value) {
+        cbio::document doc = db.create_document();
+        doc.set_id(key, false).set_value(value, false);
+        db.store(doc);
+    }
+
+    void waitFor(cbio::async &async, const bool &done) {
+        while (!done) {
+            struct pollfd pfd;
+            pfd.fd = async.fd();
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            ASSERT_EQ(1, poll(&pfd, 1, 5000));
+            async.poll();
+        }
+    }
+
+    cbio::handle db;
+};
+
+TEST_F(LibcbioCxxTest, openMissingFile)
+{
+    try {
+        cbio::handle h("/this/path/does/not/exist", CBIO_OPEN_RDONLY);
+        FAIL() << "Expected an exception";
+    } catch (const cbio::error &e) {
+        EXPECT_NE(CBIO_SUCCESS, e.code());
+    }
+}
+
+TEST_F(LibcbioCxxTest, storeAndGet)
+{
+    store("hello", "world");
+    db.commit();
+
+    std::optional<cbio::document> doc = db.get("hello");
+    ASSERT_TRUE(doc.has_value());
+    EXPECT_EQ("hello", doc->id());
+    EXPECT_EQ("world", doc->value());
+    EXPECT_EQ(5U, doc->value_bytes().size());
+    EXPECT_FALSE(doc->deleted());
+    EXPECT_FALSE(db.get("missing").has_value());
+}
+
+TEST_F(LibcbioCxxTest, moveOnly)
+{
+    cbio::document doc = db.create_document();
+    libcbio_document_t raw = doc.get();
+    cbio::document other = std::move(doc);
+    EXPECT_FALSE(doc);
+    EXPECT_EQ(raw, other.get());
+
+    cbio::handle h = std::move(db);
+    EXPECT_FALSE(db);
+    db = std::move(h);
+    EXPECT_TRUE(db);
+}
+
+TEST_F(LibcbioCxxTest, changes)
+{
+    vector<cbio::document> docs;
+    for (int ii = 0; ii < 3; ++ii) {
+        docs.push_back(db.create_document());
+        docs.back().set_id(string(1, static_cast<char>('a' + ii)));
+        docs.back().set_value("value");
+    }
+    db.store(docs);
+    db.commit();
+
+    string ids;
+    for (const cbio::document &doc : db.changes(0)) {
+        ids.append(doc.id());
+        EXPECT_EQ("value", doc.value());
+    }
+    EXPECT_EQ("abc", ids);
+}
+
+static task storeThenGet(cbio::async &async, const cbio::handle &db,
+                         bool &done)
+{
+    cbio::document doc = db.create_document();
+    doc.set_id("hello", false).set_value("world", false);
+    co_await async.store(doc);
+    co_await async.commit();
+
+    std::optional<cbio::document> found = co_await async.get("hello");
+    EXPECT_TRUE(found.has_value());
+    if (found) {
+        EXPECT_EQ("world", found->value());
+    }
+    EXPECT_FALSE((co_await async.get("missing")).has_value());
+    done = true;
+}
+
+TEST_F(LibcbioCxxTest, coroutines)
+{
+    cbio::async async(db, 2);
+    bool done = false;
+    storeThenGet(async, db, done);
+    waitFor(async, done);
+}
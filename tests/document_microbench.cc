@@ -0,0 +1,164 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Microbenchmarks for the document object API. Every benchmark
+ * reports the number of allocations and the number of bytes allocated
+ * per iteration (allocs/op and bytes/op) next to the time per
+ * iteration, so an extra allocation on these paths shows up even if
+ * it is too cheap to move the timings.
+ */
+#include <libcbio/cbio.h>
+#include <benchmark/benchmark.h>
+#include <string>
+
+#include "alloc_counter.h"
+
+using namespace std;
+
+static const char key[] = "user:0123456789abcdef";
+static const char meta[] = "0123456789abcdef";
+
+/* Report the allocations made since `start` */
+static void reportAllocations(benchmark::State &state,
+                              const AllocCounter::Snapshot &start)
+{
+    if (AllocCounter::available()) {
+        AllocCounter::Snapshot end = AllocCounter::snapshot();
+        state.counters["allocs/op"] =
+            benchmark::Counter(static_cast<double>(end.allocations -
+                                                   start.allocations),
+                               benchmark::Counter::kAvgIterations);
+        state.counters["bytes/op"] =
+            benchmark::Counter(static_cast<double>(end.bytes - start.bytes),
+                               benchmark::Counter::kAvgIterations);
+    }
+}
+
+static void BM_CreateRelease(benchmark::State &state)
+{
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    for (auto _ : state) {
+        libcbio_document_t doc;
+        cbio_create_empty_document(NULL, &doc);
+        benchmark::DoNotOptimize(doc);
+        cbio_document_release(doc);
+    }
+    reportAllocations(state, start);
+}
+BENCHMARK(BM_CreateRelease);
+
+/* Arg: allocate */
+static void BM_SetId(benchmark::State &state)
+{
+    int allocate = static_cast<int>(state.range(0));
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    for (auto _ : state) {
+        libcbio_document_t doc;
+        cbio_create_empty_document(NULL, &doc);
+        cbio_document_set_id(doc, key, sizeof(key) - 1, allocate);
+        cbio_document_release(doc);
+    }
+    reportAllocations(state, start);
+}
+BENCHMARK(BM_SetId)->Arg(0)->Arg(1);
+
+/* Args: allocate, value size */
+static void BM_SetValue(benchmark::State &state)
+{
+    int allocate = static_cast<int>(state.range(0));
+    string value(static_cast<size_t>(state.range(1)), 'x');
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    for (auto _ : state) {
+        libcbio_document_t doc;
+        cbio_create_empty_document(NULL, &doc);
+        cbio_document_set_value(doc, value.data(), value.length(), allocate);
+        cbio_document_release(doc);
+    }
+    reportAllocations(state, start);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                            state.range(1));
+}
+BENCHMARK(BM_SetValue)
+->Args({0, 256})->Args({1, 256})->Args({0, 16384})->Args({1, 16384});
+
+/* Args: allocate */
+static void BM_SetAllFields(benchmark::State &state)
+{
+    int allocate = static_cast<int>(state.range(0));
+    string value(256, 'x');
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    for (auto _ : state) {
+        libcbio_document_t doc;
+        cbio_create_empty_document(NULL, &doc);
+        cbio_document_set_id(doc, key, sizeof(key) - 1, allocate);
+        cbio_document_set_meta(doc, meta, sizeof(meta) - 1, allocate);
+        cbio_document_set_value(doc, value.data(), value.length(), allocate);
+        cbio_document_set_revision(doc, 1);
+        cbio_document_set_content_type(doc, CBIO_DOC_IS_JSON);
+        cbio_document_release(doc);
+    }
+    reportAllocations(state, start);
+}
+BENCHMARK(BM_SetAllFields)->Arg(0)->Arg(1);
+
+/* Reuse a single document. Args: allocate */
+static void BM_Reinitialize(benchmark::State &state)
+{
+    int allocate = static_cast<int>(state.range(0));
+    string value(256, 'x');
+    libcbio_document_t doc;
+    cbio_create_empty_document(NULL, &doc);
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    for (auto _ : state) {
+        cbio_document_set_id(doc, key, sizeof(key) - 1, allocate);
+        cbio_document_set_value(doc, value.data(), value.length(), allocate);
+        cbio_document_reinitialize(doc);
+    }
+    reportAllocations(state, start);
+    cbio_document_release(doc);
+}
+BENCHMARK(BM_Reinitialize)->Arg(0)->Arg(1);
+
+static void BM_GetFields(benchmark::State &state)
+{
+    string value(256, 'x');
+    libcbio_document_t doc;
+    cbio_create_empty_document(NULL, &doc);
+    cbio_document_set_id(doc, key, sizeof(key) - 1, 0);
+    cbio_document_set_meta(doc, meta, sizeof(meta) - 1, 0);
+    cbio_document_set_value(doc, value.data(), value.length(), 0);
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    for (auto _ : state) {
+        const void *ptr;
+        size_t nb;
+        uint64_t revno;
+        cbio_document_get_id(doc, &ptr, &nb);
+        benchmark::DoNotOptimize(ptr);
+        cbio_document_get_meta(doc, &ptr, &nb);
+        benchmark::DoNotOptimize(ptr);
+        cbio_document_get_value(doc, &ptr, &nb);
+        benchmark::DoNotOptimize(ptr);
+        cbio_document_get_revision(doc, &revno);
+        benchmark::DoNotOptimize(revno);
+    }
+    reportAllocations(state, start);
+    cbio_document_release(doc);
+}
+BENCHMARK(BM_GetFields);
+
+BENCHMARK_MAIN();
@@ -16,11 +16,17 @@
  */
 
 #include <libcbio/cbio.h>
+#include "alloc_counter.h"
 #include <cerrno>
 #include <cstring>
 #include <cstdlib>
 #include <fcntl.h>
 #include <fstream>
+#include <iterator>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
 #include <gtest/gtest.h>
 
 using namespace std;
@@ -156,7 +162,32 @@ TEST_F(LibcbioOpenTest, HandleIllegalFileCREATE)
               cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle));
 }
 
+TEST_F(LibcbioOpenTest, OpenMultipleHandles)
+{
+    const char *names[3] = { dbfile, "/this/path/should/not/exist", dbfile };
+    libcbio_t handles[3];
+    cbio_error_t status[3];
+
+    EXPECT_EQ(CBIO_ERROR_EINVAL,
+              cbio_open_handles(names, 0, CBIO_OPEN_CREATE, 0,
+                                handles, status));
+
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_open_handles(names, 1, CBIO_OPEN_CREATE, 0,
+                                handles, status));
+    EXPECT_EQ(CBIO_SUCCESS, status[0]);
+    cbio_close_handle(handles[0]);
 
+    EXPECT_EQ(CBIO_ERROR_ENOENT,
+              cbio_open_handles(names, 3, CBIO_OPEN_RDONLY, 2,
+                                handles, status));
+    EXPECT_EQ(CBIO_SUCCESS, status[0]);
+    EXPECT_EQ(CBIO_ERROR_ENOENT, status[1]);
+    EXPECT_EQ(NULL, handles[1]);
+    EXPECT_EQ(CBIO_SUCCESS, status[2]);
+    cbio_close_handle(handles[0]);
+    cbio_close_handle(handles[2]);
+}
 
 class LibcbioCreateDatabaseTest : public LibcbioTest {};
 
@@ -474,6 +505,476 @@ TEST_F(LibcbioDataAccessTest, testChangesSinceDocuments)
     EXPECT_EQ(5000, total);
 }
 
+struct BatchContext {
+    vector<size_t> batches;
+    vector<string> ids;
+    size_t stopAfter;
+};
+
+extern "C" {
+    static int batch_callback(libcbio_t handle,
+                              libcbio_document_t *docs,
+                              size_t ndocs,
+                              void *ctx)
+    {
+        (void)handle;
+        BatchContext *bctx = static_cast<BatchContext *>(ctx);
+        bctx->batches.push_back(ndocs);
+        for (size_t ii = 0; ii < ndocs; ++ii) {
+            const void *ptr;
+            size_t nb;
+            EXPECT_EQ(CBIO_SUCCESS, cbio_document_get_id(docs[ii], &ptr, &nb));
+            bctx->ids.push_back(string(static_cast<const char *>(ptr), nb));
+            EXPECT_EQ(CBIO_SUCCESS,
+                      cbio_document_get_value(docs[ii], &ptr, &nb));
+            EXPECT_EQ(bctx->ids.back().length(), nb);
+        }
+        return bctx->batches.size() == bctx->stopAfter;
+    }
+}
+
+TEST_F(LibcbioDataAccessTest, testChangesSinceBatch)
+{
+    BatchContext bctx;
+    bctx.stopAfter = 0;
+    EXPECT_EQ(CBIO_ERROR_EINVAL,
+              cbio_changes_since_batch(handle, 0, 0, batch_callback, &bctx));
+
+    for (int ii = 0; ii < 25; ++ii) {
+        storeSingleDocument(generateKey(ii), generateKey(ii));
+    }
+    /* Larger than the arena reserved for a row */
+    string large(1000, 'x');
+    storeSingleDocument(large, large);
+
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_changes_since_batch(handle, 0, 10, batch_callback, &bctx));
+    /* A batch is delivered early if the next row doesn't fit */
+    EXPECT_EQ(10U, bctx.batches[0]);
+    EXPECT_EQ(10U, bctx.batches[1]);
+    for (size_t ii = 0; ii < bctx.batches.size(); ++ii) {
+        EXPECT_GE(10U, bctx.batches[ii]);
+    }
+    ASSERT_EQ(26U, bctx.ids.size());
+    for (int ii = 0; ii < 25; ++ii) {
+        EXPECT_EQ(generateKey(ii), bctx.ids[ii]);
+    }
+    EXPECT_EQ(large, bctx.ids[25]);
+
+    BatchContext stopped;
+    stopped.stopAfter = 2;
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_changes_since_batch(handle, 0, 4, batch_callback,
+                                       &stopped));
+    EXPECT_EQ(2U, stopped.batches.size());
+    EXPECT_EQ(8U, stopped.ids.size());
+}
+
+extern "C" {
+    static int stop_batch_callback(libcbio_t handle,
+                                   libcbio_document_t *docs,
+                                   size_t ndocs,
+                                   void *ctx)
+    {
+        (void)handle;
+        (void)docs;
+        static_cast<vector<size_t> *>(ctx)->push_back(ndocs);
+        return 1;
+    }
+}
+
+TEST_F(LibcbioDataAccessTest, testChangesSinceBatchStopsScan)
+{
+    if (!AllocCounter::available()) {
+        return;
+    }
+    bulkStoreDocuments(5000);
+
+    // Every DocInfo couchstore visits is allocated, so walking the
+    // rest of the file after the stop would show up here
+    vector<size_t> batches;
+    batches.reserve(10);
+    AllocCounter::Snapshot before = AllocCounter::snapshot();
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_changes_since_batch(handle, 0, 10, stop_batch_callback,
+                                       &batches));
+    AllocCounter::Snapshot after = AllocCounter::snapshot();
+    ASSERT_EQ(1U, batches.size());
+    EXPECT_EQ(10U, batches[0]);
+    EXPECT_GT(500U, after.allocations - before.allocations);
+}
+
+extern "C" {
+    static int retain_callback(libcbio_t handle,
+                               libcbio_document_t doc,
+                               void *ctx)
+    {
+        (void)handle;
+        static_cast<vector<libcbio_document_t> *>(ctx)->push_back(doc);
+        return 1;
+    }
+}
+
+TEST_F(LibcbioDataAccessTest, testChangesSinceBudget)
+{
+    for (int ii = 0; ii < 20; ++ii) {
+        storeSingleDocument(generateKey(ii), string(100, 'x'));
+    }
+
+    cbio_budget_t budget;
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_budget_create(0, &budget));
+    ASSERT_EQ(CBIO_SUCCESS, cbio_budget_create(2048, &budget));
+
+    vector<libcbio_document_t> docs;
+    EXPECT_EQ(CBIO_ERROR_TIMEOUT,
+              cbio_changes_since_budget(handle, 0, budget, 0,
+                                        retain_callback, &docs));
+    ASSERT_LT(0U, docs.size());
+    EXPECT_GT(20U, docs.size());
+    EXPECT_GE(2048U, cbio_budget_get_used(budget));
+    EXPECT_LT(0U, cbio_budget_get_used(budget));
+
+    /* Resume after releasing what we got */
+    uint64_t seq;
+    size_t total = docs.size();
+    EXPECT_EQ(CBIO_SUCCESS, cbio_document_get_sequence(docs.back(), &seq));
+    for (size_t ii = 0; ii < docs.size(); ++ii) {
+        cbio_document_release(docs[ii]);
+    }
+    docs.clear();
+    EXPECT_EQ(0U, cbio_budget_get_used(budget));
+
+    while (total < 20) {
+        cbio_error_t err;
+        err = cbio_changes_since_budget(handle, seq + 1, budget, 10,
+                                        retain_callback, &docs);
+        ASSERT_LT(0U, docs.size());
+        total += docs.size();
+        EXPECT_EQ(CBIO_SUCCESS,
+                  cbio_document_get_sequence(docs.back(), &seq));
+        for (size_t ii = 0; ii < docs.size(); ++ii) {
+            cbio_document_release(docs[ii]);
+        }
+        docs.clear();
+        if (err == CBIO_SUCCESS) {
+            break;
+        }
+        EXPECT_EQ(CBIO_ERROR_TIMEOUT, err);
+    }
+    EXPECT_EQ(20U, total);
+    EXPECT_EQ(0U, cbio_budget_get_used(budget));
+    cbio_budget_destroy(budget);
+}
+
+struct SlowConsumer {
+    pthread_mutex_t mutex;
+    vector<libcbio_document_t> docs;
+    int received;
+    bool done;
+};
+
+extern "C" {
+    static int enqueue_callback(libcbio_t handle,
+                                libcbio_document_t doc,
+                                void *ctx)
+    {
+        (void)handle;
+        SlowConsumer *consumer = static_cast<SlowConsumer *>(ctx);
+        pthread_mutex_lock(&consumer->mutex);
+        consumer->docs.push_back(doc);
+        consumer->received++;
+        pthread_mutex_unlock(&consumer->mutex);
+        return 1;
+    }
+
+    static void *consumer_main(void *arg)
+    {
+        SlowConsumer *consumer = static_cast<SlowConsumer *>(arg);
+        for (;;) {
+            pthread_mutex_lock(&consumer->mutex);
+            bool done = consumer->done && consumer->docs.empty();
+            vector<libcbio_document_t> docs;
+            docs.swap(consumer->docs);
+            pthread_mutex_unlock(&consumer->mutex);
+            if (done) {
+                return NULL;
+            }
+            for (size_t ii = 0; ii < docs.size(); ++ii) {
+                cbio_document_release(docs[ii]);
+            }
+            usleep(1000);
+        }
+    }
+}
+
+TEST_F(LibcbioDataAccessTest, testChangesSinceBudgetStopsScan)
+{
+    if (!AllocCounter::available()) {
+        return;
+    }
+    bulkStoreDocuments(5000);
+
+    cbio_budget_t budget;
+    ASSERT_EQ(CBIO_SUCCESS, cbio_budget_create(2048, &budget));
+
+    // Every DocInfo couchstore visits is allocated, so walking the
+    // rest of the file after the timeout would show up here
+    vector<libcbio_document_t> docs;
+    docs.reserve(100);
+    AllocCounter::Snapshot before = AllocCounter::snapshot();
+    EXPECT_EQ(CBIO_ERROR_TIMEOUT,
+              cbio_changes_since_budget(handle, 0, budget, 0,
+                                        retain_callback, &docs));
+    AllocCounter::Snapshot after = AllocCounter::snapshot();
+    ASSERT_LT(0U, docs.size());
+    EXPECT_GT(100U, docs.size());
+    EXPECT_GT(500U, after.allocations - before.allocations);
+
+    for (size_t ii = 0; ii < docs.size(); ++ii) {
+        cbio_document_release(docs[ii]);
+    }
+    EXPECT_EQ(0U, cbio_budget_get_used(budget));
+    cbio_budget_destroy(budget);
+}
+
+TEST_F(LibcbioDataAccessTest, testChangesSinceBudgetWaits)
+{
+    for (int ii = 0; ii < 20; ++ii) {
+        storeSingleDocument(generateKey(ii), string(100, 'x'));
+    }
+
+    cbio_budget_t budget;
+    ASSERT_EQ(CBIO_SUCCESS, cbio_budget_create(1024, &budget));
+
+    SlowConsumer consumer;
+    pthread_mutex_init(&consumer.mutex, NULL);
+    consumer.received = 0;
+    consumer.done = false;
+
+    pthread_t tid;
+    ASSERT_EQ(0, pthread_create(&tid, NULL, consumer_main, &consumer));
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_changes_since_budget(handle, 0, budget, -1,
+                                        enqueue_callback, &consumer));
+    pthread_mutex_lock(&consumer.mutex);
+    consumer.done = true;
+    pthread_mutex_unlock(&consumer.mutex);
+    EXPECT_EQ(0, pthread_join(tid, NULL));
+
+    EXPECT_EQ(20, consumer.received);
+    EXPECT_EQ(0U, cbio_budget_get_used(budget));
+    cbio_budget_destroy(budget);
+    pthread_mutex_destroy(&consumer.mutex);
+}
+
+static uint32_t traceGet32(const vector<char> &trace, size_t offset)
+{
+    uint32_t ret = 0;
+    for (int ii = 3; ii >= 0; --ii) {
+        ret = (ret << 8) | static_cast<uint8_t>(trace[offset + ii]);
+    }
+    return ret;
+}
+
+TEST_F(LibcbioDataAccessTest, testTraceOperations)
+{
+    const char tracefile[] = "testcase.trace";
+    libcbio_document_t doc;
+    int total = 0;
+
+    ASSERT_EQ(CBIO_SUCCESS, cbio_trace_start(handle, tracefile));
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_trace_start(handle, tracefile));
+
+    storeSingleDocument("hello", "world!");
+    EXPECT_EQ(CBIO_SUCCESS, cbio_get_document(handle, "hello", 5, &doc));
+    cbio_document_release(doc);
+    EXPECT_EQ(CBIO_ERROR_ENOENT, cbio_get_document(handle, "miss", 4, &doc));
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_changes_since(handle, 0, count_callback,
+                                 static_cast<void *>(&total)));
+
+    EXPECT_EQ(CBIO_SUCCESS, cbio_trace_stop(handle));
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_trace_stop(handle));
+
+    ifstream in(tracefile, ios::binary);
+    vector<char> trace((istreambuf_iterator<char>(in)),
+                       istreambuf_iterator<char>());
+    in.close();
+    EXPECT_EQ(0, remove(tracefile));
+
+    // The header, then a 32 byte record per operation followed by
+    // a 24 byte entry per document for gets and stores
+    ASSERT_EQ(16U + 5 * 32 + 3 * 24, trace.size());
+    EXPECT_EQ(0, memcmp(&trace[0], "CBIOTRC1", 8));
+
+    size_t offset = 16;
+    // store
+    EXPECT_EQ(2, trace[offset]);
+    EXPECT_EQ(CBIO_SUCCESS, trace[offset + 1]);
+    EXPECT_EQ(1U, traceGet32(trace, offset + 4));
+    EXPECT_EQ(5U, traceGet32(trace, offset + 32 + 8));
+    EXPECT_EQ(6U, traceGet32(trace, offset + 32 + 12));
+    offset += 32 + 24;
+    // commit
+    EXPECT_EQ(3, trace[offset]);
+    EXPECT_EQ(0U, traceGet32(trace, offset + 4));
+    offset += 32;
+    // get, with the same id hash as the store
+    EXPECT_EQ(1, trace[offset]);
+    EXPECT_EQ(CBIO_SUCCESS, trace[offset + 1]);
+    EXPECT_EQ(0, memcmp(&trace[16 + 32], &trace[offset + 32], 8));
+    offset += 32 + 24;
+    // get miss
+    EXPECT_EQ(1, trace[offset]);
+    EXPECT_EQ(CBIO_ERROR_ENOENT, trace[offset + 1]);
+    EXPECT_EQ(4U, traceGet32(trace, offset + 32 + 8));
+    offset += 32 + 24;
+    // changes
+    EXPECT_EQ(4, trace[offset]);
+    EXPECT_EQ(1U, traceGet32(trace, offset + 4));
+}
+
+extern "C" {
+    static void probe_callback(libcbio_t handle,
+                               const cbio_probe_info_t *info,
+                               void *cookie)
+    {
+        (void)handle;
+        vector<cbio_probe_info_t> *probes =
+            static_cast<vector<cbio_probe_info_t> *>(cookie);
+        probes->push_back(*info);
+    }
+}
+
+TEST_F(LibcbioDataAccessTest, testProbeCallback)
+{
+    vector<cbio_probe_info_t> probes;
+    libcbio_document_t doc;
+    const void *ptr;
+    size_t nb;
+    int total = 0;
+
+    EXPECT_EQ(CBIO_ERROR_EINVAL,
+              cbio_set_probe_callback(NULL, probe_callback, &probes));
+    ASSERT_EQ(CBIO_SUCCESS,
+              cbio_set_probe_callback(handle, probe_callback, &probes));
+
+    storeSingleDocument("hello", "world!");
+    ASSERT_EQ(CBIO_SUCCESS, cbio_get_document(handle, "hello", 5, &doc));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_document_get_value(doc, &ptr, &nb));
+    cbio_document_release(doc);
+    EXPECT_EQ(CBIO_ERROR_ENOENT, cbio_get_document(handle, "miss", 4, &doc));
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_changes_since(handle, 0, count_callback,
+                                 static_cast<void *>(&total)));
+
+    ASSERT_EQ(CBIO_SUCCESS, cbio_set_probe_callback(handle, NULL, NULL));
+    storeSingleDocument("hello", "world");
+
+    const cbio_probe_t expected[] = {
+        CBIO_PROBE_STORE_DOCUMENTS,
+        CBIO_PROBE_COMMIT,
+        CBIO_PROBE_GET_DOCUMENT,
+        CBIO_PROBE_GET_VALUE,
+        CBIO_PROBE_GET_DOCUMENT,
+        CBIO_PROBE_CHANGES_SINCE
+    };
+    const size_t nexpected = sizeof(expected) / sizeof(expected[0]);
+    ASSERT_EQ(2 * nexpected, probes.size());
+    for (size_t ii = 0; ii < nexpected; ++ii) {
+        EXPECT_EQ(expected[ii], probes[ii * 2].probe);
+        EXPECT_EQ(0, probes[ii * 2].exit);
+        EXPECT_EQ(expected[ii], probes[ii * 2 + 1].probe);
+        EXPECT_EQ(1, probes[ii * 2 + 1].exit);
+    }
+
+    // store
+    EXPECT_EQ(1U, probes[0].count);
+    EXPECT_EQ(6U, probes[0].nbytes);
+    EXPECT_EQ(CBIO_SUCCESS, probes[1].status);
+    // get and get value
+    EXPECT_EQ(5U, probes[4].nid);
+    EXPECT_EQ(CBIO_SUCCESS, probes[5].status);
+    EXPECT_EQ(6U, probes[7].nbytes);
+    // miss
+    EXPECT_EQ(4U, probes[8].nid);
+    EXPECT_EQ(CBIO_ERROR_ENOENT, probes[9].status);
+    // changes
+    EXPECT_EQ(1U, probes[11].count);
+}
+
+extern "C" {
+    struct counting_allocator {
+        size_t calls;
+        size_t frees;
+    };
+
+    static void *counting_malloc(size_t size, void *ctx)
+    {
+        static_cast<struct counting_allocator *>(ctx)->calls++;
+        return malloc(size);
+    }
+
+    static void *counting_calloc(size_t nmemb, size_t size, void *ctx)
+    {
+        static_cast<struct counting_allocator *>(ctx)->calls++;
+        return calloc(nmemb, size);
+    }
+
+    static void *counting_realloc(void *ptr, size_t size, void *ctx)
+    {
+        static_cast<struct counting_allocator *>(ctx)->calls++;
+        return realloc(ptr, size);
+    }
+
+    static void counting_free(void *ptr, void *ctx)
+    {
+        static_cast<struct counting_allocator *>(ctx)->frees++;
+        free(ptr);
+    }
+}
+
+TEST_F(LibcbioDataAccessTest, testAllocator)
+{
+    struct counting_allocator counts = { 0, 0 };
+    cbio_allocator_t allocator = {
+        counting_malloc, counting_calloc, counting_realloc, counting_free,
+        &counts
+    };
+    cbio_allocator_t broken = allocator;
+    cbio_memory_stats_t stats;
+    libcbio_document_t doc;
+    const void *ptr;
+    size_t nb;
+
+    broken.free_fn = NULL;
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_set_allocator(handle, &broken));
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_get_memory_stats(handle, NULL));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_get_memory_stats(NULL, &stats));
+    ASSERT_EQ(CBIO_SUCCESS, cbio_set_allocator(handle, &allocator));
+
+    storeSingleDocument("hello", "world!");
+    ASSERT_EQ(CBIO_SUCCESS, cbio_get_document(handle, "hello", 5, &doc));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_document_get_value(doc, &ptr, &nb));
+
+    ASSERT_EQ(CBIO_SUCCESS, cbio_get_memory_stats(handle, &stats));
+    EXPECT_LT(0U, stats.allocated);
+    EXPECT_LT(0U, stats.allocations);
+    EXPECT_LE(stats.allocated, stats.peak);
+    EXPECT_LT(0U, counts.calls);
+    // The allocator can't be replaced with blocks outstanding
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_set_allocator(handle, NULL));
+
+    cbio_document_release(doc);
+    ASSERT_EQ(CBIO_SUCCESS, cbio_get_memory_stats(handle, &stats));
+    EXPECT_EQ(0U, stats.allocated);
+    EXPECT_EQ(0U, stats.allocations);
+    EXPECT_LT(0U, stats.peak);
+    EXPECT_EQ(stats.total_allocations, counts.calls);
+    EXPECT_EQ(counts.calls, counts.frees);
+    EXPECT_EQ(CBIO_SUCCESS, cbio_set_allocator(handle, NULL));
+}
+
 TEST_F(LibcbioDataAccessTest, testGetHeaderPosition)
 {
     EXPECT_EQ((off_t)0, cbio_get_header_position(handle));
@@ -597,3 +1098,997 @@ TEST_F(LibcbioLocalDocumentTest, testChangesLocalDocuments)
                                  static_cast<void *>(&total)));
     EXPECT_EQ(1, total);
 }
+
+TEST_F(LibcbioLocalDocumentTest, testStoreMixedDocuments)
+{
+    libcbio_document_t docs[4];
+    docs[0] = generateRandomDocument(0);
+    EXPECT_EQ(CBIO_SUCCESS, cbio_create_empty_document(handle, &docs[1]));
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_document_set_id(docs[1], "_local/mixed", 12, 0));
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_document_set_value(docs[1], "{}", 2, 0));
+    docs[2] = generateRandomDocument(1);
+    docs[3] = generateRandomDocument(2);
+
+    EXPECT_EQ(CBIO_SUCCESS, cbio_store_documents(handle, docs, 4));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_commit(handle));
+    for (int ii = 0; ii < 4; ++ii) {
+        cbio_document_release(docs[ii]);
+    }
+
+    validateExistingDocument("_local/mixed", "{}");
+    int total = 0;
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_changes_since(handle, 0, count_callback,
+                                 static_cast<void *>(&total)));
+    EXPECT_EQ(3, total);
+}
+
+class LibcbioCompressionTest : public LibcbioDataAccessTest
+{
+protected:
+    bool enableCompression(size_t min_size, unsigned int max_ratio) {
+        cbio_error_t err = cbio_set_compression(handle,
+                                                CBIO_COMPRESSION_SNAPPY,
+                                                min_size, max_ratio);
+        if (err == CBIO_ERROR_NOT_SUPPORTED) {
+            return false;
+        }
+        EXPECT_EQ(CBIO_SUCCESS, err);
+        return true;
+    }
+
+    uint8_t getContentType(const string &key) {
+        libcbio_document_t doc;
+        uint8_t content_type = 0xff;
+        EXPECT_EQ(CBIO_SUCCESS,
+                  cbio_get_document(handle, key.data(), key.length(), &doc));
+        EXPECT_EQ(CBIO_SUCCESS,
+                  cbio_document_get_content_type(doc, &content_type));
+        cbio_document_release(doc);
+        return content_type;
+    }
+};
+
+TEST_F(LibcbioCompressionTest, illegalArguments)
+{
+    EXPECT_EQ(CBIO_ERROR_EINVAL,
+              cbio_set_compression(handle, CBIO_COMPRESSION_SNAPPY, 0, 101));
+    EXPECT_EQ(CBIO_ERROR_EINVAL,
+              cbio_set_compression(handle, (cbio_compression_t)0xff, 0, 0));
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_set_compression(handle, CBIO_COMPRESSION_NONE, 0, 0));
+}
+
+TEST_F(LibcbioCompressionTest, compressLargeDocument)
+{
+    if (!enableCompression(1024, 0)) {
+        return;
+    }
+    string key = "key";
+    string value(8192, 'a');
+    storeSingleDocument(key, value);
+    validateExistingDocument(key, value);
+    EXPECT_EQ(CBIO_DOC_IS_COMPRESSED,
+              getContentType(key) & CBIO_DOC_IS_COMPRESSED);
+}
+
+TEST_F(LibcbioCompressionTest, dontCompressSmallDocument)
+{
+    if (!enableCompression(1024, 0)) {
+        return;
+    }
+    string key = "key";
+    string value(100, 'a');
+    storeSingleDocument(key, value);
+    validateExistingDocument(key, value);
+    EXPECT_EQ(0, getContentType(key) & CBIO_DOC_IS_COMPRESSED);
+}
+
+TEST_F(LibcbioCompressionTest, dontCompressIncompressibleDocument)
+{
+    if (!enableCompression(0, 50)) {
+        return;
+    }
+    string key = "key";
+    string value;
+    srandom(0);
+    for (int ii = 0; ii < 4096; ++ii) {
+        value.push_back(static_cast<char>(random()));
+    }
+    storeSingleDocument(key, value);
+    validateExistingDocument(key, value);
+    EXPECT_EQ(0, getContentType(key) & CBIO_DOC_IS_COMPRESSED);
+}
+
+TEST_F(LibcbioCompressionTest, dictionaryRequiresTraining)
+{
+    cbio_error_t err = cbio_set_compression(handle,
+                                            CBIO_COMPRESSION_ZSTD_DICT,
+                                            0, 0);
+    if (err != CBIO_ERROR_NOT_SUPPORTED) {
+        EXPECT_EQ(CBIO_ERROR_ENOENT, err);
+    }
+}
+
+TEST_F(LibcbioCompressionTest, compressWithTrainedDictionary)
+{
+    for (int ii = 0; ii < 2000; ++ii) {
+        stringstream ss;
+        ss << "{\"name\":\"user-" << ii << "\",\"email\":\"user" << ii
+           << "@example.com\",\"age\":" << ii % 90 << ",\"active\":"
+           << (ii % 2 ? "true" : "false")
+           << ",\"address\":{\"street\":\"" << ii * 7 << " Main Street\","
+           << "\"city\":\"Springfield\",\"zip\":\"" << 10000 + ii << "\"}}";
+        storeSingleDocument(generateKey(ii), ss.str());
+    }
+
+    cbio_error_t err = cbio_train_dictionary(handle, 0, 2000, 4096);
+    if (err == CBIO_ERROR_NOT_SUPPORTED) {
+        return;
+    }
+    ASSERT_EQ(CBIO_SUCCESS, err);
+    ASSERT_EQ(CBIO_SUCCESS,
+              cbio_set_compression(handle, CBIO_COMPRESSION_ZSTD_DICT,
+                                   0, 0));
+
+    string key = "compressed";
+    string value = "{\"name\":\"user-4711\",\"email\":\"user4711@example.com\","
+                   "\"age\":31,\"active\":true,\"address\":{\"street\":"
+                   "\"1234 Main Street\",\"city\":\"Springfield\","
+                   "\"zip\":\"14711\"}}";
+    storeSingleDocument(key, value);
+    validateExistingDocument(key, value);
+    EXPECT_EQ(CBIO_DOC_IS_DICT_COMPRESSED,
+              getContentType(key) & CBIO_DOC_IS_DICT_COMPRESSED);
+
+    // The dictionary should be available after reopening the file
+    cbio_close_handle(handle);
+    ASSERT_EQ(CBIO_SUCCESS,
+              cbio_open_handle(dbfile, CBIO_OPEN_RW, &handle));
+    validateExistingDocument(key, value);
+}
+
+extern "C" {
+    static int read_value_callback(libcbio_t handle,
+                                   libcbio_document_t doc,
+                                   void *ctx)
+    {
+        const void *ptr;
+        size_t nbytes;
+        (void)handle;
+        EXPECT_EQ(CBIO_SUCCESS, cbio_document_get_value(doc, &ptr, &nbytes));
+        (*static_cast<int *>(ctx))++;
+        return 0;
+    }
+}
+
+TEST_F(LibcbioCompressionTest, changesReleaseValues)
+{
+    for (int ii = 0; ii < 2000; ++ii) {
+        stringstream ss;
+        ss << "{\"name\":\"user-" << ii << "\",\"age\":" << ii % 90
+           << ",\"city\":\"Springfield\",\"zip\":\"" << 10000 + ii
+           << "\"}";
+        storeSingleDocument(generateKey(ii), ss.str());
+    }
+
+    cbio_error_t err = cbio_train_dictionary(handle, 0, 2000, 4096);
+    if (err == CBIO_ERROR_NOT_SUPPORTED) {
+        return;
+    }
+    ASSERT_EQ(CBIO_SUCCESS, err);
+    ASSERT_EQ(CBIO_SUCCESS,
+              cbio_set_compression(handle, CBIO_COMPRESSION_ZSTD_DICT,
+                                   0, 0));
+    for (int ii = 0; ii < 100; ++ii) {
+        storeSingleDocument(generateKey(ii),
+                            "{\"name\":\"user\",\"city\":\"Springfield\"}");
+    }
+
+    // The decompressed bodies read by the callback are released
+    cbio_memory_stats_t before;
+    cbio_memory_stats_t after;
+    int total = 0;
+    ASSERT_EQ(CBIO_SUCCESS, cbio_get_memory_stats(handle, &before));
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_changes_since(handle, 0, read_value_callback,
+                                 static_cast<void *>(&total)));
+    ASSERT_EQ(CBIO_SUCCESS, cbio_get_memory_stats(handle, &after));
+    EXPECT_EQ(2000, total);
+    EXPECT_EQ(before.allocated, after.allocated);
+    EXPECT_EQ(before.allocations, after.allocations);
+
+    cbio_budget_t budget;
+    ASSERT_EQ(CBIO_SUCCESS, cbio_budget_create(1024 * 1024, &budget));
+    total = 0;
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_changes_since_budget(handle, 0, budget, 0,
+                                        read_value_callback,
+                                        static_cast<void *>(&total)));
+    ASSERT_EQ(CBIO_SUCCESS, cbio_get_memory_stats(handle, &after));
+    EXPECT_EQ(2000, total);
+    EXPECT_EQ(before.allocated, after.allocated);
+    EXPECT_EQ(0U, cbio_budget_get_used(budget));
+    cbio_budget_destroy(budget);
+}
+
+class LibcbioBulkWriterTest : public LibcbioDataAccessTest
+{
+};
+
+TEST_F(LibcbioBulkWriterTest, illegalArguments)
+{
+    cbio_bulk_writer_t writer;
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_bulk_writer_create(NULL, 0, &writer));
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_bulk_writer_create(handle, 0, NULL));
+}
+
+TEST_F(LibcbioBulkWriterTest, storeBatches)
+{
+    (void)cbio_set_compression(handle, CBIO_COMPRESSION_SNAPPY, 0, 0);
+    memset(blob, 'a', blobsize);
+
+    cbio_bulk_writer_t writer;
+    ASSERT_EQ(CBIO_SUCCESS, cbio_bulk_writer_create(handle, 4, &writer));
+
+    const int chunksize = 1000;
+    libcbio_document_t docs[chunksize];
+    for (int total = 0; total < 10000; total += chunksize) {
+        for (int ii = 0; ii < chunksize; ++ii) {
+            docs[ii] = generateRandomDocument(total + ii);
+        }
+        EXPECT_EQ(CBIO_SUCCESS,
+                  cbio_bulk_writer_append(writer, docs, chunksize));
+    }
+    EXPECT_EQ(CBIO_SUCCESS, cbio_bulk_writer_destroy(writer));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_commit(handle));
+
+    for (int ii = 0; ii < 10000; ++ii) {
+        libcbio_document_t doc;
+        string key = generateKey(ii);
+        const void *ptr;
+        size_t nbytes;
+        ASSERT_EQ(CBIO_SUCCESS,
+                  cbio_get_document(handle, key.data(), key.length(), &doc));
+        EXPECT_EQ(CBIO_SUCCESS, cbio_document_get_value(doc, &ptr, &nbytes));
+        EXPECT_EQ(0, memcmp(blob, ptr, nbytes));
+        cbio_document_release(doc);
+    }
+}
+
+class LibcbioBatchTest : public LibcbioDataAccessTest
+{
+protected:
+    cbio_batch_entry_t entry(const string &key, const string &value) {
+        cbio_batch_entry_t ret;
+        memset(&ret, 0, sizeof(ret));
+        ret.id = key.data();
+        ret.nid = key.length();
+        ret.value = value.data();
+        ret.nvalue = value.length();
+        return ret;
+    }
+};
+
+TEST_F(LibcbioBatchTest, illegalArguments)
+{
+    cbio_batch_t batch;
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_batch_create(NULL, &batch));
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_batch_create(handle, NULL));
+
+    ASSERT_EQ(CBIO_SUCCESS, cbio_batch_create(handle, &batch));
+    string local("_local/foo");
+    string empty;
+    string value("bar");
+    cbio_batch_entry_t e = entry(local, value);
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_batch_append(batch, NULL));
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_batch_append(batch, &e));
+    e = entry(empty, value);
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_batch_append(batch, &e));
+    EXPECT_EQ(0U, cbio_batch_count(batch));
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_batch_submit(batch));
+    cbio_batch_destroy(batch);
+}
+
+TEST_F(LibcbioBatchTest, storeAndReuse)
+{
+    cbio_batch_t batch;
+    cbio_memory_stats_t before;
+    cbio_memory_stats_t after;
+    string value;
+
+    ASSERT_EQ(CBIO_SUCCESS, cbio_batch_create(handle, &batch));
+    for (int round = 0; round < 2; ++round) {
+        if (round == 1) {
+            ASSERT_EQ(CBIO_SUCCESS, cbio_get_memory_stats(handle, &before));
+        }
+        // Appended in reverse order, the batch is sorted on submit
+        for (int ii = 999; ii >= 0; --ii) {
+            string key = generateKey(ii);
+            value = key + (round == 0 ? "-first" : "-second");
+            cbio_batch_entry_t e = entry(key, value);
+            e.revno = round + 1;
+            e.deleted = round == 1 && ii % 10 == 0;
+            ASSERT_EQ(CBIO_SUCCESS, cbio_batch_append(batch, &e));
+        }
+        EXPECT_EQ(1000U, cbio_batch_count(batch));
+        ASSERT_EQ(CBIO_SUCCESS, cbio_batch_submit(batch));
+        cbio_batch_reset(batch);
+        EXPECT_EQ(0U, cbio_batch_count(batch));
+    }
+    // The second batch is built in the memory of the first
+    ASSERT_EQ(CBIO_SUCCESS, cbio_get_memory_stats(handle, &after));
+    EXPECT_EQ(before.total_allocations, after.total_allocations);
+    cbio_batch_destroy(batch);
+    EXPECT_EQ(CBIO_SUCCESS, cbio_commit(handle));
+
+    for (int ii = 0; ii < 1000; ++ii) {
+        libcbio_document_t doc;
+        string key = generateKey(ii);
+        const void *ptr;
+        size_t nbytes;
+        uint64_t revno;
+
+        if (ii % 10 == 0) {
+            EXPECT_EQ(CBIO_ERROR_ENOENT,
+                      cbio_get_document(handle, key.data(), key.length(),
+                                        &doc));
+            continue;
+        }
+        ASSERT_EQ(CBIO_SUCCESS,
+                  cbio_get_document(handle, key.data(), key.length(), &doc));
+        EXPECT_EQ(CBIO_SUCCESS, cbio_document_get_value(doc, &ptr, &nbytes));
+        value = key + "-second";
+        EXPECT_EQ(value, string(static_cast<const char *>(ptr), nbytes));
+        EXPECT_EQ(CBIO_SUCCESS, cbio_document_get_revision(doc, &revno));
+        EXPECT_EQ(2U, revno);
+        cbio_document_release(doc);
+    }
+}
+
+class LibcbioDedupTest : public LibcbioBatchTest
+{
+protected:
+    libcbio_document_t createDocument(const string &key,
+                                      const string &value,
+                                      uint64_t revno) {
+        libcbio_document_t doc;
+        EXPECT_EQ(CBIO_SUCCESS, cbio_create_empty_document(handle, &doc));
+        EXPECT_EQ(CBIO_SUCCESS, cbio_document_set_id(doc, key.data(),
+                                                     key.length(), 1));
+        EXPECT_EQ(CBIO_SUCCESS, cbio_document_set_value(doc, value.data(),
+                                                        value.length(), 1));
+        EXPECT_EQ(CBIO_SUCCESS, cbio_document_set_revision(doc, revno));
+        return doc;
+    }
+
+    string getValue(const string &key) {
+        libcbio_document_t doc;
+        const void *ptr;
+        size_t nbytes;
+        string ret;
+
+        EXPECT_EQ(CBIO_SUCCESS, cbio_get_document(handle, key.data(),
+                                                  key.length(), &doc));
+        EXPECT_EQ(CBIO_SUCCESS, cbio_document_get_value(doc, &ptr, &nbytes));
+        ret.assign(static_cast<const char *>(ptr), nbytes);
+        cbio_document_release(doc);
+        return ret;
+    }
+
+    int countChanges() {
+        int total = 0;
+        EXPECT_EQ(CBIO_SUCCESS,
+                  cbio_changes_since(handle, 0, count_callback,
+                                     static_cast<void *>(&total)));
+        return total;
+    }
+};
+
+TEST_F(LibcbioDedupTest, illegalArguments)
+{
+    EXPECT_EQ(CBIO_ERROR_EINVAL,
+              cbio_set_deduplication(NULL, CBIO_DEDUP_LAST));
+    EXPECT_EQ(CBIO_ERROR_EINVAL,
+              cbio_set_deduplication(handle, (cbio_dedup_t)42));
+}
+
+TEST_F(LibcbioDedupTest, storeDocumentsKeepsLast)
+{
+    ASSERT_EQ(CBIO_SUCCESS, cbio_set_deduplication(handle, CBIO_DEDUP_LAST));
+
+    libcbio_document_t docs[5];
+    docs[0] = createDocument("a", "1", 3);
+    docs[1] = createDocument("b", "1", 1);
+    docs[2] = createDocument("a", "2", 2);
+    docs[3] = createDocument("c", "1", 1);
+    docs[4] = createDocument("a", "3", 1);
+    EXPECT_EQ(CBIO_SUCCESS, cbio_store_documents(handle, docs, 5));
+    for (int ii = 0; ii < 5; ++ii) {
+        cbio_document_release(docs[ii]);
+    }
+    EXPECT_EQ(CBIO_SUCCESS, cbio_commit(handle));
+
+    EXPECT_EQ(3, countChanges());
+    EXPECT_EQ("3", getValue("a"));
+}
+
+TEST_F(LibcbioDedupTest, storeDocumentsKeepsHighestRevision)
+{
+    ASSERT_EQ(CBIO_SUCCESS,
+              cbio_set_deduplication(handle, CBIO_DEDUP_REVISION));
+
+    libcbio_document_t docs[4];
+    docs[0] = createDocument("a", "1", 3);
+    docs[1] = createDocument("a", "2", 5);
+    docs[2] = createDocument("a", "3", 5);
+    docs[3] = createDocument("a", "4", 4);
+    EXPECT_EQ(CBIO_SUCCESS, cbio_store_documents(handle, docs, 4));
+    for (int ii = 0; ii < 4; ++ii) {
+        cbio_document_release(docs[ii]);
+    }
+    EXPECT_EQ(CBIO_SUCCESS, cbio_commit(handle));
+
+    EXPECT_EQ(1, countChanges());
+    EXPECT_EQ("3", getValue("a"));
+}
+
+TEST_F(LibcbioDedupTest, batch)
+{
+    ASSERT_EQ(CBIO_SUCCESS,
+              cbio_set_deduplication(handle, CBIO_DEDUP_REVISION));
+
+    cbio_batch_t batch;
+    ASSERT_EQ(CBIO_SUCCESS, cbio_batch_create(handle, &batch));
+    const string values[] = { "1", "2", "3", "4" };
+    const uint64_t revisions[] = { 3, 5, 5, 4 };
+    string key("counter");
+    string other("other");
+    for (int ii = 0; ii < 4; ++ii) {
+        cbio_batch_entry_t e = entry(key, values[ii]);
+        e.revno = revisions[ii];
+        ASSERT_EQ(CBIO_SUCCESS, cbio_batch_append(batch, &e));
+        e = entry(other, values[ii]);
+        ASSERT_EQ(CBIO_SUCCESS, cbio_batch_append(batch, &e));
+    }
+    EXPECT_EQ(CBIO_SUCCESS, cbio_batch_submit(batch));
+    cbio_batch_destroy(batch);
+    EXPECT_EQ(CBIO_SUCCESS, cbio_commit(handle));
+
+    EXPECT_EQ(2, countChanges());
+    EXPECT_EQ("3", getValue(key));
+    EXPECT_EQ("4", getValue(other));
+}
+
+TEST_F(LibcbioDedupTest, asyncStoresAreSeparate)
+{
+    ASSERT_EQ(CBIO_SUCCESS,
+              cbio_set_deduplication(handle, CBIO_DEDUP_REVISION));
+
+    cbio_async_t async;
+    ASSERT_EQ(CBIO_SUCCESS, cbio_async_create(handle, 1, &async));
+
+    // The revisions go down, so deduplicating stores queued behind
+    // each other would keep an earlier value
+    const size_t nops = 50;
+    libcbio_document_t docs[nops];
+    for (size_t ii = 0; ii < nops; ++ii) {
+        stringstream ss;
+        ss << ii;
+        docs[ii] = createDocument("a", ss.str(), nops - ii);
+        EXPECT_EQ(CBIO_SUCCESS, cbio_async_store(async, docs + ii, 1, NULL));
+    }
+    EXPECT_EQ(CBIO_SUCCESS, cbio_async_commit(async, NULL));
+
+    cbio_completion_t completions[nops + 1];
+    size_t total = 0;
+    while (total < nops + 1) {
+        struct pollfd pfd;
+        pfd.fd = cbio_async_get_fd(async);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        ASSERT_EQ(1, poll(&pfd, 1, 5000));
+        total += cbio_async_reap(async, completions + total,
+                                 nops + 1 - total);
+    }
+    for (size_t ii = 0; ii <= nops; ++ii) {
+        EXPECT_EQ(CBIO_SUCCESS, completions[ii].status);
+    }
+    for (size_t ii = 0; ii < nops; ++ii) {
+        cbio_document_release(docs[ii]);
+    }
+    cbio_async_destroy(async);
+
+    stringstream last;
+    last << nops - 1;
+    EXPECT_EQ(last.str(), getValue("a"));
+}
+
+class LibcbioJsonValidationTest : public LibcbioCompressionTest
+{
+protected:
+    uint8_t classify(const string &value) {
+        string key = "key";
+        storeSingleDocument(key, value);
+        return getContentType(key);
+    }
+};
+
+TEST_F(LibcbioJsonValidationTest, disabledByDefault)
+{
+    EXPECT_EQ(CBIO_DOC_IS_JSON, classify("this is not json"));
+}
+
+TEST_F(LibcbioJsonValidationTest, validJson)
+{
+    ASSERT_EQ(CBIO_SUCCESS, cbio_set_json_validation(handle, 1));
+    EXPECT_EQ(CBIO_DOC_IS_JSON, classify("{}"));
+    EXPECT_EQ(CBIO_DOC_IS_JSON, classify(" [ ] "));
+    EXPECT_EQ(CBIO_DOC_IS_JSON, classify("-12.5e+3"));
+    EXPECT_EQ(CBIO_DOC_IS_JSON, classify("\"caf\xc3\xa9\""));
+    EXPECT_EQ(CBIO_DOC_IS_JSON,
+              classify("{\"a\":[1,true,false,null,{\"b\":\"\\u00e9\\n\"}],"
+                       "\"nested\":{\"_ok\":0}}"));
+    // Long strings are scanned by the vectorized code
+    EXPECT_EQ(CBIO_DOC_IS_JSON,
+              classify("{\"a\":\"" + string(1000, 'x') + "\\\"" +
+                       string(77, 'y') + "\"}"));
+}
+
+TEST_F(LibcbioJsonValidationTest, invalidJson)
+{
+    ASSERT_EQ(CBIO_SUCCESS, cbio_set_json_validation(handle, 1));
+    EXPECT_EQ(CBIO_DOC_INVALID_JSON, classify("this is not json"));
+    EXPECT_EQ(CBIO_DOC_INVALID_JSON, classify("{\"a\":1,}"));
+    EXPECT_EQ(CBIO_DOC_INVALID_JSON, classify("[1 2]"));
+    EXPECT_EQ(CBIO_DOC_INVALID_JSON, classify("01"));
+    EXPECT_EQ(CBIO_DOC_INVALID_JSON, classify("{\"a\":1} x"));
+    EXPECT_EQ(CBIO_DOC_INVALID_JSON, classify("\"\xc0\xaf\""));
+    EXPECT_EQ(CBIO_DOC_INVALID_JSON, classify("\"tab\there\""));
+    EXPECT_EQ(CBIO_DOC_INVALID_JSON,
+              classify("{\"a\":\"" + string(100, 'x') + "\x01\"}"));
+    EXPECT_EQ(CBIO_DOC_INVALID_JSON, classify(string(2000, '[')));
+}
+
+TEST_F(LibcbioJsonValidationTest, reservedKeys)
+{
+    ASSERT_EQ(CBIO_SUCCESS, cbio_set_json_validation(handle, 1));
+    EXPECT_EQ(CBIO_DOC_INVALID_JSON_KEY, classify("{\"_id\":\"foo\"}"));
+    EXPECT_EQ(CBIO_DOC_INVALID_JSON_KEY, classify("{\"a\":1, \"_rev\":2}"));
+}
+
+class LibcbioSharedHandleTest : public LibcbioDataAccessTest
+{
+public:
+    virtual void SetUp(void) {
+        removeDb();
+        ASSERT_EQ(CBIO_SUCCESS,
+                  cbio_open_shared_handle(dbfile, CBIO_OPEN_CREATE, 2,
+                                          &handle));
+    }
+
+protected:
+    static const int ndocs = 500;
+
+    static void *reader_main(void *arg) {
+        LibcbioSharedHandleTest *test;
+        test = static_cast<LibcbioSharedHandleTest *>(arg);
+        long failed = 0;
+        for (int ii = 0; ii < ndocs; ++ii) {
+            string key = test->generateKey(ii);
+            libcbio_document_t doc;
+            const void *ptr;
+            size_t nbytes;
+            if (cbio_get_document(test->handle, key.data(), key.length(),
+                                  &doc) != CBIO_SUCCESS) {
+                ++failed;
+                continue;
+            }
+            if (cbio_document_get_value(doc, &ptr, &nbytes) != CBIO_SUCCESS ||
+                nbytes != key.length() || memcmp(ptr, key.data(), nbytes)) {
+                ++failed;
+            }
+            cbio_document_release(doc);
+        }
+        return reinterpret_cast<void *>(failed);
+    }
+};
+
+TEST_F(LibcbioSharedHandleTest, readersSeeLastCommit)
+{
+    libcbio_document_t doc;
+    string key = "hello";
+    string value = "world";
+
+    EXPECT_EQ(CBIO_SUCCESS, cbio_create_empty_document(handle, &doc));
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_document_set_id(doc, key.data(), key.length(), 0));
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_document_set_value(doc, value.data(), value.length(), 0));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_store_document(handle, doc));
+    cbio_document_release(doc);
+
+    validateNonExistingDocument(key);
+    EXPECT_EQ(CBIO_SUCCESS, cbio_commit(handle));
+    validateExistingDocument(key, value);
+}
+
+TEST_F(LibcbioSharedHandleTest, concurrentReaders)
+{
+    libcbio_document_t docs[ndocs];
+    for (int ii = 0; ii < ndocs; ++ii) {
+        string key = generateKey(ii);
+        EXPECT_EQ(CBIO_SUCCESS, cbio_create_empty_document(handle, &docs[ii]));
+        EXPECT_EQ(CBIO_SUCCESS,
+                  cbio_document_set_id(docs[ii], key.data(), key.length(), 1));
+        EXPECT_EQ(CBIO_SUCCESS,
+                  cbio_document_set_value(docs[ii], key.data(),
+                                          key.length(), 1));
+    }
+    EXPECT_EQ(CBIO_SUCCESS, cbio_store_documents(handle, docs, ndocs));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_commit(handle));
+    for (int ii = 0; ii < ndocs; ++ii) {
+        cbio_document_release(docs[ii]);
+    }
+
+    // Use more threads than reader slots
+    pthread_t threads[8];
+    for (int ii = 0; ii < 8; ++ii) {
+        ASSERT_EQ(0, pthread_create(threads + ii, NULL, reader_main, this));
+    }
+    for (int ii = 0; ii < 8; ++ii) {
+        void *failed;
+        EXPECT_EQ(0, pthread_join(threads[ii], &failed));
+        EXPECT_EQ(NULL, failed);
+    }
+}
+
+class LibcbioSnapshotTest : public LibcbioDataAccessTest
+{
+protected:
+    static int count_callback(libcbio_t handle,
+                              libcbio_document_t doc,
+                              void *ctx)
+    {
+        (void)handle;
+        (void)doc;
+        int *count = static_cast<int *>(ctx);
+        (*count)++;
+        return 0;
+    }
+};
+
+TEST_F(LibcbioSnapshotTest, illegalArguments)
+{
+    libcbio_t snapshot;
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_snapshot_open(NULL, &snapshot));
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_snapshot_open(handle, NULL));
+}
+
+TEST_F(LibcbioSnapshotTest, pinnedToHeader)
+{
+    storeSingleDocument("hello", "world");
+
+    libcbio_t snapshot;
+    ASSERT_EQ(CBIO_SUCCESS, cbio_snapshot_open(handle, &snapshot));
+    EXPECT_EQ(cbio_get_header_position(handle),
+              cbio_get_header_position(snapshot));
+
+    storeSingleDocument("hello", "there");
+    storeSingleDocument("foo", "bar");
+    validateExistingDocument("hello", "there");
+
+    libcbio_document_t doc;
+    const void *ptr;
+    size_t nbytes;
+    EXPECT_EQ(CBIO_SUCCESS, cbio_get_document(snapshot, "hello", 5, &doc));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_document_get_value(doc, &ptr, &nbytes));
+    EXPECT_EQ(5, nbytes);
+    EXPECT_EQ(0, memcmp("world", ptr, nbytes));
+    cbio_document_release(doc);
+    EXPECT_EQ(CBIO_ERROR_ENOENT, cbio_get_document(snapshot, "foo", 3, &doc));
+
+    int total = 0;
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_changes_since(snapshot, 0, count_callback,
+                                 static_cast<void *>(&total)));
+    EXPECT_EQ(1, total);
+    cbio_snapshot_close(snapshot);
+}
+
+class LibcbioHistoryTest : public LibcbioSnapshotTest
+{
+protected:
+    static int collect_headers(libcbio_t handle,
+                               const cbio_header_info_t *info,
+                               void *ctx)
+    {
+        (void)handle;
+        vector<cbio_header_info_t> *headers;
+        headers = static_cast<vector<cbio_header_info_t> *>(ctx);
+        headers->push_back(*info);
+        return 0;
+    }
+};
+
+TEST_F(LibcbioHistoryTest, enumerateHeaders)
+{
+    storeSingleDocument("a", "1");
+    storeSingleDocument("b", "2");
+    storeSingleDocument("c", "3");
+
+    vector<cbio_header_info_t> headers;
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_foreach_header(handle, collect_headers, &headers));
+    ASSERT_LE(3, headers.size());
+    EXPECT_EQ(cbio_get_header_position(handle), headers[0].position);
+    EXPECT_EQ(3, headers[0].last_sequence);
+    EXPECT_EQ(3, headers[0].doc_count);
+    EXPECT_EQ(2, headers[1].last_sequence);
+    EXPECT_EQ(1, headers[2].last_sequence);
+    EXPECT_GT(headers[0].position, headers[1].position);
+
+    libcbio_t old;
+    ASSERT_EQ(CBIO_SUCCESS,
+              cbio_open_handle_at(dbfile, headers[1].position, &old));
+    libcbio_document_t doc;
+    EXPECT_EQ(CBIO_SUCCESS, cbio_get_document(old, "b", 1, &doc));
+    cbio_document_release(doc);
+    EXPECT_EQ(CBIO_ERROR_ENOENT, cbio_get_document(old, "c", 1, &doc));
+    cbio_close_handle(old);
+
+    EXPECT_EQ(CBIO_ERROR_NO_HEADER,
+              cbio_open_handle_at(dbfile, headers[1].position + 1, &old));
+
+    ASSERT_EQ(CBIO_SUCCESS, cbio_open_handle_at_sequence(dbfile, 1, &old));
+    EXPECT_EQ(headers[2].position, cbio_get_header_position(old));
+    cbio_close_handle(old);
+}
+
+TEST_F(LibcbioHistoryTest, sequenceBeforeFirstHeader)
+{
+    storeSingleDocument("a", "1");
+    storeSingleDocument("b", "2");
+
+    vector<cbio_header_info_t> headers;
+    ASSERT_EQ(CBIO_SUCCESS,
+              cbio_foreach_header(handle, collect_headers, &headers));
+    ASSERT_LT(0U, headers.size());
+    uint64_t oldest = headers.back().last_sequence;
+    if (oldest == 0) {
+        // The file starts with an empty header
+        return;
+    }
+
+    libcbio_t old;
+    EXPECT_EQ(CBIO_ERROR_NO_HEADER,
+              cbio_open_handle_at_sequence(dbfile, oldest - 1, &old));
+    EXPECT_EQ(CBIO_ERROR_NO_HEADER, cbio_rollback(handle, oldest - 1));
+    EXPECT_EQ(CBIO_ERROR_NO_HEADER,
+              cbio_open_handle_at(dbfile, headers.back().position - 1,
+                                  &old));
+
+    // The handle is left untouched
+    validateExistingDocument("a", "1");
+    validateExistingDocument("b", "2");
+}
+
+TEST_F(LibcbioHistoryTest, rollback)
+{
+    storeSingleDocument("a", "1");
+    storeSingleDocument("b", "2");
+    storeSingleDocument("a", "3");
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_rollback(NULL, 1));
+
+    EXPECT_EQ(CBIO_SUCCESS, cbio_rollback(handle, 2));
+    validateExistingDocument("a", "1");
+    validateExistingDocument("b", "2");
+
+    storeSingleDocument("c", "4");
+    EXPECT_EQ(CBIO_SUCCESS, cbio_rollback(handle, 1));
+    validateExistingDocument("a", "1");
+    validateNonExistingDocument("b");
+    validateNonExistingDocument("c");
+
+    // The rollback should survive reopening the file
+    cbio_close_handle(handle);
+    ASSERT_EQ(CBIO_SUCCESS, cbio_open_handle(dbfile, CBIO_OPEN_RW, &handle));
+    validateExistingDocument("a", "1");
+    validateNonExistingDocument("b");
+}
+
+TEST_F(LibcbioHistoryTest, rollbackDiscardsUncommitted)
+{
+    storeSingleDocument("a", "1");
+    storeSingleDocument("b", "2");
+
+    // Store without committing, then roll back over it
+    libcbio_document_t doc;
+    ASSERT_EQ(CBIO_SUCCESS, cbio_create_empty_document(handle, &doc));
+    ASSERT_EQ(CBIO_SUCCESS, cbio_document_set_id(doc, "c", 1, 0));
+    ASSERT_EQ(CBIO_SUCCESS, cbio_document_set_value(doc, "3", 1, 0));
+    ASSERT_EQ(CBIO_SUCCESS, cbio_store_document(handle, doc));
+    cbio_document_release(doc);
+
+    EXPECT_EQ(CBIO_SUCCESS, cbio_rollback(handle, 1));
+    validateExistingDocument("a", "1");
+    validateNonExistingDocument("b");
+    validateNonExistingDocument("c");
+
+    // The file is still good for writes after the rollback
+    storeSingleDocument("d", "4");
+    cbio_close_handle(handle);
+    ASSERT_EQ(CBIO_SUCCESS, cbio_open_handle(dbfile, CBIO_OPEN_RW, &handle));
+    validateExistingDocument("a", "1");
+    validateExistingDocument("d", "4");
+    validateNonExistingDocument("b");
+    validateNonExistingDocument("c");
+}
+
+class LibcbioTailTest : public LibcbioSnapshotTest
+{
+public:
+    virtual void SetUp(void) {
+        LibcbioSnapshotTest::SetUp();
+        ASSERT_EQ(CBIO_SUCCESS,
+                  cbio_open_handle(dbfile, CBIO_OPEN_RDONLY, &reader));
+    }
+
+    virtual void TearDown(void) {
+        cbio_close_handle(reader);
+        LibcbioSnapshotTest::TearDown();
+    }
+
+protected:
+    static void *writer_main(void *arg) {
+        LibcbioTailTest *test = static_cast<LibcbioTailTest *>(arg);
+        usleep(50000);
+        test->storeSingleDocument("late", "arrival");
+        return NULL;
+    }
+
+    libcbio_t reader;
+};
+
+TEST_F(LibcbioTailTest, refresh)
+{
+    libcbio_document_t doc;
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_refresh(handle));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_refresh(reader));
+
+    storeSingleDocument("hello", "world");
+    EXPECT_EQ(CBIO_ERROR_ENOENT, cbio_get_document(reader, "hello", 5, &doc));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_wait_for_commit(reader, 0));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_refresh(reader));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_get_document(reader, "hello", 5, &doc));
+    cbio_document_release(doc);
+    EXPECT_EQ(cbio_get_header_position(handle),
+              cbio_get_header_position(reader));
+    EXPECT_EQ(CBIO_ERROR_TIMEOUT, cbio_wait_for_commit(reader, 10));
+}
+
+TEST_F(LibcbioTailTest, tailChanges)
+{
+    storeSingleDocument("a", "1");
+    storeSingleDocument("b", "2");
+    ASSERT_EQ(CBIO_SUCCESS, cbio_refresh(reader));
+
+    int total = 0;
+    uint64_t since = 2;
+    EXPECT_EQ(CBIO_ERROR_TIMEOUT,
+              cbio_tail_changes(reader, &since, 10, count_callback, &total));
+    EXPECT_EQ(1, total);
+    EXPECT_EQ(3, since);
+
+    pthread_t writer;
+    ASSERT_EQ(0, pthread_create(&writer, NULL, writer_main, this));
+    EXPECT_EQ(CBIO_ERROR_TIMEOUT,
+              cbio_tail_changes(reader, &since, 500, count_callback, &total));
+    EXPECT_EQ(0, pthread_join(writer, NULL));
+    EXPECT_EQ(2, total);
+    EXPECT_EQ(4, since);
+}
+
+class LibcbioAsyncTest : public LibcbioDataAccessTest
+{
+protected:
+    void reapAll(cbio_async_t async, cbio_completion_t *completions,
+                 size_t ncompletions) {
+        size_t total = 0;
+        while (total < ncompletions) {
+            struct pollfd pfd;
+            pfd.fd = cbio_async_get_fd(async);
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            ASSERT_EQ(1, poll(&pfd, 1, 5000));
+            total += cbio_async_reap(async, completions + total,
+                                     ncompletions - total);
+        }
+    }
+
+    void storeCommitAndGet(unsigned int nthreads) {
+        cbio_async_t async;
+        ASSERT_EQ(CBIO_SUCCESS, cbio_async_create(handle, nthreads, &async));
+
+        const int ndocs = 10;
+        libcbio_document_t docs[ndocs];
+        for (int ii = 0; ii < ndocs; ++ii) {
+            docs[ii] = generateRandomDocument(ii);
+            EXPECT_EQ(CBIO_SUCCESS,
+                      cbio_async_store(async, docs + ii, 1, docs + ii));
+        }
+        EXPECT_EQ(CBIO_SUCCESS, cbio_async_commit(async, this));
+
+        cbio_completion_t completions[ndocs + 1];
+        reapAll(async, completions, ndocs + 1);
+        for (int ii = 0; ii < ndocs; ++ii) {
+            EXPECT_EQ(CBIO_ASYNC_STORE, completions[ii].op);
+            EXPECT_EQ(docs + ii, completions[ii].cookie);
+            EXPECT_EQ(CBIO_SUCCESS, completions[ii].status);
+            cbio_document_release(docs[ii]);
+        }
+        EXPECT_EQ(CBIO_ASYNC_COMMIT, completions[ndocs].op);
+        EXPECT_EQ(this, completions[ndocs].cookie);
+        EXPECT_EQ(CBIO_SUCCESS, completions[ndocs].status);
+        EXPECT_EQ(0, cbio_async_reap(async, completions, ndocs + 1));
+
+        string key = generateKey(1);
+        EXPECT_EQ(CBIO_SUCCESS,
+                  cbio_async_get(async, key.data(), key.length(), &key));
+        EXPECT_EQ(CBIO_SUCCESS, cbio_async_get(async, "missing", 7, NULL));
+        reapAll(async, completions, 2);
+        for (int ii = 0; ii < 2; ++ii) {
+            EXPECT_EQ(CBIO_ASYNC_GET, completions[ii].op);
+            if (completions[ii].cookie == &key) {
+                EXPECT_EQ(CBIO_SUCCESS, completions[ii].status);
+                const void *ptr;
+                size_t nbytes;
+                EXPECT_EQ(CBIO_SUCCESS,
+                          cbio_document_get_id(completions[ii].doc,
+                                               &ptr, &nbytes));
+                EXPECT_EQ(key.length(), nbytes);
+                EXPECT_EQ(0, memcmp(key.data(), ptr, nbytes));
+                cbio_document_release(completions[ii].doc);
+            } else {
+                EXPECT_EQ(NULL, completions[ii].cookie);
+                EXPECT_EQ(CBIO_ERROR_ENOENT, completions[ii].status);
+            }
+        }
+
+        cbio_async_destroy(async);
+    }
+};
+
+TEST_F(LibcbioAsyncTest, illegalArguments)
+{
+    cbio_async_t async;
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_async_create(NULL, 1, &async));
+    ASSERT_EQ(CBIO_SUCCESS, cbio_async_create(handle, 1, &async));
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_async_get(async, NULL, 0, NULL));
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_async_store(async, NULL, 0, NULL));
+    cbio_async_destroy(async);
+}
+
+TEST_F(LibcbioAsyncTest, storeCommitAndGet)
+{
+    storeCommitAndGet(2);
+}
+
+TEST_F(LibcbioAsyncTest, sharedHandle)
+{
+    cbio_close_handle(handle);
+    ASSERT_EQ(CBIO_SUCCESS,
+              cbio_open_shared_handle(dbfile, CBIO_OPEN_RW, 2, &handle));
+    storeCommitAndGet(4);
+}
+
+TEST_F(LibcbioAsyncTest, destroyReleasesUnreaped)
+{
+    storeSingleDocument("hello", "world");
+    cbio_async_t async;
+    ASSERT_EQ(CBIO_SUCCESS, cbio_async_create(handle, 1, &async));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_async_get(async, "hello", 5, NULL));
+    cbio_async_destroy(async);
+}
@@ -0,0 +1,165 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <libcbio/cbio.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+using namespace std;
+
+static const char dbdir[] = "testcase.set";
+static const uint16_t nvbuckets = 16;
+
+class LibcbioSetTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp(void) {
+        removeSet();
+        ASSERT_EQ(CBIO_SUCCESS,
+                  cbio_set_open(dbdir, nvbuckets, CBIO_OPEN_CREATE, &set));
+    }
+
+    virtual void TearDown(void) {
+        cbio_set_close(set);
+        removeSet();
+    }
+
+    void removeSet(void) {
+        for (uint16_t ii = 0; ii < nvbuckets; ++ii) {
+            stringstream ss;
+            ss << dbdir << "/" << ii << ".couch";
+            EXPECT_EQ(0, (remove(ss.str().c_str()) == -1 && errno != ENOENT));
+        }
+        EXPECT_EQ(0, (rmdir(dbdir) == -1 && errno != ENOENT));
+    }
+
+    libcbio_document_t createDocument(const string &key, const string &value) {
+        libcbio_document_t doc;
+        EXPECT_EQ(CBIO_SUCCESS,
+                  cbio_create_empty_document(cbio_set_get_handle(set, 0),
+                                             &doc));
+        EXPECT_EQ(CBIO_SUCCESS,
+                  cbio_document_set_id(doc, key.data(), key.length(), 1));
+        EXPECT_EQ(CBIO_SUCCESS,
+                  cbio_document_set_value(doc, value.data(),
+                                          value.length(), 1));
+        return doc;
+    }
+
+    string generateKey(int id) {
+        stringstream ss;
+        ss << "mykey-" << id;
+        return ss.str();
+    }
+
+    static int count_callback(libcbio_t handle,
+                              libcbio_document_t doc,
+                              void *ctx)
+    {
+        (void)handle;
+        (void)doc;
+        int *count = static_cast<int *>(ctx);
+        (*count)++;
+        return 0;
+    }
+
+    cbio_set_t set;
+};
+
+TEST_F(LibcbioSetTest, illegalArguments)
+{
+    cbio_set_t other;
+    EXPECT_EQ(CBIO_ERROR_EINVAL,
+              cbio_set_open(NULL, nvbuckets, CBIO_OPEN_CREATE, &other));
+    EXPECT_EQ(CBIO_ERROR_EINVAL,
+              cbio_set_open(dbdir, 0, CBIO_OPEN_CREATE, &other));
+    EXPECT_EQ(CBIO_ERROR_EINVAL,
+              cbio_set_open(dbdir, 0x8001, CBIO_OPEN_CREATE, &other));
+    EXPECT_EQ(NULL, cbio_set_get_handle(set, nvbuckets));
+}
+
+TEST_F(LibcbioSetTest, vbucketMapping)
+{
+    cbio_set_t other;
+    ASSERT_EQ(CBIO_SUCCESS,
+              cbio_set_open(dbdir, 1024, CBIO_OPEN_CREATE, &other));
+    EXPECT_EQ(115, cbio_set_get_vbucket(other, "foo", 3));
+    EXPECT_EQ(528, cbio_set_get_vbucket(other, "hello", 5));
+    cbio_set_close(other);
+
+    for (int ii = 16; ii < 1024; ++ii) {
+        stringstream ss;
+        ss << dbdir << "/" << ii << ".couch";
+        EXPECT_EQ(0, remove(ss.str().c_str()));
+    }
+}
+
+TEST_F(LibcbioSetTest, storeAndGet)
+{
+    const int ndocs = 1000;
+    libcbio_document_t *docs = new libcbio_document_t[ndocs];
+    for (int ii = 0; ii < ndocs; ++ii) {
+        docs[ii] = createDocument(generateKey(ii), generateKey(ii));
+    }
+
+    EXPECT_EQ(CBIO_SUCCESS, cbio_set_store_documents(set, docs, ndocs));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_set_commit(set));
+    for (int ii = 0; ii < ndocs; ++ii) {
+        cbio_document_release(docs[ii]);
+    }
+    delete []docs;
+
+    for (int ii = 0; ii < ndocs; ++ii) {
+        string key = generateKey(ii);
+        libcbio_document_t doc;
+        const void *ptr;
+        size_t nbytes;
+
+        ASSERT_EQ(CBIO_SUCCESS,
+                  cbio_set_get_document(set, key.data(), key.length(), &doc));
+        EXPECT_EQ(CBIO_SUCCESS, cbio_document_get_value(doc, &ptr, &nbytes));
+        EXPECT_EQ(key.length(), nbytes);
+        EXPECT_EQ(0, memcmp(key.data(), ptr, nbytes));
+        cbio_document_release(doc);
+    }
+
+    int total = 0;
+    EXPECT_EQ(CBIO_SUCCESS,
+              cbio_set_changes_since(set, 0, count_callback,
+                                     static_cast<void *>(&total)));
+    EXPECT_EQ(ndocs, total);
+}
+
+TEST_F(LibcbioSetTest, reopenReadOnly)
+{
+    libcbio_document_t doc = createDocument("hello", "world");
+    EXPECT_EQ(CBIO_SUCCESS, cbio_set_store_documents(set, &doc, 1));
+    cbio_document_release(doc);
+    cbio_set_close(set);
+
+    ASSERT_EQ(CBIO_SUCCESS,
+              cbio_set_open(dbdir, nvbuckets, CBIO_OPEN_RDONLY, &set));
+    EXPECT_EQ(CBIO_SUCCESS, cbio_set_get_document(set, "hello", 5, &doc));
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_set_store_documents(set, &doc, 1));
+    EXPECT_EQ(CBIO_ERROR_EINVAL, cbio_set_commit(set));
+    cbio_document_release(doc);
+}
@@ -43,13 +43,15 @@ TEST_F(LibcbioStrerrorTest, testKnownErrorCodes) {
     EXPECT_STREQ("illegal header version",
                  cbio_strerror(CBIO_ERROR_HEADER_VERSION));
     EXPECT_STREQ("checksum fail", cbio_strerror(CBIO_ERROR_CHECKSUM_FAIL));
+    EXPECT_STREQ("not supported", cbio_strerror(CBIO_ERROR_NOT_SUPPORTED));
+    EXPECT_STREQ("timeout", cbio_strerror(CBIO_ERROR_TIMEOUT));
 }
 
 TEST_F(LibcbioStrerrorTest, testUnknownErrorCodes) {
 
     for (int ii = -200; ii < 200; ++ii) {
         if (ii < static_cast<int>(CBIO_SUCCESS) &&
-            ii > static_cast<int>(CBIO_ERROR_CHECKSUM_FAIL)) {
+            ii > static_cast<int>(CBIO_ERROR_TIMEOUT)) {
             EXPECT_STREQ("Internal error",
                          cbio_strerror(static_cast<cbio_error_t>(ii)));
         }
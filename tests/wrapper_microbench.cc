@@ -0,0 +1,426 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Measure what libcbio costs on top of couchstore. Every workload is
+ * run twice, once through couchstore and once through libcbio (the
+ * benchmarks are named <workload>/couchstore and <workload>/libcbio),
+ * and the overhead of the libcbio run is compared to the thresholds
+ * below. The program fails if an overhead exceeds its threshold.
+ */
+#include <libcbio/cbio.h>
+#include <libcouchstore/couch_db.h>
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "alloc_counter.h"
+
+using namespace std;
+
+static const char readfile[] = "wrapper_bench.read.couch";
+static const char couchfile[] = "wrapper_bench.couchstore.couch";
+static const char cbiofile[] = "wrapper_bench.libcbio.couch";
+static const int nrecords = 10000;
+static const size_t valuesize = 256;
+
+/*
+ * The maximum overhead of libcbio compared to couchstore. The extra
+ * allocations are per document, and the time is the ratio of the
+ * cpu time per operation. A single document store pays for the
+ * arrays handed to couchstore on top of the document itself.
+ */
+struct Threshold {
+    const char *workload;
+    double allocations;
+    double cpu_ratio;
+};
+
+static const Threshold thresholds[] = {
+    { "GetInfo", 1, 1.5 },
+    { "Get", 1, 1.5 },
+    { "Store/1", 6, 2.0 },
+    { "Store/100", 3.5, 2.0 },
+    { "ChangesSince", 1, 1.5 }
+};
+
+static vector<string> keys;
+static string value(valuesize, 'x');
+static Db *couch_reader;
+static libcbio_t cbio_reader;
+
+static void check(cbio_error_t err, const char *what)
+{
+    if (err != CBIO_SUCCESS) {
+        fprintf(stderr, "%s: %s\n", what, cbio_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void check(couchstore_error_t err, const char *what)
+{
+    if (err != COUCHSTORE_SUCCESS) {
+        fprintf(stderr, "%s: couchstore error %d\n", what, (int)err);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Report the allocations made since `start` per document, where every
+ * iteration handled `ndocs` documents
+ */
+static void reportAllocations(benchmark::State &state,
+                              const AllocCounter::Snapshot &start,
+                              size_t ndocs = 1)
+{
+    if (AllocCounter::available()) {
+        AllocCounter::Snapshot end = AllocCounter::snapshot();
+        double nb = static_cast<double>(ndocs);
+        state.counters["allocs/doc"] =
+            benchmark::Counter(static_cast<double>(end.allocations -
+                                                   start.allocations) / nb,
+                               benchmark::Counter::kAvgIterations);
+        state.counters["bytes/doc"] =
+            benchmark::Counter(static_cast<double>(end.bytes - start.bytes) / nb,
+                               benchmark::Counter::kAvgIterations);
+    }
+}
+
+static void createDataset(void)
+{
+    libcbio_t handle;
+    vector<libcbio_document_t> docs;
+
+    for (int ii = 0; ii < nrecords; ++ii) {
+        stringstream ss;
+        ss << "user" << ii;
+        keys.push_back(ss.str());
+    }
+
+    remove(readfile);
+    check(cbio_open_handle(readfile, CBIO_OPEN_CREATE, &handle),
+          "Failed to create the dataset");
+    for (int ii = 0; ii < nrecords; ++ii) {
+        libcbio_document_t doc;
+        check(cbio_create_empty_document(handle, &doc), "create document");
+        check(cbio_document_set_id(doc, keys[ii].data(), keys[ii].length(), 0),
+              "set id");
+        check(cbio_document_set_value(doc, value.data(), value.length(), 0),
+              "set value");
+        docs.push_back(doc);
+    }
+    check(cbio_store_documents(handle, &docs[0], docs.size()),
+          "store documents");
+    check(cbio_commit(handle), "commit");
+    for (size_t ii = 0; ii < docs.size(); ++ii) {
+        cbio_document_release(docs[ii]);
+    }
+    cbio_close_handle(handle);
+
+    check(couchstore_open_db(readfile, COUCHSTORE_OPEN_FLAG_RDONLY,
+                             &couch_reader), "open dataset");
+    check(cbio_open_handle(readfile, CBIO_OPEN_RDONLY, &cbio_reader),
+          "open dataset");
+}
+
+static void GetInfo_couchstore(benchmark::State &state)
+{
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    size_t next = 0;
+    for (auto _ : state) {
+        const string &key = keys[next++ % keys.size()];
+        DocInfo *info;
+        check(couchstore_docinfo_by_id(couch_reader, key.data(), key.length(),
+                                       &info), "docinfo_by_id");
+        couchstore_free_docinfo(info);
+    }
+    reportAllocations(state, start);
+}
+BENCHMARK(GetInfo_couchstore)->Name("GetInfo/couchstore");
+
+static void GetInfo_libcbio(benchmark::State &state)
+{
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    size_t next = 0;
+    for (auto _ : state) {
+        const string &key = keys[next++ % keys.size()];
+        libcbio_document_t doc;
+        check(cbio_get_document(cbio_reader, key.data(), key.length(), &doc),
+              "get document");
+        cbio_document_release(doc);
+    }
+    reportAllocations(state, start);
+}
+BENCHMARK(GetInfo_libcbio)->Name("GetInfo/libcbio");
+
+static void Get_couchstore(benchmark::State &state)
+{
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    size_t next = 0;
+    for (auto _ : state) {
+        const string &key = keys[next++ % keys.size()];
+        DocInfo *info;
+        Doc *doc;
+        check(couchstore_docinfo_by_id(couch_reader, key.data(), key.length(),
+                                       &info), "docinfo_by_id");
+        check(couchstore_open_doc_with_docinfo(couch_reader, info, &doc,
+                                               DECOMPRESS_DOC_BODIES),
+              "open_doc_with_docinfo");
+        benchmark::DoNotOptimize(doc->data.buf);
+        couchstore_free_document(doc);
+        couchstore_free_docinfo(info);
+    }
+    reportAllocations(state, start);
+}
+BENCHMARK(Get_couchstore)->Name("Get/couchstore");
+
+static void Get_libcbio(benchmark::State &state)
+{
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    size_t next = 0;
+    for (auto _ : state) {
+        const string &key = keys[next++ % keys.size()];
+        libcbio_document_t doc;
+        const void *ptr;
+        size_t nb;
+        check(cbio_get_document(cbio_reader, key.data(), key.length(), &doc),
+              "get document");
+        check(cbio_document_get_value(doc, &ptr, &nb), "get value");
+        benchmark::DoNotOptimize(ptr);
+        cbio_document_release(doc);
+    }
+    reportAllocations(state, start);
+}
+BENCHMARK(Get_libcbio)->Name("Get/libcbio");
+
+/* Arg: the number of documents per store */
+static void Store_couchstore(benchmark::State &state)
+{
+    size_t batch = static_cast<size_t>(state.range(0));
+    vector<Doc> docs(batch);
+    vector<DocInfo> info(batch);
+    vector<Doc *> pdocs(batch);
+    vector<DocInfo *> pinfo(batch);
+    Db *db;
+
+    remove(couchfile);
+    check(couchstore_open_db(couchfile, COUCHSTORE_OPEN_FLAG_CREATE, &db),
+          "create database");
+
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    size_t next = 0;
+    for (auto _ : state) {
+        for (size_t ii = 0; ii < batch; ++ii) {
+            const string &key = keys[next++ % keys.size()];
+            memset(&docs[ii], 0, sizeof(Doc));
+            memset(&info[ii], 0, sizeof(DocInfo));
+            docs[ii].id.buf = info[ii].id.buf = const_cast<char *>(key.data());
+            docs[ii].id.size = info[ii].id.size = key.length();
+            docs[ii].data.buf = const_cast<char *>(value.data());
+            docs[ii].data.size = value.length();
+            pdocs[ii] = &docs[ii];
+            pinfo[ii] = &info[ii];
+        }
+        check(couchstore_save_documents(db, &pdocs[0], &pinfo[0],
+                                        static_cast<unsigned>(batch), 0),
+              "save documents");
+    }
+    reportAllocations(state, start, batch);
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * batch));
+
+    couchstore_close_db(db);
+    remove(couchfile);
+}
+BENCHMARK(Store_couchstore)->Name("Store/couchstore")->Arg(1)->Arg(100);
+
+static void Store_libcbio(benchmark::State &state)
+{
+    size_t batch = static_cast<size_t>(state.range(0));
+    vector<libcbio_document_t> docs(batch);
+    libcbio_t handle;
+
+    remove(cbiofile);
+    check(cbio_open_handle(cbiofile, CBIO_OPEN_CREATE, &handle),
+          "create database");
+
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    size_t next = 0;
+    for (auto _ : state) {
+        for (size_t ii = 0; ii < batch; ++ii) {
+            const string &key = keys[next++ % keys.size()];
+            check(cbio_create_empty_document(handle, &docs[ii]),
+                  "create document");
+            check(cbio_document_set_id(docs[ii], key.data(), key.length(), 0),
+                  "set id");
+            check(cbio_document_set_value(docs[ii], value.data(),
+                                          value.length(), 0),
+                  "set value");
+        }
+        check(cbio_store_documents(handle, &docs[0], batch),
+              "store documents");
+        for (size_t ii = 0; ii < batch; ++ii) {
+            cbio_document_release(docs[ii]);
+        }
+    }
+    reportAllocations(state, start, batch);
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * batch));
+
+    cbio_close_handle(handle);
+    remove(cbiofile);
+}
+BENCHMARK(Store_libcbio)->Name("Store/libcbio")->Arg(1)->Arg(100);
+
+extern "C" {
+    static int couchstore_count(Db *db, DocInfo *info, void *ctx)
+    {
+        (void)db;
+        (void)info;
+        ++*static_cast<size_t *>(ctx);
+        return 0;
+    }
+
+    static int cbio_count(libcbio_t handle, libcbio_document_t doc, void *ctx)
+    {
+        (void)handle;
+        (void)doc;
+        ++*static_cast<size_t *>(ctx);
+        return 0;
+    }
+}
+
+/* Scan the whole dataset */
+static void ChangesSince_couchstore(benchmark::State &state)
+{
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    for (auto _ : state) {
+        size_t count = 0;
+        check(couchstore_changes_since(couch_reader, 0, 0, couchstore_count,
+                                       &count), "changes_since");
+    }
+    reportAllocations(state, start, nrecords);
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                            nrecords);
+}
+BENCHMARK(ChangesSince_couchstore)->Name("ChangesSince/couchstore");
+
+static void ChangesSince_libcbio(benchmark::State &state)
+{
+    AllocCounter::Snapshot start = AllocCounter::snapshot();
+    for (auto _ : state) {
+        size_t count = 0;
+        check(cbio_changes_since(cbio_reader, 0, cbio_count, &count),
+              "changes_since");
+    }
+    reportAllocations(state, start, nrecords);
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                            nrecords);
+}
+BENCHMARK(ChangesSince_libcbio)->Name("ChangesSince/libcbio");
+
+/* Collect the results while printing them as usual */
+class OverheadReporter : public benchmark::ConsoleReporter {
+public:
+    virtual void ReportRuns(const vector<Run> &reports) {
+        for (size_t ii = 0; ii < reports.size(); ++ii) {
+            const Run &run = reports[ii];
+            if (run.run_type != Run::RT_Iteration || run.error_occurred) {
+                continue;
+            }
+            Result &result = results[run.benchmark_name()];
+            result.cpu = run.GetAdjustedCPUTime();
+            benchmark::UserCounters::const_iterator it;
+            it = run.counters.find("allocs/doc");
+            result.allocations = it == run.counters.end() ? 0 : it->second.value;
+        }
+        ConsoleReporter::ReportRuns(reports);
+    }
+
+    struct Result {
+        double cpu;
+        double allocations;
+    };
+
+    map<string, Result> results;
+};
+
+static const OverheadReporter::Result *find(const OverheadReporter &reporter,
+                                            const string &workload,
+                                            const string &library)
+{
+    /* The arguments follow the library in the name */
+    string name = workload;
+    string args;
+    size_t slash = workload.find('/');
+    if (slash != string::npos) {
+        name = workload.substr(0, slash);
+        args = workload.substr(slash);
+    }
+
+    map<string, OverheadReporter::Result>::const_iterator it;
+    it = reporter.results.find(name + "/" + library + args);
+    return it == reporter.results.end() ? NULL : &it->second;
+}
+
+int main(int argc, char **argv)
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return EXIT_FAILURE;
+    }
+
+    createDataset();
+
+    OverheadReporter reporter;
+    benchmark::RunSpecifiedBenchmarks(&reporter);
+
+    couchstore_close_db(couch_reader);
+    cbio_close_handle(cbio_reader);
+    remove(readfile);
+
+    int failed = 0;
+    printf("\n%-16s %16s %16s\n", "Overhead", "allocs/doc", "cpu ratio");
+    for (size_t ii = 0; ii < sizeof(thresholds) / sizeof(thresholds[0]); ++ii) {
+        const Threshold &t = thresholds[ii];
+        const OverheadReporter::Result *couch;
+        const OverheadReporter::Result *cbio;
+        couch = find(reporter, t.workload, "couchstore");
+        cbio = find(reporter, t.workload, "libcbio");
+        if (couch == NULL || cbio == NULL) {
+            /* Filtered out */
+            continue;
+        }
+
+        double allocations = cbio->allocations - couch->allocations;
+        double ratio = cbio->cpu / couch->cpu;
+        /* Both counts are 0 if the allocations can't be counted */
+        bool ok = allocations <= t.allocations + 0.01 && ratio <= t.cpu_ratio;
+        printf("%-16s %8.2f (<= %3.1f) %8.2f (<= %.1f) %s\n", t.workload,
+               allocations, t.allocations, ratio, t.cpu_ratio,
+               ok ? "ok" : "FAILED");
+        if (!ok) {
+            failed = 1;
+        }
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,530 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * cbio_bench loads a database file with a generated dataset and runs
+ * a YCSB style workload against it, measuring the latency of every
+ * operation. The results are written to stdout as a JSON object.
+ */
+#include "config.h"
+
+#include <libcbio/cbio.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "workload.h"
+
+/* The number of documents stored per commit while loading */
+#define BENCH_LOAD_BATCH 1000
+
+struct bench_config {
+    const char *file;
+    const struct workload_mix *mix;
+    uint64_t records;
+    uint64_t operations;
+    size_t value_size;
+    size_t batch_size;
+    unsigned int commit_every;
+    size_t scan_length;
+    int zipfian;
+    uint64_t seed;
+    int load;
+};
+
+struct bench_latency {
+    uint64_t *samples;
+    size_t count;
+    size_t size;
+};
+
+struct bench {
+    struct bench_config config;
+    libcbio_t handle;
+    struct workload_rng rng;
+    struct workload_zipf zipf;
+    uint64_t inserted;
+    char *value;
+
+    /* The stores not yet written */
+    libcbio_document_t *pending;
+    char (*keys)[WORKLOAD_MAX_KEY];
+    size_t npending;
+    unsigned int uncommitted;
+
+    struct bench_latency latency[WORKLOAD_OP_MAX];
+    uint64_t errors[WORKLOAD_OP_MAX];
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_record(struct bench *bench, workload_op_t op,
+                         uint64_t start, cbio_error_t err)
+{
+    struct bench_latency *lat = bench->latency + op;
+    uint64_t elapsed = bench_now() - start;
+
+    if (err != CBIO_SUCCESS) {
+        bench->errors[op]++;
+        return;
+    }
+
+    if (lat->count == lat->size) {
+        size_t size = lat->size == 0 ? 1024 : lat->size * 2;
+        uint64_t *ptr = realloc(lat->samples, size * sizeof(uint64_t));
+        if (ptr == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        lat->samples = ptr;
+        lat->size = size;
+    }
+    lat->samples[lat->count++] = elapsed;
+}
+
+static void bench_check(cbio_error_t err, const char *what)
+{
+    if (err != CBIO_SUCCESS) {
+        fprintf(stderr, "%s: %s\n", what, cbio_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static uint64_t bench_pick_record(struct bench *bench)
+{
+    uint64_t nrecords = bench->config.records + bench->inserted;
+
+    if (bench->config.zipfian) {
+        return workload_zipf_next(&bench->zipf, &bench->rng);
+    }
+    return workload_rng_uniform(&bench->rng, nrecords);
+}
+
+static void bench_flush(struct bench *bench)
+{
+    cbio_error_t err;
+    uint64_t start;
+    size_t ii;
+
+    if (bench->npending == 0) {
+        return;
+    }
+
+    start = bench_now();
+    err = cbio_store_documents(bench->handle, bench->pending,
+                               bench->npending);
+    bench_record(bench, WORKLOAD_OP_STORE, start, err);
+
+    for (ii = 0; ii < bench->npending; ++ii) {
+        cbio_document_release(bench->pending[ii]);
+    }
+    bench->uncommitted += (unsigned int)bench->npending;
+    bench->npending = 0;
+
+    if (bench->uncommitted >= bench->config.commit_every) {
+        start = bench_now();
+        bench_record(bench, WORKLOAD_OP_COMMIT, start,
+                     cbio_commit(bench->handle));
+        bench->uncommitted = 0;
+    }
+}
+
+static void bench_write(struct bench *bench, uint64_t id)
+{
+    libcbio_document_t doc;
+    char *key = bench->keys[bench->npending];
+    size_t nkey = workload_key(bench->config.mix, id, key);
+
+    workload_value(&bench->rng, bench->value, bench->config.value_size);
+    bench_check(cbio_create_empty_document(bench->handle, &doc),
+                "Failed to create document");
+    bench_check(cbio_document_set_id(doc, key, nkey, 0),
+                "Failed to set id");
+    bench_check(cbio_document_set_value(doc, bench->value,
+                                        bench->config.value_size, 1),
+                "Failed to set value");
+
+    bench->pending[bench->npending++] = doc;
+    if (bench->npending == bench->config.batch_size) {
+        bench_flush(bench);
+    }
+}
+
+static void bench_get(struct bench *bench)
+{
+    char key[WORKLOAD_MAX_KEY];
+    size_t nkey = workload_key(bench->config.mix, bench_pick_record(bench),
+                               key);
+    libcbio_document_t doc;
+    const void *ptr;
+    size_t nb;
+    cbio_error_t err;
+    uint64_t start = bench_now();
+
+    err = cbio_get_document(bench->handle, key, nkey, &doc);
+    if (err == CBIO_SUCCESS) {
+        err = cbio_document_get_value(doc, &ptr, &nb);
+        cbio_document_release(doc);
+    }
+    bench_record(bench, WORKLOAD_OP_GET, start, err);
+}
+
+struct bench_scan {
+    size_t rows;
+};
+
+static int bench_scan_callback(libcbio_t handle, libcbio_document_t *docs,
+                               size_t ndocs, void *ctx)
+{
+    struct bench_scan *scan = ctx;
+    (void)handle;
+    (void)docs;
+    scan->rows += ndocs;
+    /* Only the first batch is of interest */
+    return 1;
+}
+
+static void bench_scan(struct bench *bench)
+{
+    uint64_t nrecords = bench->config.records + bench->inserted;
+    uint64_t since = 1 + workload_rng_uniform(&bench->rng, nrecords);
+    size_t length = 1 + (size_t)workload_rng_uniform(&bench->rng,
+                                                     bench->config.scan_length);
+    struct bench_scan scan;
+    uint64_t start = bench_now();
+
+    scan.rows = 0;
+    bench_record(bench, WORKLOAD_OP_SCAN, start,
+                 cbio_changes_since_batch(bench->handle, since, length,
+                                          bench_scan_callback, &scan));
+}
+
+static double bench_seconds(uint64_t ns)
+{
+    return (double)ns / 1000000000.0;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double bench_percentile(struct bench_latency *lat, double p)
+{
+    size_t idx = (size_t)(p * (double)(lat->count - 1) + 0.5);
+    return (double)lat->samples[idx] / 1000.0;
+}
+
+static void bench_report_latency(struct bench *bench)
+{
+    int first = 1;
+    int op;
+
+    printf("  \"latency_us\": {");
+    for (op = 0; op < WORKLOAD_OP_MAX; ++op) {
+        struct bench_latency *lat = bench->latency + op;
+        double total = 0;
+        size_t ii;
+
+        if (lat->count == 0 && bench->errors[op] == 0) {
+            continue;
+        }
+
+        printf("%s\n    \"%s\": {\"count\": %lu, \"errors\": %lu",
+               first ? "" : ",", workload_op_name((workload_op_t)op),
+               (unsigned long)lat->count, (unsigned long)bench->errors[op]);
+        first = 0;
+        if (lat->count == 0) {
+            printf("}");
+            continue;
+        }
+
+        qsort(lat->samples, lat->count, sizeof(uint64_t), bench_compare);
+        for (ii = 0; ii < lat->count; ++ii) {
+            total += (double)lat->samples[ii];
+        }
+        printf(", \"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, "
+               "\"p999\": %.3f, \"max\": %.3f}",
+               total / (double)lat->count / 1000.0,
+               bench_percentile(lat, 0.50), bench_percentile(lat, 0.99),
+               bench_percentile(lat, 0.999),
+               (double)lat->samples[lat->count - 1] / 1000.0);
+    }
+    printf("\n  }\n");
+}
+
+static void bench_load(struct bench *bench)
+{
+    uint64_t id;
+
+    for (id = 0; id < bench->config.records; ++id) {
+        bench_write(bench, id);
+    }
+    bench_flush(bench);
+    if (bench->uncommitted != 0) {
+        bench_check(cbio_commit(bench->handle), "Failed to commit");
+        bench->uncommitted = 0;
+    }
+}
+
+static void bench_run(struct bench *bench)
+{
+    uint64_t ii;
+
+    for (ii = 0; ii < bench->config.operations; ++ii) {
+        switch (workload_next_op(bench->config.mix, &bench->rng)) {
+        case WORKLOAD_OP_GET:
+            bench_get(bench);
+            break;
+        case WORKLOAD_OP_UPDATE:
+            bench_write(bench, bench_pick_record(bench));
+            break;
+        case WORKLOAD_OP_INSERT:
+            bench_write(bench, bench->config.records + bench->inserted++);
+            break;
+        default:
+            bench_scan(bench);
+            break;
+        }
+    }
+
+    bench_flush(bench);
+    if (bench->uncommitted != 0) {
+        uint64_t start = bench_now();
+        bench_record(bench, WORKLOAD_OP_COMMIT, start,
+                     cbio_commit(bench->handle));
+    }
+}
+
+static void usage(void)
+{
+    const struct workload_mix *mix;
+    size_t nmixes;
+    size_t ii;
+
+    fprintf(stderr, "Usage: cbio_bench [options]\n"
+            "  -f file    The database file (default: cbio_bench.couch)\n"
+            "  -w name    The workload to run (default: read-heavy)\n"
+            "  -n count   The number of records (default: 100000)\n"
+            "  -o count   The number of operations (default: 100000)\n"
+            "  -s size    The size of the values (default: 256)\n");
+    fprintf(stderr,
+            "  -b count   Documents per store call (default: 1)\n"
+            "  -c count   Documents per commit (default: 100)\n"
+            "  -l count   The maximum scan length (default: 100)\n"
+            "  -d name    The key distribution, uniform or zipfian\n"
+            "             (default: zipfian)\n");
+    fprintf(stderr,
+            "  -r seed    The random seed (default: 1)\n"
+            "  -L         Run against the existing file without loading\n"
+            "Workloads:");
+    mix = workload_get_mixes(&nmixes);
+    for (ii = 0; ii < nmixes; ++ii) {
+        fprintf(stderr, " %s", mix[ii].name);
+    }
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench bench;
+    cbio_memory_stats_t before;
+    cbio_memory_stats_t after;
+    uint64_t start;
+    uint64_t load_ns = 0;
+    uint64_t run_ns;
+    uint64_t nops;
+    int cmd;
+    int ii;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.config.file = "cbio_bench.couch";
+    bench.config.mix = workload_find_mix("read-heavy");
+    bench.config.records = 100000;
+    bench.config.operations = 100000;
+    bench.config.value_size = 256;
+    bench.config.batch_size = 1;
+    bench.config.commit_every = 100;
+    bench.config.scan_length = 100;
+    bench.config.zipfian = 1;
+    bench.config.seed = 1;
+    bench.config.load = 1;
+
+    while ((cmd = getopt(argc, argv, "f:w:n:o:s:b:c:l:d:r:L")) != -1) {
+        switch (cmd) {
+        case 'f':
+            bench.config.file = optarg;
+            break;
+        case 'w':
+            if ((bench.config.mix = workload_find_mix(optarg)) == NULL) {
+                usage();
+            }
+            break;
+        case 'n':
+            bench.config.records = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            bench.config.operations = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            bench.config.value_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            bench.config.batch_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            bench.config.commit_every = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            bench.config.scan_length = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            if (strcmp(optarg, "uniform") == 0) {
+                bench.config.zipfian = 0;
+            } else if (strcmp(optarg, "zipfian") == 0) {
+                bench.config.zipfian = 1;
+            } else {
+                usage();
+            }
+            break;
+        case 'r':
+            bench.config.seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            bench.config.load = 0;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (bench.config.records == 0 || bench.config.value_size < 16 ||
+        bench.config.batch_size == 0 || bench.config.commit_every == 0 ||
+        bench.config.scan_length == 0) {
+        usage();
+    }
+
+    bench.value = malloc(bench.config.value_size);
+    bench.pending = calloc(bench.config.batch_size, sizeof(libcbio_document_t));
+    bench.keys = calloc(bench.config.batch_size, WORKLOAD_MAX_KEY);
+    if (bench.value == NULL || bench.pending == NULL || bench.keys == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+
+    workload_rng_init(&bench.rng, bench.config.seed);
+    if (bench.config.zipfian) {
+        workload_zipf_init(&bench.zipf, bench.config.records, 0.99);
+    }
+
+    if (bench.config.load) {
+        size_t batch_size = bench.config.batch_size;
+        unsigned int commit_every = bench.config.commit_every;
+
+        if (remove(bench.config.file) == -1 && errno != ENOENT) {
+            fprintf(stderr, "Failed to remove %s: %s\n", bench.config.file,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        bench_check(cbio_open_handle(bench.config.file, CBIO_OPEN_CREATE,
+                                     &bench.handle),
+                    "Failed to create database");
+
+        free(bench.pending);
+        free(bench.keys);
+        bench.config.batch_size = BENCH_LOAD_BATCH;
+        bench.config.commit_every = BENCH_LOAD_BATCH;
+        bench.pending = calloc(BENCH_LOAD_BATCH, sizeof(libcbio_document_t));
+        bench.keys = calloc(BENCH_LOAD_BATCH, WORKLOAD_MAX_KEY);
+        if (bench.pending == NULL || bench.keys == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return EXIT_FAILURE;
+        }
+
+        start = bench_now();
+        bench_load(&bench);
+        load_ns = bench_now() - start;
+
+        /* The load isn't part of the measured workload */
+        for (ii = 0; ii < WORKLOAD_OP_MAX; ++ii) {
+            bench.latency[ii].count = 0;
+            bench.errors[ii] = 0;
+        }
+        bench.config.batch_size = batch_size;
+        bench.config.commit_every = commit_every;
+    } else {
+        bench_check(cbio_open_handle(bench.config.file, CBIO_OPEN_RW,
+                                     &bench.handle),
+                    "Failed to open database");
+    }
+
+    /* The allocations don't depend on the machine, so unlike the
+     * timings they can be compared with any baseline */
+    bench_check(cbio_get_memory_stats(bench.handle, &before),
+                "Failed to get the memory stats");
+    start = bench_now();
+    bench_run(&bench);
+    run_ns = bench_now() - start;
+    bench_check(cbio_get_memory_stats(bench.handle, &after),
+                "Failed to get the memory stats");
+    cbio_close_handle(bench.handle);
+
+    nops = bench.config.operations;
+    printf("{\n");
+    printf("  \"workload\": \"%s\",\n", bench.config.mix->name);
+    printf("  \"records\": %lu,\n", (unsigned long)bench.config.records);
+    printf("  \"operations\": %lu,\n", (unsigned long)nops);
+    printf("  \"value_size\": %lu,\n", (unsigned long)bench.config.value_size);
+    printf("  \"batch_size\": %lu,\n", (unsigned long)bench.config.batch_size);
+    printf("  \"commit_every\": %u,\n", bench.config.commit_every);
+    printf("  \"distribution\": \"%s\",\n",
+           bench.config.zipfian ? "zipfian" : "uniform");
+    printf("  \"seed\": %lu,\n", (unsigned long)bench.config.seed);
+    if (bench.config.load) {
+        printf("  \"load\": {\"seconds\": %.6f, \"ops_per_sec\": %.1f},\n",
+               bench_seconds(load_ns),
+               (double)bench.config.records / bench_seconds(load_ns));
+    }
+    printf("  \"run\": {\"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+           "\"allocs/op\": %.3f},\n",
+           bench_seconds(run_ns), (double)nops / bench_seconds(run_ns),
+           (double)(after.total_allocations - before.total_allocations) /
+           (double)nops);
+    bench_report_latency(&bench);
+    printf("}\n");
+
+    for (ii = 0; ii < WORKLOAD_OP_MAX; ++ii) {
+        free(bench.latency[ii].samples);
+    }
+    free(bench.pending);
+    free(bench.keys);
+    free(bench.value);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,484 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * cbio_gen builds a synthetic database file for testing at scale. The
+ * records are written through cbio_store_documents in large batches,
+ * interleaved with zipfian updates of the records already written
+ * (which leave stale versions behind in the file), and a share of the
+ * records is deleted at the end. The same options and seed always
+ * produce the same documents in the same order.
+ */
+#include "config.h"
+
+#include <libcbio/cbio.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "workload.h"
+
+#define GEN_MAX_BUCKETS 16
+
+/* The values of a batch are kept in an arena of (at least) this size */
+#define GEN_ARENA_SIZE (16 * 1024 * 1024)
+
+/* A bucket of the value size histogram */
+struct gen_bucket {
+    size_t min;
+    size_t max;
+    unsigned int weight;
+};
+
+struct gen_config {
+    const char *file;
+    uint64_t records;
+    struct gen_bucket bucket[GEN_MAX_BUCKETS];
+    int nbuckets;
+    unsigned int fragmentation;
+    unsigned int deletes;
+    unsigned int local;
+    double theta;
+    size_t batch_size;
+    uint64_t commit_every;
+    uint64_t seed;
+};
+
+struct gen {
+    struct gen_config config;
+    libcbio_t handle;
+    struct workload_rng rng;
+    struct workload_zipf zipf;
+    unsigned int total_weight;
+    size_t max_value;
+
+    /* The documents of the current batch */
+    libcbio_document_t *docs;
+    char (*keys)[WORKLOAD_MAX_KEY];
+    size_t ndocs;
+    char *arena;
+    size_t narena;
+    size_t arena_size;
+    uint64_t uncommitted;
+
+    uint64_t written;
+    uint64_t updated;
+    uint64_t deleted;
+    uint64_t local;
+    uint64_t bytes;
+    uint64_t commits;
+};
+
+static uint64_t gen_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void gen_check(cbio_error_t err, const char *what)
+{
+    if (err != CBIO_SUCCESS) {
+        fprintf(stderr, "%s: %s\n", what, cbio_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Parse a value size histogram: a comma separated list of buckets
+ * of the form size[-max][:weight] (the weight defaults to 1).
+ */
+static int gen_parse_histogram(struct gen_config *config, const char *spec)
+{
+    const char *ptr = spec;
+
+    config->nbuckets = 0;
+    while (*ptr != '\0') {
+        struct gen_bucket *bucket;
+        char *end;
+
+        if (config->nbuckets == GEN_MAX_BUCKETS) {
+            return -1;
+        }
+        bucket = config->bucket + config->nbuckets++;
+        bucket->min = strtoul(ptr, &end, 10);
+        bucket->max = bucket->min;
+        bucket->weight = 1;
+        if (end == ptr) {
+            return -1;
+        }
+        ptr = end;
+        if (*ptr == '-') {
+            bucket->max = strtoul(++ptr, &end, 10);
+            if (end == ptr) {
+                return -1;
+            }
+            ptr = end;
+        }
+        if (*ptr == ':') {
+            bucket->weight = (unsigned int)strtoul(++ptr, &end, 10);
+            if (end == ptr) {
+                return -1;
+            }
+            ptr = end;
+        }
+        if (bucket->min < 16 || bucket->max < bucket->min ||
+            bucket->weight == 0) {
+            return -1;
+        }
+        if (*ptr == ',') {
+            ++ptr;
+        } else if (*ptr != '\0') {
+            return -1;
+        }
+    }
+
+    return config->nbuckets == 0 ? -1 : 0;
+}
+
+static size_t gen_value_size(struct gen *gen)
+{
+    unsigned int pick;
+    int ii;
+
+    pick = (unsigned int)workload_rng_uniform(&gen->rng, gen->total_weight);
+    for (ii = 0; ii < gen->config.nbuckets - 1; ++ii) {
+        if (pick < gen->config.bucket[ii].weight) {
+            break;
+        }
+        pick -= gen->config.bucket[ii].weight;
+    }
+
+    return gen->config.bucket[ii].min +
+           (size_t)workload_rng_uniform(&gen->rng,
+                                        gen->config.bucket[ii].max -
+                                        gen->config.bucket[ii].min + 1);
+}
+
+/* Pick the records to be stored as local documents or deleted by id */
+static int gen_select(struct gen *gen, uint64_t id, unsigned int percent,
+                      uint64_t salt)
+{
+    return workload_hash(id ^ gen->config.seed ^ salt) % 100 < percent;
+}
+
+static int gen_is_local(struct gen *gen, uint64_t id)
+{
+    return gen_select(gen, id, gen->config.local, 1);
+}
+
+static size_t gen_key(struct gen *gen, uint64_t id, char *buf)
+{
+    if (gen_is_local(gen, id)) {
+        memcpy(buf, "_local/", 7);
+        return 7 + workload_key(NULL, id, buf + 7);
+    }
+    return workload_key(NULL, id, buf);
+}
+
+static void gen_flush(struct gen *gen)
+{
+    size_t ii;
+
+    if (gen->ndocs == 0) {
+        return;
+    }
+
+    gen_check(cbio_store_documents(gen->handle, gen->docs, gen->ndocs),
+              "Failed to store documents");
+    for (ii = 0; ii < gen->ndocs; ++ii) {
+        cbio_document_reinitialize(gen->docs[ii]);
+    }
+    gen->uncommitted += gen->ndocs;
+    gen->ndocs = 0;
+    gen->narena = 0;
+
+    if (gen->uncommitted >= gen->config.commit_every) {
+        gen_check(cbio_commit(gen->handle), "Failed to commit");
+        gen->uncommitted = 0;
+        gen->commits++;
+    }
+}
+
+/*
+ * Add a document to the batch. The batch is stored when it is full or
+ * when the next value doesn't fit in the arena, as the documents refer
+ * to their values in the arena.
+ */
+static void gen_write(struct gen *gen, uint64_t id, int deleted)
+{
+    libcbio_document_t doc;
+    char *key;
+    size_t nkey;
+    size_t nvalue = deleted ? 0 : gen_value_size(gen);
+
+    if (gen->ndocs == gen->config.batch_size ||
+        gen->narena + nvalue > gen->arena_size) {
+        gen_flush(gen);
+    }
+
+    doc = gen->docs[gen->ndocs];
+    key = gen->keys[gen->ndocs];
+    nkey = gen_key(gen, id, key);
+    gen_check(cbio_document_set_id(doc, key, nkey, 0), "Failed to set id");
+
+    if (deleted) {
+        gen_check(cbio_document_set_deleted(doc, 1),
+                  "Failed to mark document as deleted");
+        gen_check(cbio_document_set_value(doc, "", 0, 0),
+                  "Failed to set value");
+    } else {
+        char *value = gen->arena + gen->narena;
+        workload_value(&gen->rng, value, nvalue);
+        gen_check(cbio_document_set_value(doc, value, nvalue, 0),
+                  "Failed to set value");
+        gen->narena += nvalue;
+        gen->bytes += nvalue;
+    }
+
+    gen->ndocs++;
+}
+
+/*
+ * Write the records in order, and for each record written make (on
+ * average) enough updates of the records written so far to reach the
+ * requested share of stale documents. The updates pick the records
+ * from a zipfian distribution, so a few hot records are rewritten
+ * over and over again as in a real bucket.
+ */
+static void gen_load(struct gen *gen)
+{
+    uint64_t nupdates = 0;
+    uint64_t id;
+
+    if (gen->config.fragmentation > 0) {
+        nupdates = gen->config.records * gen->config.fragmentation /
+                   (100 - gen->config.fragmentation);
+    }
+
+    for (id = 0; id < gen->config.records; ++id) {
+        uint64_t target;
+
+        gen_write(gen, id, 0);
+        gen->written++;
+        if (gen_is_local(gen, id)) {
+            gen->local++;
+        }
+
+        /* The number of updates due after id + 1 records */
+        target = nupdates * (id + 1) / gen->config.records;
+        while (gen->updated < target) {
+            uint64_t pick = workload_zipf_next(&gen->zipf, &gen->rng);
+            gen_write(gen, pick % (id + 1), 0);
+            gen->updated++;
+        }
+    }
+
+    if (gen->config.deletes > 0) {
+        for (id = 0; id < gen->config.records; ++id) {
+            if (gen_select(gen, id, gen->config.deletes, 2)) {
+                gen_write(gen, id, 1);
+                gen->deleted++;
+            }
+        }
+    }
+
+    gen_flush(gen);
+    if (gen->uncommitted != 0) {
+        gen_check(cbio_commit(gen->handle), "Failed to commit");
+        gen->uncommitted = 0;
+        gen->commits++;
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: cbio_gen [options]\n"
+            "  -f file    The database file (default: cbio_gen.couch)\n"
+            "  -n count   The number of records (default: 1000000)\n"
+            "  -s sizes   The value size histogram, a comma separated list\n"
+            "             of size[-max][:weight] (default: 256)\n");
+    fprintf(stderr,
+            "  -F percent The share of the documents written that are\n"
+            "             stale versions of updated records (default: 0)\n"
+            "  -D percent The share of the records deleted (default: 0)\n"
+            "  -l percent The share of the records stored as local\n"
+            "             documents (default: 0)\n");
+    fprintf(stderr,
+            "  -z theta   The skew of the updated records (default: 0.99)\n"
+            "  -b count   Documents per store call (default: 10000)\n"
+            "  -c count   Documents per commit (default: 100000)\n"
+            "  -r seed    The random seed (default: 1)\n");
+    fprintf(stderr, "\nExample: cbio_gen -n 10000000 "
+            "-s 100-500:70,1000-4000:25,65536:5 -F 50 -D 5 -l 1\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct gen gen;
+    struct stat st;
+    double seconds;
+    uint64_t start;
+    size_t ii;
+    int cmd;
+
+    memset(&gen, 0, sizeof(gen));
+    gen.config.file = "cbio_gen.couch";
+    gen.config.records = 1000000;
+    gen.config.theta = 0.99;
+    gen.config.batch_size = 10000;
+    gen.config.commit_every = 100000;
+    gen.config.seed = 1;
+    gen_parse_histogram(&gen.config, "256");
+
+    while ((cmd = getopt(argc, argv, "f:n:s:F:D:l:z:b:c:r:")) != -1) {
+        switch (cmd) {
+        case 'f':
+            gen.config.file = optarg;
+            break;
+        case 'n':
+            gen.config.records = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            if (gen_parse_histogram(&gen.config, optarg) != 0) {
+                fprintf(stderr, "Invalid value size histogram: %s\n", optarg);
+                usage();
+            }
+            break;
+        case 'F':
+            gen.config.fragmentation = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'D':
+            gen.config.deletes = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            gen.config.local = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            gen.config.theta = strtod(optarg, NULL);
+            break;
+        case 'b':
+            gen.config.batch_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            gen.config.commit_every = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            gen.config.seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (gen.config.records == 0 || gen.config.fragmentation > 95 ||
+        gen.config.deletes > 100 || gen.config.local > 100 ||
+        gen.config.theta <= 0 || gen.config.theta >= 1 ||
+        gen.config.batch_size == 0 || gen.config.commit_every == 0) {
+        usage();
+    }
+
+    for (ii = 0; ii < (size_t)gen.config.nbuckets; ++ii) {
+        gen.total_weight += gen.config.bucket[ii].weight;
+        if (gen.config.bucket[ii].max > gen.max_value) {
+            gen.max_value = gen.config.bucket[ii].max;
+        }
+    }
+    gen.arena_size = gen.max_value > GEN_ARENA_SIZE ?
+                     gen.max_value : GEN_ARENA_SIZE;
+
+    gen.docs = calloc(gen.config.batch_size, sizeof(libcbio_document_t));
+    gen.keys = calloc(gen.config.batch_size, WORKLOAD_MAX_KEY);
+    gen.arena = malloc(gen.arena_size);
+    if (gen.docs == NULL || gen.keys == NULL || gen.arena == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+
+    if (remove(gen.config.file) == -1 && errno != ENOENT) {
+        fprintf(stderr, "Failed to remove %s: %s\n", gen.config.file,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+    gen_check(cbio_open_handle(gen.config.file, CBIO_OPEN_CREATE,
+                               &gen.handle),
+              "Failed to create database");
+    for (ii = 0; ii < gen.config.batch_size; ++ii) {
+        gen_check(cbio_create_empty_document(gen.handle, gen.docs + ii),
+                  "Failed to create document");
+    }
+
+    workload_rng_init(&gen.rng, gen.config.seed);
+    workload_zipf_init(&gen.zipf, gen.config.records, gen.config.theta);
+
+    start = gen_now();
+    gen_load(&gen);
+    seconds = (double)(gen_now() - start) / 1000000000.0;
+
+    for (ii = 0; ii < gen.config.batch_size; ++ii) {
+        cbio_document_release(gen.docs[ii]);
+    }
+    cbio_close_handle(gen.handle);
+
+    if (stat(gen.config.file, &st) == -1) {
+        fprintf(stderr, "Failed to stat %s: %s\n", gen.config.file,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    printf("{\n");
+    printf("  \"file\": \"%s\",\n", gen.config.file);
+    printf("  \"records\": %lu,\n", (unsigned long)gen.config.records);
+    printf("  \"value_sizes\": [");
+    for (ii = 0; ii < (size_t)gen.config.nbuckets; ++ii) {
+        printf("%s{\"min\": %lu, \"max\": %lu, \"weight\": %u}",
+               ii == 0 ? "" : ", ",
+               (unsigned long)gen.config.bucket[ii].min,
+               (unsigned long)gen.config.bucket[ii].max,
+               gen.config.bucket[ii].weight);
+    }
+    printf("],\n");
+    printf("  \"fragmentation\": %u,\n", gen.config.fragmentation);
+    printf("  \"deletes\": %u,\n", gen.config.deletes);
+    printf("  \"local\": %u,\n", gen.config.local);
+    printf("  \"seed\": %lu,\n", (unsigned long)gen.config.seed);
+    printf("  \"documents\": {\"inserted\": %lu, \"updated\": %lu, "
+           "\"deleted\": %lu, \"local\": %lu},\n",
+           (unsigned long)gen.written, (unsigned long)gen.updated,
+           (unsigned long)gen.deleted, (unsigned long)gen.local);
+    printf("  \"commits\": %lu,\n", (unsigned long)gen.commits);
+    printf("  \"value_bytes\": %.0f,\n", (double)gen.bytes);
+    printf("  \"file_bytes\": %.0f,\n", (double)st.st_size);
+    printf("  \"seconds\": %.6f,\n", seconds);
+    printf("  \"docs_per_sec\": %.1f,\n",
+           (double)(gen.written + gen.updated + gen.deleted) / seconds);
+    printf("  \"mb_per_sec\": %.1f\n",
+           (double)gen.bytes / (1024.0 * 1024.0) / seconds);
+    printf("}\n");
+
+    free(gen.docs);
+    free(gen.keys);
+    free(gen.arena);
+
+    return EXIT_SUCCESS;
+}
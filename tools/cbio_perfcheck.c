@@ -0,0 +1,584 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * cbio_perfcheck compares the JSON results of cbio_bench or of the
+ * Google Benchmark programs with a baseline. Both files are flattened
+ * into a list of dotted paths (the elements of an array are named by
+ * their "name" member if they have one), and every metric in the
+ * baseline is compared with the same metric in the results:
+ *
+ *   throughput  (ops_per_sec, items_per_second, bytes_per_second)
+ *               fails if it dropped by more than the time tolerance
+ *   latency     (mean, p50, p99, real_time, cpu_time) fails if it
+ *               grew by more than the time tolerance
+ *   allocations (allocs/op, allocs/doc, bytes/op, bytes/doc) fails if
+ *               it grew by more than the allocation tolerance
+ *
+ * The workload parameters at the top level of a cbio_bench result
+ * must match the baseline. The exit status is 0 if nothing regressed,
+ * 1 if something did and 2 if the files couldn't be compared.
+ */
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Allocation counts averaged over the iterations are allowed to wobble */
+#define PERFCHECK_ALLOC_SLACK 0.01
+
+typedef enum {
+    METRIC_IGNORE,
+    METRIC_PARAMETER,
+    METRIC_THROUGHPUT,
+    METRIC_LATENCY,
+    METRIC_ALLOCATIONS
+} metric_kind_t;
+
+struct metric {
+    char *path;
+    char *string;
+    double number;
+};
+
+struct metrics {
+    const char *file;
+    struct metric *items;
+    size_t count;
+    size_t size;
+};
+
+struct parser {
+    struct metrics *metrics;
+    const char *ptr;
+    const char *end;
+};
+
+static const char *throughput_names[] = {
+    "ops_per_sec", "items_per_second", "bytes_per_second", NULL
+};
+
+/* p999 and max are decided by a handful of samples, too noisy to compare */
+static const char *latency_names[] = {
+    "mean", "p50", "p99", "real_time", "cpu_time", NULL
+};
+
+static const char *allocation_names[] = {
+    "allocs/op", "allocs/doc", "bytes/op", "bytes/doc", NULL
+};
+
+static const char *parameter_names[] = {
+    "workload", "records", "operations", "value_size", "batch_size",
+    "commit_every", "distribution", "seed", NULL
+};
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    void *ret = realloc(ptr, size);
+    if (ret == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(2);
+    }
+    return ret;
+}
+
+static char *xstrndup(const char *str, size_t nb)
+{
+    char *ret = xrealloc(NULL, nb + 1);
+    memcpy(ret, str, nb);
+    ret[nb] = '\0';
+    return ret;
+}
+
+static char *read_file(const char *name, size_t *nb)
+{
+    FILE *fp = fopen(name, "rb");
+    char *buffer = NULL;
+    size_t size = 0;
+    size_t nr;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", name, strerror(errno));
+        exit(2);
+    }
+
+    *nb = 0;
+    do {
+        if (*nb == size) {
+            size = size == 0 ? 8192 : size * 2;
+            buffer = xrealloc(buffer, size);
+        }
+        nr = fread(buffer + *nb, 1, size - *nb, fp);
+        *nb += nr;
+    } while (nr > 0);
+
+    if (ferror(fp)) {
+        fprintf(stderr, "Failed to read %s: %s\n", name, strerror(errno));
+        exit(2);
+    }
+    fclose(fp);
+
+    return buffer;
+}
+
+static void metrics_add(struct metrics *metrics, char *path,
+                        char *string, double number)
+{
+    struct metric *metric;
+
+    if (metrics->count == metrics->size) {
+        metrics->size = metrics->size == 0 ? 64 : metrics->size * 2;
+        metrics->items = xrealloc(metrics->items,
+                                  metrics->size * sizeof(struct metric));
+    }
+
+    metric = metrics->items + metrics->count++;
+    metric->path = path;
+    metric->string = string;
+    metric->number = number;
+}
+
+static const struct metric *metrics_find(const struct metrics *metrics,
+                                         const char *path)
+{
+    size_t ii;
+
+    for (ii = 0; ii < metrics->count; ++ii) {
+        if (strcmp(metrics->items[ii].path, path) == 0) {
+            return metrics->items + ii;
+        }
+    }
+
+    return NULL;
+}
+
+static char *path_join(const char *path, const char *name, size_t nb)
+{
+    size_t len = strlen(path);
+    char *ret;
+
+    if (len == 0) {
+        return xstrndup(name, nb);
+    }
+
+    ret = xrealloc(NULL, len + nb + 2);
+    memcpy(ret, path, len);
+    ret[len] = '.';
+    memcpy(ret + len + 1, name, nb);
+    ret[len + nb + 1] = '\0';
+    return ret;
+}
+
+static void parse_error(struct parser *parser, const char *what)
+{
+    fprintf(stderr, "%s: %s\n", parser->metrics->file, what);
+    exit(2);
+}
+
+static void skip_space(struct parser *parser)
+{
+    while (parser->ptr < parser->end &&
+           (*parser->ptr == ' ' || *parser->ptr == '\t' ||
+            *parser->ptr == '\n' || *parser->ptr == '\r')) {
+        ++parser->ptr;
+    }
+}
+
+static int next_char(struct parser *parser)
+{
+    skip_space(parser);
+    if (parser->ptr == parser->end) {
+        parse_error(parser, "Unexpected end of file");
+    }
+    return *parser->ptr;
+}
+
+static void expect(struct parser *parser, char c)
+{
+    if (next_char(parser) != c) {
+        parse_error(parser, "Invalid JSON");
+    }
+    ++parser->ptr;
+}
+
+/* The escapes are kept as is, we only need to compare the strings */
+static char *parse_string(struct parser *parser)
+{
+    const char *start;
+
+    expect(parser, '"');
+    start = parser->ptr;
+    while (parser->ptr < parser->end && *parser->ptr != '"') {
+        if (*parser->ptr == '\\') {
+            ++parser->ptr;
+        }
+        ++parser->ptr;
+    }
+    if (parser->ptr >= parser->end) {
+        parse_error(parser, "Unterminated string");
+    }
+
+    return xstrndup(start, (size_t)(parser->ptr++ - start));
+}
+
+static void parse_value(struct parser *parser, const char *path);
+
+static void parse_object(struct parser *parser, const char *path)
+{
+    expect(parser, '{');
+    if (next_char(parser) == '}') {
+        ++parser->ptr;
+        return;
+    }
+
+    for (;;) {
+        char *name = parse_string(parser);
+        char *child = path_join(path, name, strlen(name));
+        free(name);
+        expect(parser, ':');
+        parse_value(parser, child);
+        free(child);
+
+        if (next_char(parser) == '}') {
+            ++parser->ptr;
+            return;
+        }
+        expect(parser, ',');
+    }
+}
+
+/*
+ * Name the metrics of an array element after its "name" member so
+ * that the benchmarks may be added or reordered
+ */
+static void rename_element(struct metrics *metrics, size_t first,
+                           const char *prefix, const char *path)
+{
+    const struct metric *name = NULL;
+    size_t len = strlen(prefix);
+    size_t ii;
+
+    for (ii = first; ii < metrics->count; ++ii) {
+        const char *suffix = metrics->items[ii].path + len;
+        if (strcmp(suffix, ".name") == 0 && metrics->items[ii].string) {
+            name = metrics->items + ii;
+            break;
+        }
+    }
+
+    if (name == NULL) {
+        return;
+    }
+
+    for (ii = first; ii < metrics->count; ++ii) {
+        char *old = metrics->items[ii].path;
+        char *prefixed = path_join(path, name->string, strlen(name->string));
+        metrics->items[ii].path = path_join(prefixed, old + len + 1,
+                                            strlen(old + len + 1));
+        free(prefixed);
+        free(old);
+    }
+}
+
+static void parse_array(struct parser *parser, const char *path)
+{
+    char index[32];
+    size_t nelem = 0;
+
+    expect(parser, '[');
+    if (next_char(parser) == ']') {
+        ++parser->ptr;
+        return;
+    }
+
+    for (;;) {
+        size_t first = parser->metrics->count;
+        char *child;
+
+        sprintf(index, "%lu", (unsigned long)nelem++);
+        child = path_join(path, index, strlen(index));
+        parse_value(parser, child);
+        rename_element(parser->metrics, first, child, path);
+        free(child);
+
+        if (next_char(parser) == ']') {
+            ++parser->ptr;
+            return;
+        }
+        expect(parser, ',');
+    }
+}
+
+static void parse_value(struct parser *parser, const char *path)
+{
+    int c = next_char(parser);
+    char *end;
+    double number;
+
+    switch (c) {
+    case '{':
+        parse_object(parser, path);
+        break;
+    case '[':
+        parse_array(parser, path);
+        break;
+    case '"':
+        metrics_add(parser->metrics, xstrndup(path, strlen(path)),
+                    parse_string(parser), 0);
+        break;
+    case 't':
+    case 'f':
+    case 'n':
+        while (parser->ptr < parser->end &&
+               *parser->ptr >= 'a' && *parser->ptr <= 'z') {
+            ++parser->ptr;
+        }
+        break;
+    default:
+        /* The file is '\0' terminated so strtod stops in time */
+        number = strtod(parser->ptr, &end);
+        if (end == parser->ptr) {
+            parse_error(parser, "Invalid JSON");
+        }
+        parser->ptr = end;
+        metrics_add(parser->metrics, xstrndup(path, strlen(path)), NULL,
+                    number);
+    }
+}
+
+static void load_metrics(struct metrics *metrics, const char *file)
+{
+    struct parser parser;
+    char *data;
+    size_t nb;
+
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->file = file;
+
+    data = read_file(file, &nb);
+    data = xrealloc(data, nb + 1);
+    data[nb] = '\0';
+
+    parser.metrics = metrics;
+    parser.ptr = data;
+    parser.end = data + nb;
+    parse_value(&parser, "");
+    skip_space(&parser);
+    if (parser.ptr != parser.end) {
+        parse_error(&parser, "Trailing data after the JSON document");
+    }
+
+    free(data);
+}
+
+static void free_metrics(struct metrics *metrics)
+{
+    size_t ii;
+
+    for (ii = 0; ii < metrics->count; ++ii) {
+        free(metrics->items[ii].path);
+        free(metrics->items[ii].string);
+    }
+    free(metrics->items);
+}
+
+static int in_list(const char *name, const char **list)
+{
+    for (; *list != NULL; ++list) {
+        if (strcmp(name, *list) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static metric_kind_t classify(const char *path)
+{
+    const char *name = strrchr(path, '.');
+
+    if (name == NULL) {
+        return in_list(path, parameter_names) ? METRIC_PARAMETER :
+               METRIC_IGNORE;
+    }
+
+    ++name;
+    if (in_list(name, throughput_names)) {
+        return METRIC_THROUGHPUT;
+    }
+    if (in_list(name, latency_names)) {
+        return METRIC_LATENCY;
+    }
+    if (in_list(name, allocation_names)) {
+        return METRIC_ALLOCATIONS;
+    }
+    return METRIC_IGNORE;
+}
+
+static int same_value(const struct metric *a, const struct metric *b)
+{
+    if (a->string == NULL || b->string == NULL) {
+        return a->string == b->string && a->number == b->number;
+    }
+    return strcmp(a->string, b->string) == 0;
+}
+
+/*
+ * Compare the results with the baseline and return the number of
+ * regressions, or -1 if the results are for a different workload
+ */
+static int compare(const struct metrics *baseline,
+                   const struct metrics *results,
+                   double time_tolerance, double alloc_tolerance,
+                   int verbose)
+{
+    int regressions = 0;
+    size_t ii;
+
+    for (ii = 0; ii < baseline->count; ++ii) {
+        const struct metric *base = baseline->items + ii;
+        const struct metric *res = metrics_find(results, base->path);
+        metric_kind_t kind = classify(base->path);
+        const char *status = "ok";
+        double change;
+        double limit;
+        int failed;
+
+        if (kind == METRIC_IGNORE) {
+            continue;
+        }
+
+        if (res == NULL) {
+            printf("%-52s missing from %s\n", base->path, results->file);
+            ++regressions;
+            continue;
+        }
+
+        if (kind == METRIC_PARAMETER) {
+            if (!same_value(base, res)) {
+                fprintf(stderr, "%s differs between %s and %s, "
+                        "the results aren't comparable\n", base->path,
+                        baseline->file, results->file);
+                return -1;
+            }
+            continue;
+        }
+
+        if (kind == METRIC_THROUGHPUT) {
+            limit = base->number * (1.0 - time_tolerance);
+            failed = res->number < limit;
+            if (res->number > base->number * (1.0 + time_tolerance)) {
+                status = "improved";
+            }
+        } else {
+            double tolerance = time_tolerance;
+            limit = base->number * (1.0 + tolerance);
+            if (kind == METRIC_ALLOCATIONS) {
+                tolerance = alloc_tolerance;
+                limit = base->number * (1.0 + tolerance) +
+                        PERFCHECK_ALLOC_SLACK;
+            }
+            failed = res->number > limit;
+            if (res->number < base->number * (1.0 - tolerance)) {
+                status = "improved";
+            }
+        }
+
+        if (failed) {
+            status = "REGRESSED";
+            ++regressions;
+        }
+
+        if (failed || verbose) {
+            change = base->number == 0 ? 0 :
+                     (res->number - base->number) * 100.0 / base->number;
+            printf("%-52s %14.3f %14.3f %+8.1f%% %s\n", base->path,
+                   base->number, res->number, change, status);
+        }
+    }
+
+    for (ii = 0; ii < results->count && verbose; ++ii) {
+        const struct metric *res = results->items + ii;
+        if (classify(res->path) != METRIC_IGNORE &&
+            metrics_find(baseline, res->path) == NULL) {
+            printf("%-52s not in the baseline\n", res->path);
+        }
+    }
+
+    return regressions;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: cbio_perfcheck [options] baseline results\n"
+            "  -t percent  The allowed change in throughput and latency\n"
+            "              (default: 20)\n"
+            "  -a percent  The allowed growth in allocations (default: 5)\n"
+            "  -v          Print every metric, not just the regressions\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct metrics baseline;
+    struct metrics results;
+    double time_tolerance = 0.20;
+    double alloc_tolerance = 0.05;
+    int verbose = 0;
+    int regressions;
+    int cmd;
+
+    while ((cmd = getopt(argc, argv, "t:a:v")) != -1) {
+        switch (cmd) {
+        case 't':
+            time_tolerance = strtod(optarg, NULL) / 100.0;
+            break;
+        case 'a':
+            alloc_tolerance = strtod(optarg, NULL) / 100.0;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 2 || time_tolerance < 0 || alloc_tolerance < 0) {
+        usage();
+    }
+
+    load_metrics(&baseline, argv[optind]);
+    load_metrics(&results, argv[optind + 1]);
+
+    regressions = compare(&baseline, &results, time_tolerance,
+                          alloc_tolerance, verbose);
+    if (regressions > 0) {
+        printf("%s: %d regression%s against %s\n", results.file, regressions,
+               regressions == 1 ? "" : "s", baseline.file);
+    }
+
+    free_metrics(&baseline);
+    free_metrics(&results);
+
+    if (regressions < 0) {
+        return 2;
+    }
+    return regressions == 0 ? EXIT_SUCCESS : 1;
+}
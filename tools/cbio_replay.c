@@ -0,0 +1,628 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * cbio_replay re-executes a trace recorded with cbio_trace_start()
+ * against a copy of the database, either as fast as possible or at
+ * (a multiple of) the speed it was recorded at. The trace only holds
+ * the hashes of the ids, so the ids of the documents in the database
+ * are hashed to map them back, and the documents the trace refers to
+ * which aren't in the database (inserts, misses and local documents)
+ * get a made up id of the recorded size. The values are generated.
+ *
+ * The recorded and the replayed latencies are written to stdout as a
+ * JSON object.
+ */
+#include "config.h"
+
+#include <libcbio/cbio.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "workload.h"
+
+#define REPLAY_NOPS (CBIO_TRACE_CHANGES + 1)
+
+struct replay_key {
+    uint64_t hash;
+    char *id;
+    size_t nid;
+};
+
+/* Open addressing, keyed by the id hash */
+struct replay_keys {
+    struct replay_key *slots;
+    size_t size;
+    size_t count;
+};
+
+struct replay_latency {
+    uint64_t *samples;
+    size_t count;
+    size_t size;
+};
+
+struct replay_stats {
+    struct replay_latency recorded;
+    struct replay_latency replayed;
+    uint64_t errors;
+    /* Operations with another result than when recorded */
+    uint64_t mismatches;
+};
+
+struct replay {
+    libcbio_t handle;
+    struct replay_keys keys;
+    struct workload_rng rng;
+    char *value;
+    size_t value_size;
+    struct replay_stats stats[REPLAY_NOPS];
+};
+
+struct replay_record {
+    cbio_trace_op_t op;
+    cbio_error_t status;
+    uint32_t count;
+    uint64_t start;
+    uint64_t duration;
+    uint64_t arg;
+};
+
+struct replay_entry {
+    uint64_t hash;
+    uint32_t nid;
+    uint32_t nvalue;
+    uint32_t flags;
+};
+
+static const char *op_names[REPLAY_NOPS] = {
+    NULL, "get", "store", "commit", "changes"
+};
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    void *ret = realloc(ptr, size);
+    if (ret == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+static void replay_check(cbio_error_t err, const char *what)
+{
+    if (err != CBIO_SUCCESS) {
+        fprintf(stderr, "%s: %s\n", what, cbio_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static uint64_t replay_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void replay_sleep_until(uint64_t when)
+{
+    uint64_t now = replay_now();
+    struct timespec ts;
+
+    if (when <= now) {
+        return;
+    }
+    ts.tv_sec = (time_t)((when - now) / 1000000000);
+    ts.tv_nsec = (long)((when - now) % 1000000000);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+        /* Sleep for the rest of the time */
+    }
+}
+
+static uint64_t replay_hash(const void *data, size_t nb)
+{
+    const uint8_t *ptr = data;
+    uint64_t hash;
+    size_t ii;
+
+    CBIO_TRACE_HASH_INIT(hash);
+    for (ii = 0; ii < nb; ++ii) {
+        CBIO_TRACE_HASH(hash, ptr[ii]);
+    }
+
+    return hash;
+}
+
+static void replay_latency_add(struct replay_latency *lat, uint64_t ns)
+{
+    if (lat->count == lat->size) {
+        lat->size = lat->size == 0 ? 1024 : lat->size * 2;
+        lat->samples = xrealloc(lat->samples, lat->size * sizeof(uint64_t));
+    }
+    lat->samples[lat->count++] = ns;
+}
+
+static struct replay_key *replay_keys_slot(struct replay_keys *keys,
+                                           uint64_t hash)
+{
+    size_t mask = keys->size - 1;
+    size_t idx = (size_t)hash & mask;
+
+    while (keys->slots[idx].id != NULL && keys->slots[idx].hash != hash) {
+        idx = (idx + 1) & mask;
+    }
+
+    return keys->slots + idx;
+}
+
+static void replay_keys_add(struct replay_keys *keys, uint64_t hash,
+                            const char *id, size_t nid)
+{
+    struct replay_key *slot;
+
+    if (keys->count * 2 >= keys->size) {
+        struct replay_key *old = keys->slots;
+        size_t nold = keys->size;
+        size_t ii;
+
+        keys->size = nold == 0 ? 1024 : nold * 2;
+        keys->slots = xrealloc(NULL, keys->size * sizeof(struct replay_key));
+        memset(keys->slots, 0, keys->size * sizeof(struct replay_key));
+        for (ii = 0; ii < nold; ++ii) {
+            if (old[ii].id != NULL) {
+                *replay_keys_slot(keys, old[ii].hash) = old[ii];
+            }
+        }
+        free(old);
+    }
+
+    slot = replay_keys_slot(keys, hash);
+    if (slot->id == NULL) {
+        slot->hash = hash;
+        slot->id = xrealloc(NULL, nid);
+        memcpy(slot->id, id, nid);
+        slot->nid = nid;
+        ++keys->count;
+    }
+}
+
+static int replay_map_callback(libcbio_t handle, libcbio_document_t doc,
+                               void *ctx)
+{
+    struct replay_keys *keys = ctx;
+    const void *id;
+    size_t nid;
+
+    (void)handle;
+    if (cbio_document_get_id(doc, &id, &nid) == CBIO_SUCCESS) {
+        replay_keys_add(keys, replay_hash(id, nid), id, nid);
+    }
+    return 0;
+}
+
+/*
+ * Get the id for a document in the trace. Ids we don't know are made
+ * up from the hash (padded to the recorded size) and remembered, so a
+ * document stored by the trace is found by the gets that follow.
+ */
+static const struct replay_key *replay_get_key(struct replay *replay,
+                                               const struct replay_entry *e)
+{
+    static const char hex[] = "0123456789abcdef";
+    struct replay_key *slot;
+    char *id;
+    size_t nid = 0;
+    size_t size = e->nid < 32 ? 32 : e->nid;
+    int ii;
+
+    if (replay->keys.size != 0) {
+        slot = replay_keys_slot(&replay->keys, e->hash);
+        if (slot->id != NULL) {
+            return slot;
+        }
+    }
+
+    id = xrealloc(NULL, size);
+    if (e->flags & CBIO_TRACE_LOCAL) {
+        memcpy(id, "_local/", 7);
+        nid = 7;
+    }
+    memcpy(id + nid, "trace-", 6);
+    nid += 6;
+    for (ii = 60; ii >= 0 && nid < size; ii -= 4) {
+        id[nid++] = hex[(e->hash >> ii) & 0xf];
+    }
+    while (nid < e->nid) {
+        id[nid++] = '-';
+    }
+
+    replay_keys_add(&replay->keys, e->hash, id, nid);
+    free(id);
+
+    return replay_keys_slot(&replay->keys, e->hash);
+}
+
+static char *replay_value(struct replay *replay, size_t nb)
+{
+    if (nb > replay->value_size || replay->value == NULL) {
+        replay->value = xrealloc(replay->value, nb + 1);
+        replay->value_size = nb;
+    }
+
+    if (nb >= 16) {
+        workload_value(&replay->rng, replay->value, nb);
+    } else {
+        memset(replay->value, 'x', nb);
+    }
+
+    return replay->value;
+}
+
+static uint32_t get32(const uint8_t *ptr)
+{
+    return (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) |
+           ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static uint64_t get64(const uint8_t *ptr)
+{
+    return (uint64_t)get32(ptr) | ((uint64_t)get32(ptr + 4) << 32);
+}
+
+static int replay_read_record(FILE *fp, struct replay_record *rec)
+{
+    uint8_t buffer[CBIO_TRACE_RECORD_SIZE];
+
+    if (fread(buffer, sizeof(buffer), 1, fp) != 1) {
+        return 0;
+    }
+
+    rec->op = (cbio_trace_op_t)buffer[0];
+    rec->status = (cbio_error_t)buffer[1];
+    rec->count = get32(buffer + 4);
+    rec->start = get64(buffer + 8);
+    rec->duration = get64(buffer + 16);
+    rec->arg = get64(buffer + 24);
+
+    if (rec->op < CBIO_TRACE_GET || rec->op > CBIO_TRACE_CHANGES) {
+        fprintf(stderr, "Invalid record in the trace\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return 1;
+}
+
+static struct replay_entry *replay_read_entries(FILE *fp, uint32_t count)
+{
+    uint8_t buffer[CBIO_TRACE_ENTRY_SIZE];
+    struct replay_entry *entries;
+    uint32_t ii;
+
+    entries = xrealloc(NULL, (count == 0 ? 1 : count) * sizeof(*entries));
+    for (ii = 0; ii < count; ++ii) {
+        if (fread(buffer, sizeof(buffer), 1, fp) != 1) {
+            fprintf(stderr, "Truncated trace\n");
+            exit(EXIT_FAILURE);
+        }
+        entries[ii].hash = get64(buffer);
+        entries[ii].nid = get32(buffer + 8);
+        entries[ii].nvalue = get32(buffer + 12);
+        entries[ii].flags = get32(buffer + 16);
+    }
+
+    return entries;
+}
+
+static cbio_error_t replay_get(struct replay *replay,
+                               const struct replay_entry *entry)
+{
+    const struct replay_key *key = replay_get_key(replay, entry);
+    libcbio_document_t doc;
+    cbio_error_t err;
+
+    err = cbio_get_document(replay->handle, key->id, key->nid, &doc);
+    if (err == CBIO_SUCCESS) {
+        cbio_document_release(doc);
+    }
+    return err;
+}
+
+static cbio_error_t replay_store(struct replay *replay,
+                                 const struct replay_entry *entries,
+                                 uint32_t count)
+{
+    libcbio_document_t *docs;
+    cbio_error_t err;
+    uint32_t ii;
+
+    docs = xrealloc(NULL, (count == 0 ? 1 : count) * sizeof(*docs));
+    for (ii = 0; ii < count; ++ii) {
+        const struct replay_key *key = replay_get_key(replay, entries + ii);
+        const char *value = replay_value(replay, entries[ii].nvalue);
+
+        replay_check(cbio_create_empty_document(replay->handle, docs + ii),
+                     "Failed to create document");
+        replay_check(cbio_document_set_id(docs[ii], key->id, key->nid, 0),
+                     "Failed to set id");
+        /* The value is reused for the next document */
+        replay_check(cbio_document_set_value(docs[ii], value,
+                                             entries[ii].nvalue,
+                                             entries[ii].nvalue > 0),
+                     "Failed to set value");
+        if (entries[ii].flags & CBIO_TRACE_DELETED) {
+            replay_check(cbio_document_set_deleted(docs[ii], 1),
+                         "Failed to delete document");
+        }
+    }
+
+    err = cbio_store_documents(replay->handle, docs, count);
+    for (ii = 0; ii < count; ++ii) {
+        cbio_document_release(docs[ii]);
+    }
+    free(docs);
+
+    return err;
+}
+
+struct replay_scan {
+    size_t rows;
+    size_t wanted;
+};
+
+static int replay_scan_callback(libcbio_t handle, libcbio_document_t *docs,
+                                size_t ndocs, void *ctx)
+{
+    struct replay_scan *scan = ctx;
+    (void)handle;
+    (void)docs;
+    scan->rows += ndocs;
+    return scan->rows >= scan->wanted;
+}
+
+/* Read as many changes as the recorded scan got */
+static cbio_error_t replay_changes(struct replay *replay,
+                                   const struct replay_record *rec)
+{
+    struct replay_scan scan;
+
+    scan.rows = 0;
+    scan.wanted = rec->count;
+    return cbio_changes_since_batch(replay->handle, rec->arg,
+                                    rec->count == 0 ? 1 : rec->count,
+                                    replay_scan_callback, &scan);
+}
+
+static void replay_copy(const char *from, const char *to)
+{
+    FILE *in = fopen(from, "rb");
+    FILE *out;
+    char buffer[65536];
+    size_t nr;
+
+    if (in == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", from, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if ((out = fopen(to, "wb")) == NULL) {
+        fprintf(stderr, "Failed to create %s: %s\n", to, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    while ((nr = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, nr, out) != nr) {
+            fprintf(stderr, "Failed to write %s: %s\n", to, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (ferror(in) || fclose(out) != 0) {
+        fprintf(stderr, "Failed to copy %s to %s\n", from, to);
+        exit(EXIT_FAILURE);
+    }
+    fclose(in);
+}
+
+static int replay_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void replay_report_latency(const char *name,
+                                  struct replay_latency *lat)
+{
+    double total = 0;
+    size_t ii;
+
+    printf("\"%s\": {", name);
+    if (lat->count > 0) {
+        qsort(lat->samples, lat->count, sizeof(uint64_t), replay_compare);
+        for (ii = 0; ii < lat->count; ++ii) {
+            total += (double)lat->samples[ii];
+        }
+        printf("\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f",
+               total / (double)lat->count / 1000.0,
+               (double)lat->samples[(size_t)(0.50 * (double)(lat->count - 1) +
+                                             0.5)] / 1000.0,
+               (double)lat->samples[(size_t)(0.99 * (double)(lat->count - 1) +
+                                             0.5)] / 1000.0,
+               (double)lat->samples[lat->count - 1] / 1000.0);
+    }
+    printf("}");
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: cbio_replay [options] trace database\n"
+            "  -o file    The copy of the database to replay against\n"
+            "             (default: <database>.replay)\n"
+            "  -s speed   Replay at speed times the recorded speed, or\n"
+            "             as fast as possible with 0 (default: 0)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct replay replay;
+    struct replay_record rec;
+    struct replay_entry *entries;
+    uint8_t header[CBIO_TRACE_HEADER_SIZE];
+    const char *database;
+    char *copy = NULL;
+    double speed = 0;
+    uint64_t start;
+    uint64_t last = 0;
+    uint64_t nops = 0;
+    int first = 1;
+    int cmd;
+    int ii;
+    FILE *fp;
+
+    while ((cmd = getopt(argc, argv, "o:s:")) != -1) {
+        switch (cmd) {
+        case 'o':
+            copy = optarg;
+            break;
+        case 's':
+            speed = strtod(optarg, NULL);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 2 || speed < 0) {
+        usage();
+    }
+
+    if ((fp = fopen(argv[optind], "rb")) == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", argv[optind],
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (fread(header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header, CBIO_TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s isn't a libcbio trace\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    database = argv[optind + 1];
+    if (copy == NULL) {
+        copy = xrealloc(NULL, strlen(database) + 8);
+        sprintf(copy, "%s.replay", database);
+    }
+    replay_copy(database, copy);
+
+    memset(&replay, 0, sizeof(replay));
+    workload_rng_init(&replay.rng, 1);
+    replay_check(cbio_open_handle(copy, CBIO_OPEN_RW, &replay.handle),
+                 "Failed to open the copy of the database");
+    replay_check(cbio_changes_since(replay.handle, 0, replay_map_callback,
+                                    &replay.keys),
+                 "Failed to read the ids");
+
+    start = replay_now();
+    while (replay_read_record(fp, &rec)) {
+        struct replay_stats *stats = replay.stats + rec.op;
+        uint32_t count = 0;
+        uint64_t begin;
+        cbio_error_t err;
+
+        if (rec.op == CBIO_TRACE_GET || rec.op == CBIO_TRACE_STORE) {
+            count = rec.count;
+        }
+        entries = replay_read_entries(fp, count);
+
+        if (speed > 0) {
+            replay_sleep_until(start + (uint64_t)((double)rec.start / speed));
+        }
+
+        begin = replay_now();
+        switch (rec.op) {
+        case CBIO_TRACE_GET:
+            err = count == 0 ? CBIO_ERROR_EINVAL :
+                  replay_get(&replay, entries);
+            break;
+        case CBIO_TRACE_STORE:
+            err = replay_store(&replay, entries, count);
+            break;
+        case CBIO_TRACE_COMMIT:
+            err = cbio_commit(replay.handle);
+            break;
+        default:
+            err = replay_changes(&replay, &rec);
+        }
+        last = replay_now();
+        free(entries);
+
+        replay_latency_add(&stats->recorded, rec.duration);
+        replay_latency_add(&stats->replayed, last - begin);
+        if (err != CBIO_SUCCESS) {
+            ++stats->errors;
+        }
+        if (err != rec.status) {
+            ++stats->mismatches;
+        }
+        ++nops;
+    }
+    fclose(fp);
+    cbio_close_handle(replay.handle);
+
+    printf("{\n");
+    printf("  \"trace\": \"%s\",\n", argv[optind]);
+    printf("  \"operations\": %lu,\n", (unsigned long)nops);
+    printf("  \"speed\": %.3f,\n", speed);
+    printf("  \"run\": {\"seconds\": %.6f, \"ops_per_sec\": %.1f},\n",
+           (double)(last - start) / 1000000000.0,
+           (double)nops * 1000000000.0 /
+           (double)(last > start ? last - start : 1));
+    printf("  \"latency_us\": {");
+    for (ii = CBIO_TRACE_GET; ii < REPLAY_NOPS; ++ii) {
+        struct replay_stats *stats = replay.stats + ii;
+        if (stats->recorded.count == 0) {
+            continue;
+        }
+        printf("%s\n    \"%s\": {\"count\": %lu, \"errors\": %lu, "
+               "\"mismatches\": %lu,\n      ", first ? "" : ",", op_names[ii],
+               (unsigned long)stats->recorded.count,
+               (unsigned long)stats->errors,
+               (unsigned long)stats->mismatches);
+        replay_report_latency("recorded", &stats->recorded);
+        printf(",\n      ");
+        replay_report_latency("replayed", &stats->replayed);
+        printf("}");
+        first = 0;
+        free(stats->recorded.samples);
+        free(stats->replayed.samples);
+    }
+    printf("\n  }\n}\n");
+
+    for (cmd = 0; (size_t)cmd < replay.keys.size; ++cmd) {
+        free(replay.keys.slots[cmd].id);
+    }
+    free(replay.keys.slots);
+    free(replay.value);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,195 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "workload.h"
+
+#include <math.h>
+#include <string.h>
+
+/* C89 doesn't have 64 bit integer constants */
+#define U64(hi, lo) (((uint64_t)(hi) << 32) | (uint64_t)(lo))
+
+/*
+ * The mixes follow the YCSB core workloads where they apply: A is
+ * update-heavy, B read-heavy, C read-only, D read-latest (insert
+ * with reads) and E scan.
+ */
+static const struct workload_mix mixes[] = {
+    { "update-heavy", 50, 50, 0, 0, 0 },
+    { "read-heavy", 95, 5, 0, 0, 0 },
+    { "read-only", 100, 0, 0, 0, 0 },
+    { "read-insert", 95, 0, 5, 0, 0 },
+    { "scan", 0, 0, 5, 95, 0 },
+    { "insert-only", 0, 0, 100, 0, 0 },
+    { "local", 50, 50, 0, 0, 1 }
+};
+
+static const char *op_names[WORKLOAD_OP_MAX] = {
+    "get", "update", "insert", "scan", "store", "commit"
+};
+
+const struct workload_mix *workload_find_mix(const char *name)
+{
+    size_t ii;
+
+    for (ii = 0; ii < sizeof(mixes) / sizeof(mixes[0]); ++ii) {
+        if (strcmp(mixes[ii].name, name) == 0) {
+            return mixes + ii;
+        }
+    }
+
+    return NULL;
+}
+
+const struct workload_mix *workload_get_mixes(size_t *nmixes)
+{
+    *nmixes = sizeof(mixes) / sizeof(mixes[0]);
+    return mixes;
+}
+
+const char *workload_op_name(workload_op_t op)
+{
+    return op_names[op];
+}
+
+workload_op_t workload_next_op(const struct workload_mix *mix,
+                               struct workload_rng *rng)
+{
+    int pick = (int)workload_rng_uniform(rng, 100);
+
+    if ((pick -= mix->get) < 0) {
+        return WORKLOAD_OP_GET;
+    }
+    if ((pick -= mix->update) < 0) {
+        return WORKLOAD_OP_UPDATE;
+    }
+    if ((pick -= mix->insert) < 0) {
+        return WORKLOAD_OP_INSERT;
+    }
+    return WORKLOAD_OP_SCAN;
+}
+
+/* splitmix64 to seed, xorshift64* to generate */
+void workload_rng_init(struct workload_rng *rng, uint64_t seed)
+{
+    rng->state = workload_hash(seed);
+    if (rng->state == 0) {
+        rng->state = U64(0x9e3779b9, 0x7f4a7c15);
+    }
+}
+
+uint64_t workload_rng_next(struct workload_rng *rng)
+{
+    uint64_t x = rng->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng->state = x;
+    return x * U64(0x2545f491, 0x4f6cdd1d);
+}
+
+uint64_t workload_rng_uniform(struct workload_rng *rng, uint64_t n)
+{
+    return n == 0 ? 0 : workload_rng_next(rng) % n;
+}
+
+static double workload_rng_double(struct workload_rng *rng)
+{
+    return (double)(workload_rng_next(rng) >> 11) / 9007199254740992.0;
+}
+
+uint64_t workload_hash(uint64_t val)
+{
+    val += U64(0x9e3779b9, 0x7f4a7c15);
+    val = (val ^ (val >> 30)) * U64(0xbf58476d, 0x1ce4e5b9);
+    val = (val ^ (val >> 27)) * U64(0x94d049bb, 0x133111eb);
+    return val ^ (val >> 31);
+}
+
+/* Gray et al, "Quickly generating billion-record synthetic databases" */
+void workload_zipf_init(struct workload_zipf *zipf, uint64_t n, double theta)
+{
+    double zeta2 = 1.0 + pow(0.5, theta);
+    uint64_t ii;
+
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->zetan = 0;
+    for (ii = 1; ii <= n; ++ii) {
+        zipf->zetan += 1.0 / pow((double)ii, theta);
+    }
+    zipf->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) /
+                (1.0 - zeta2 / zipf->zetan);
+}
+
+uint64_t workload_zipf_next(struct workload_zipf *zipf,
+                            struct workload_rng *rng)
+{
+    double u = workload_rng_double(rng);
+    double uz = u * zipf->zetan;
+    uint64_t ret;
+
+    if (uz < 1.0) {
+        ret = 0;
+    } else if (uz < 1.0 + pow(0.5, zipf->theta)) {
+        ret = 1;
+    } else {
+        ret = (uint64_t)((double)zipf->n *
+                         pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+    }
+
+    /* Scramble so that the popular records aren't next to each other */
+    return workload_hash(ret) % zipf->n;
+}
+
+size_t workload_key(const struct workload_mix *mix, uint64_t id, char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    uint64_t hash = workload_hash(id);
+    size_t nb = 0;
+    int ii;
+
+    if (mix != NULL && mix->local && (id & 1) == 1) {
+        memcpy(buf, "_local/", 7);
+        nb = 7;
+    }
+
+    memcpy(buf + nb, "user", 4);
+    nb += 4;
+    for (ii = 60; ii >= 0; ii -= 4) {
+        buf[nb++] = hex[(hash >> ii) & 0xf];
+    }
+    buf[nb] = '\0';
+
+    return nb;
+}
+
+void workload_value(struct workload_rng *rng, char *buf, size_t nb)
+{
+    static const char alnum[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    size_t ii;
+    size_t end;
+
+    memcpy(buf, "{\"field0\":\"", 11);
+    end = nb - 2;
+    for (ii = 11; ii < end; ++ii) {
+        buf[ii] = alnum[workload_rng_next(rng) % (sizeof(alnum) - 1)];
+    }
+    buf[end] = '"';
+    buf[end + 1] = '}';
+}
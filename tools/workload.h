@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Workload generation shared by the tools: deterministic random
+ * numbers, key popularity distributions, the key and value format,
+ * and the YCSB style operation mixes.
+ */
+#ifndef LIBCBIO_TOOLS_WORKLOAD_H
+#define LIBCBIO_TOOLS_WORKLOAD_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The largest key generated by workload_key (including the '\0') */
+#define WORKLOAD_MAX_KEY 32
+
+typedef enum {
+    WORKLOAD_OP_GET,
+    WORKLOAD_OP_UPDATE,
+    WORKLOAD_OP_INSERT,
+    WORKLOAD_OP_SCAN,
+    /* A call to store the pending updates and inserts */
+    WORKLOAD_OP_STORE,
+    WORKLOAD_OP_COMMIT,
+    WORKLOAD_OP_MAX
+} workload_op_t;
+
+/*
+ * The proportion (in percent) of each operation. A local mix stores
+ * every other key as a local document.
+ */
+struct workload_mix {
+    const char *name;
+    int get;
+    int update;
+    int insert;
+    int scan;
+    int local;
+};
+
+struct workload_rng {
+    uint64_t state;
+};
+
+/* A (scrambled) zipfian distribution over [0, n) */
+struct workload_zipf {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+const struct workload_mix *workload_find_mix(const char *name);
+const struct workload_mix *workload_get_mixes(size_t *nmixes);
+const char *workload_op_name(workload_op_t op);
+workload_op_t workload_next_op(const struct workload_mix *mix,
+                               struct workload_rng *rng);
+
+void workload_rng_init(struct workload_rng *rng, uint64_t seed);
+uint64_t workload_rng_next(struct workload_rng *rng);
+uint64_t workload_rng_uniform(struct workload_rng *rng, uint64_t n);
+
+void workload_zipf_init(struct workload_zipf *zipf, uint64_t n, double theta);
+uint64_t workload_zipf_next(struct workload_zipf *zipf,
+                            struct workload_rng *rng);
+
+uint64_t workload_hash(uint64_t val);
+
+/*
+ * Format the key for record `id` into buf (at least WORKLOAD_MAX_KEY
+ * bytes) and return its length. The record ids are hashed so that
+ * the keys are inserted in random order.
+ */
+size_t workload_key(const struct workload_mix *mix, uint64_t id, char *buf);
+
+/* Fill buf with a JSON document of exactly nb bytes (nb >= 16) */
+void workload_value(struct workload_rng *rng, char *buf, size_t nb);
+
+#endif